@@ -0,0 +1,159 @@
+/**
+ * @file    benchAsyncDCSAM.cpp
+ * @brief   Front-end latency and throughput of AsyncDCSAM vs. DCSAM
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "dcsam/AsyncDCSAM.h"
+#include "dcsam/DCMixtureFactor.h"
+#include "dcsam/DCSAM.h"
+#include "dcsam/DiscretePriorFactor.h"
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+const size_t kNumSteps = 1000;
+const size_t kCardinality = 2;
+
+// Time between consecutive batches from the simulated front-end.
+const std::chrono::microseconds kSensorPeriod(500);
+
+double ElapsedMs(const Clock::time_point &start, const Clock::time_point &end) {
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/*
+ * The batch produced by the front-end at step `t`: odometry from the previous
+ * pose and a measurement of the pose that is either an inlier or an outlier,
+ * as selected by a binary discrete variable.
+ */
+void MakeBatch(size_t t, dcsam::HybridFactorGraph *hfg,
+               gtsam::Values *initialGuess,
+               dcsam::DiscreteValues *initialGuessDiscrete) {
+  gtsam::Symbol xt('x', t);
+  gtsam::DiscreteKey dt(gtsam::Symbol('d', t), kCardinality);
+  auto odomNoise = gtsam::noiseModel::Isotropic::Sigma(1, 0.1);
+  auto inlierNoise = gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  auto outlierNoise = gtsam::noiseModel::Isotropic::Sigma(1, 50.0);
+
+  if (t == 0) {
+    hfg->push_nonlinear(gtsam::PriorFactor<double>(xt, 0.0, odomNoise));
+  } else {
+    hfg->push_nonlinear(gtsam::BetweenFactor<double>(gtsam::Symbol('x', t - 1),
+                                                     xt, 1.0, odomNoise));
+  }
+
+  // Every tenth measurement is corrupted.
+  const double z = (t % 10 == 9) ? t + 20.0 : static_cast<double>(t);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(xt, z, inlierNoise),
+      gtsam::PriorFactor<double>(xt, z, outlierNoise)};
+  hfg->push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{xt}, dt, components));
+  hfg->push_discrete(dcsam::DiscretePriorFactor(dt, {0.9, 0.1}));
+
+  initialGuess->insert(xt, static_cast<double>(t));
+  (*initialGuessDiscrete)[dt.first] = 0;
+}
+
+struct Stats {
+  double meanMs = 0.0;
+  double maxMs = 0.0;
+};
+
+Stats Summarize(const std::vector<double> &samples) {
+  Stats stats;
+  for (const double s : samples) {
+    stats.meanMs += s / samples.size();
+    stats.maxMs = std::max(stats.maxMs, s);
+  }
+  return stats;
+}
+
+}  // namespace
+
+/*
+ * Simulates a front-end that produces a new batch of factors every
+ * `kSensorPeriod`. In the synchronous case, the front-end calls DCSAM::update
+ * itself and is blocked for the duration of each solve. In the asynchronous
+ * case it only enqueues the batch, and the solver catches up in the
+ * background, coalescing batches that arrive during a solve.
+ *
+ * We report the time the front-end is blocked per batch (latency), the total
+ * time to incorporate all batches (throughput), and for the asynchronous case
+ * how many updates were needed and how far behind the published estimate was
+ * on average.
+ */
+int main() {
+  std::vector<double> syncLatency, asyncLatency, asyncLag;
+
+  // Synchronous: the front-end runs the solver inline.
+  auto syncStart = Clock::now();
+  {
+    dcsam::DCSAM dcsam;
+    auto next = Clock::now();
+    for (size_t t = 0; t < kNumSteps; t++) {
+      std::this_thread::sleep_until(next);
+      next += kSensorPeriod;
+      dcsam::HybridFactorGraph hfg;
+      gtsam::Values initialGuess;
+      dcsam::DiscreteValues initialGuessDiscrete;
+      MakeBatch(t, &hfg, &initialGuess, &initialGuessDiscrete);
+
+      auto start = Clock::now();
+      dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+      syncLatency.push_back(ElapsedMs(start, Clock::now()));
+    }
+  }
+  const double syncTotal = ElapsedMs(syncStart, Clock::now());
+
+  // Asynchronous: the front-end only enqueues.
+  auto asyncStart = Clock::now();
+  size_t numUpdates = 0;
+  {
+    dcsam::AsyncDCSAM async;
+    auto next = Clock::now();
+    for (size_t t = 0; t < kNumSteps; t++) {
+      std::this_thread::sleep_until(next);
+      next += kSensorPeriod;
+      dcsam::HybridFactorGraph hfg;
+      gtsam::Values initialGuess;
+      dcsam::DiscreteValues initialGuessDiscrete;
+      MakeBatch(t, &hfg, &initialGuess, &initialGuessDiscrete);
+
+      auto start = Clock::now();
+      const size_t enqueued =
+          async.enqueue(hfg, initialGuess, initialGuessDiscrete);
+      asyncLatency.push_back(ElapsedMs(start, Clock::now()));
+      asyncLag.push_back(enqueued - async.estimate()->batches);
+    }
+    async.flush();
+    numUpdates = async.numUpdates();
+  }
+  const double asyncTotal = ElapsedMs(asyncStart, Clock::now());
+
+  const Stats sync = Summarize(syncLatency), async = Summarize(asyncLatency);
+  double meanLag = 0.0;
+  for (const double lag : asyncLag) meanLag += lag / asyncLag.size();
+
+  std::printf("%6s %16s %16s %12s %10s %10s\n", "mode", "mean block (ms)",
+              "max block (ms)", "total (ms)", "updates", "mean lag");
+  std::printf("%6s %16.4f %16.4f %12.2f %10zu %10s\n", "sync", sync.meanMs,
+              sync.maxMs, syncTotal, kNumSteps, "0");
+  std::printf("%6s %16.4f %16.4f %12.2f %10zu %10.2f\n", "async", async.meanMs,
+              async.maxMs, asyncTotal, numUpdates, meanLag);
+  return 0;
+}
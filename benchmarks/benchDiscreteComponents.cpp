@@ -0,0 +1,151 @@
+/**
+ * @file    benchDiscreteComponents.cpp
+ * @brief   Serial vs. parallel solves of many independent discrete components
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/discrete/DiscreteFactorGraph.h>
+#include <gtsam/inference/Symbol.h>
+
+#include <algorithm>
+#include <boost/make_shared.hpp>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "dcsam/DiscreteISAM.h"
+#include "dcsam/DiscretePriorFactor.h"
+#include "dcsam/ThreadPool.h"
+
+namespace {
+
+const size_t kNumLandmarks = 5000;
+const size_t kNumClasses = 10;
+const size_t kNumSteps = 20;
+
+/*
+ * A semantic observation of landmark `l`: a binary variable for whether the
+ * detection is valid, coupled to the landmark class. A valid detection
+ * favors `observedClass`; an invalid one is uninformative.
+ */
+void AddObservation(size_t l, size_t obs, size_t observedClass,
+                    gtsam::DiscreteFactorGraph *graph) {
+  gtsam::DiscreteKey cl(gtsam::Symbol('c', l), kNumClasses);
+  gtsam::DiscreteKey vo(gtsam::Symbol('v', l * 1000 + obs), 2);
+  std::vector<double> table;
+  for (size_t c = 0; c < kNumClasses; c++) {
+    // Rows are indexed by the class, columns by validity.
+    table.push_back(0.1);
+    table.push_back((c == observedClass) ? 0.9 : 0.01);
+  }
+  graph->push_back(
+      boost::make_shared<gtsam::DecisionTreeFactor>(cl & vo, table));
+  graph->push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+      vo, std::vector<double>{0.2, 0.8}));
+}
+
+// Mean time per update (in ms) of a single-threaded solver and of one using
+// `pool`, and the mean number of components solved per update.
+struct Timing {
+  double serialMs = 0.0;
+  double pooledMs = 0.0;
+  double components = 0.0;
+};
+
+/*
+ * Time `kNumSteps` updates, each observing `observationsPerStep` random
+ * landmarks, with fresh solvers.
+ */
+Timing Run(size_t observationsPerStep,
+           const dcsam::ThreadPool::shared_ptr &pool) {
+  dcsam::DiscreteISAM serial, pooled(pool);
+
+  // Every landmark starts with a single observation.
+  std::mt19937 rng(0);
+  std::uniform_int_distribution<size_t> landmark(0, kNumLandmarks - 1);
+  std::uniform_int_distribution<size_t> label(0, kNumClasses - 1);
+  std::vector<size_t> observations(kNumLandmarks, 1);
+  gtsam::DiscreteFactorGraph initial;
+  for (size_t l = 0; l < kNumLandmarks; l++) {
+    AddObservation(l, 0, l % kNumClasses, &initial);
+  }
+  serial.update(initial);
+  pooled.update(initial);
+
+  Timing timing;
+  for (size_t t = 0; t < kNumSteps; t++) {
+    gtsam::DiscreteFactorGraph newFactors;
+    for (size_t i = 0; i < observationsPerStep; i++) {
+      const size_t l = landmark(rng);
+      // Mostly consistent labels, with the occasional misdetection.
+      const size_t c = (label(rng) == 0) ? label(rng) : l % kNumClasses;
+      AddObservation(l, observations[l]++, c, &newFactors);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    serial.update(newFactors);
+    auto mid = std::chrono::steady_clock::now();
+    dcsam::DiscreteISAMResult result = pooled.update(newFactors);
+    auto end = std::chrono::steady_clock::now();
+
+    timing.serialMs +=
+        std::chrono::duration<double, std::milli>(mid - start).count();
+    timing.pooledMs +=
+        std::chrono::duration<double, std::milli>(end - mid).count();
+    timing.components += result.componentsSolved;
+  }
+  timing.serialMs /= kNumSteps;
+  timing.pooledMs /= kNumSteps;
+  timing.components /= kNumSteps;
+  return timing;
+}
+
+}  // namespace
+
+/*
+ * Simulates semantic SLAM with thousands of landmarks, each of which forms
+ * its own small connected component of the discrete graph (the class variable
+ * and a validity variable per observation). At each step a batch of
+ * observations of random landmarks arrives, touching one component per
+ * observed landmark.
+ *
+ * We time DiscreteISAM::update with a single thread and with a thread pool
+ * using every available core, over a range of batch sizes. Both only re-solve
+ * the touched components; the pool additionally solves them concurrently,
+ * which only pays off once there are enough components to amortize waking
+ * the threads. We report the smallest batch from which the pool is faster.
+ */
+int main() {
+  const size_t numThreads =
+      std::max<size_t>(2, std::thread::hardware_concurrency());
+  auto pool = boost::make_shared<dcsam::ThreadPool>(numThreads);
+  std::printf("%zu landmarks, %zu threads\n", kNumLandmarks, pool->size());
+
+  std::printf("%12s %12s %14s %14s %9s\n", "observations", "components",
+              "serial (ms)", "pooled (ms)", "speedup");
+  size_t crossover = 0;
+  for (size_t observationsPerStep = 1; observationsPerStep <= 2048;
+       observationsPerStep *= 2) {
+    const Timing timing = Run(observationsPerStep, pool);
+    const double speedup = timing.serialMs / timing.pooledMs;
+    std::printf("%12zu %12.1f %14.4f %14.4f %8.2fx\n", observationsPerStep,
+                timing.components, timing.serialMs, timing.pooledMs, speedup);
+    if (speedup > 1.0) {
+      if (crossover == 0) crossover = observationsPerStep;
+    } else {
+      crossover = 0;
+    }
+  }
+  if (crossover > 0) {
+    std::printf("crossover: pooled is faster from %zu observations per step\n",
+                crossover);
+  } else {
+    std::printf("crossover: pooled is not faster at any batch size tried\n");
+  }
+  return 0;
+}
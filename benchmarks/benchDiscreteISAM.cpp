@@ -0,0 +1,83 @@
+/**
+ * @file    benchDiscreteISAM.cpp
+ * @brief   Per-update cost of incremental vs. batch discrete inference
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/discrete/DiscreteFactorGraph.h>
+#include <gtsam/inference/Symbol.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "dcsam/DiscreteISAM.h"
+#include "dcsam/DiscretePriorFactor.h"
+
+/*
+ * Simulates a long mission in which a new semantic landmark is observed at
+ * every step. Each landmark class variable gets a prior, and consecutive
+ * landmarks are coupled by a pairwise "co-occurrence" factor, so the discrete
+ * graph is a single connected chain that grows by one variable per update.
+ *
+ * For each update we time DiscreteISAM::update against a full batch solve of
+ * the same accumulated graph with DiscreteFactorGraph::optimize. The
+ * incremental time should stay flat as the graph grows while the batch time
+ * grows linearly.
+ */
+int main() {
+  const size_t numSteps = 2000;
+  const size_t reportEvery = 200;
+  const size_t cardinality = 5;
+
+  // Pairwise factor favoring equal classes for consecutive landmarks.
+  std::vector<double> pairwise;
+  for (size_t i = 0; i < cardinality; i++) {
+    for (size_t j = 0; j < cardinality; j++) {
+      pairwise.push_back((i == j) ? 0.6 : 0.1);
+    }
+  }
+
+  gtsam::DiscreteFactorGraph batch;
+  dcsam::DiscreteISAM isam;
+
+  double incrementalTotal = 0.0, batchTotal = 0.0;
+  std::printf("%8s %18s %18s\n", "step", "incremental (ms)", "batch (ms)");
+  for (size_t t = 0; t < numSteps; t++) {
+    gtsam::DiscreteFactorGraph newFactors;
+    gtsam::DiscreteKey lt(gtsam::Symbol('l', t), cardinality);
+
+    std::vector<double> probs(cardinality, 0.1 / (cardinality - 1));
+    probs[t % cardinality] = 0.9;
+    newFactors.push_back(
+        boost::make_shared<dcsam::DiscretePriorFactor>(lt, probs));
+    if (t > 0) {
+      gtsam::DiscreteKey ls(gtsam::Symbol('l', t - 1), cardinality);
+      newFactors.push_back(
+          boost::make_shared<gtsam::DecisionTreeFactor>(ls & lt, pairwise));
+    }
+    for (const auto &factor : newFactors) batch.push_back(factor);
+
+    auto start = std::chrono::steady_clock::now();
+    isam.update(newFactors);
+    auto mid = std::chrono::steady_clock::now();
+    batch.optimize();
+    auto end = std::chrono::steady_clock::now();
+
+    const double incrementalMs =
+        std::chrono::duration<double, std::milli>(mid - start).count();
+    const double batchMs =
+        std::chrono::duration<double, std::milli>(end - mid).count();
+    incrementalTotal += incrementalMs;
+    batchTotal += batchMs;
+
+    if ((t + 1) % reportEvery == 0) {
+      std::printf("%8zu %18.4f %18.4f\n", t + 1, incrementalMs, batchMs);
+    }
+  }
+  std::printf("%8s %18.2f %18.2f\n", "total", incrementalTotal, batchTotal);
+  return 0;
+}
@@ -0,0 +1,142 @@
+/**
+ * @file    benchEMLinearize.cpp
+ * @brief   Graph-based vs. fused Jacobian stacking in DCEMFactor::linearize
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <gtsam/geometry/Point2.h>
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/linear/GaussianFactorGraph.h>
+#include <gtsam/linear/JacobianFactor.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "dcsam/DCEMFactor.h"
+#include "dcsam/SemanticBearingRangeFactor.h"
+
+// Count every heap allocation made by the process.
+namespace {
+std::atomic<size_t> numAllocations(0);
+}  // namespace
+
+void *operator new(size_t size) {
+  numAllocations++;
+  if (void *p = std::malloc(size == 0 ? 1 : size)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+const size_t kRepetitions = 2000;
+
+using SBRFactor =
+    dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>;
+
+// The previous DCEMFactor::linearize: reweight a copy of each component's
+// [A b] and combine them through a temporary GaussianFactorGraph.
+boost::shared_ptr<gtsam::GaussianFactor> GraphLinearize(
+    const dcsam::DCEMFactor<SBRFactor> &factor,
+    const std::vector<SBRFactor> &components, const gtsam::Values &values,
+    const dcsam::DiscreteValues &discreteVals) {
+  std::vector<double> errors =
+      factor.computeComponentLogProbs(values, discreteVals);
+  std::vector<double> componentWeights = dcsam::expNormalize(errors);
+  gtsam::GaussianFactorGraph gfg;
+  for (size_t i = 0; i < components.size(); i++) {
+    boost::shared_ptr<gtsam::GaussianFactor> gf =
+        components[i].linearize(values, discreteVals);
+    gtsam::JacobianFactor jf_component(*gf);
+    gtsam::VerticalBlockMatrix Ab = jf_component.matrixObject();
+    gtsam::VerticalBlockMatrix Ab_weighted = Ab;
+    double sqrt_weight = sqrt(componentWeights[i]);
+    for (size_t k = 0; k < Ab_weighted.nBlocks(); k++) {
+      Ab_weighted(k) = sqrt_weight * Ab(k);
+    }
+    gtsam::JacobianFactor jf(components[i].keys(), Ab_weighted);
+    gfg.add(jf);
+  }
+  return boost::make_shared<gtsam::JacobianFactor>(gfg);
+}
+
+}  // namespace
+
+/*
+ * Linearizes a DCEMFactor over the data association of one bearing-range
+ * measurement to each of `numCandidates` landmarks, once as DCEMFactor used
+ * to (by way of a GaussianFactorGraph) and once with the current, fused
+ * implementation. We alternate between two linearization points, so that
+ * DCEMFactor can't reuse its memoized component linearizations. We report the
+ * mean time and number of heap allocations per linearization, and check that
+ * both give the same factor.
+ */
+int main() {
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(2, 0.1);
+  gtsam::Symbol x0('x', 0);
+
+  std::printf("%12s %12s %12s %14s %14s %10s\n", "candidates", "graph (us)",
+              "fused (us)", "graph allocs", "fused allocs", "speedup");
+  for (size_t numCandidates : {2, 4, 8, 16, 32}) {
+    gtsam::Values values;
+    values.insert(x0, gtsam::Pose2());
+    gtsam::KeyVector keys{x0};
+    gtsam::DiscreteKeys discreteKeys;
+    dcsam::DiscreteValues discreteVals;
+    std::vector<SBRFactor> components;
+    for (size_t i = 0; i < numCandidates; i++) {
+      gtsam::Symbol l('l', i);
+      gtsam::DiscreteKey c(gtsam::Symbol('c', i), 2);
+      values.insert(l, gtsam::Point2(1.0 + 0.1 * i, 0.2 * i));
+      keys.push_back(l);
+      discreteKeys.push_back(c);
+      discreteVals[c.first] = 0;
+      components.emplace_back(x0, l, c, std::vector<double>{0.7, 0.3},
+                              gtsam::Rot2(), 1.0, noise);
+    }
+    dcsam::DCEMFactor<SBRFactor> factor(keys, discreteKeys, components,
+                                        false);
+    gtsam::Values perturbed = values;
+    perturbed.update(x0, gtsam::Pose2(0.01, 0.0, 0.0));
+    const gtsam::Values *points[2] = {&values, &perturbed};
+
+    // Both should give the same factor.
+    const bool same = GraphLinearize(factor, components, values, discreteVals)
+                          ->equals(*factor.linearize(values, discreteVals));
+
+    const size_t allocsStart = numAllocations;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < kRepetitions; r++) {
+      GraphLinearize(factor, components, *points[r % 2], discreteVals);
+    }
+    auto mid = std::chrono::steady_clock::now();
+    const size_t allocsMid = numAllocations;
+    for (size_t r = 0; r < kRepetitions; r++) {
+      factor.linearize(*points[r % 2], discreteVals);
+    }
+    auto end = std::chrono::steady_clock::now();
+    const size_t allocsEnd = numAllocations;
+
+    const double graphUs =
+        std::chrono::duration<double, std::micro>(mid - start).count() /
+        kRepetitions;
+    const double fusedUs =
+        std::chrono::duration<double, std::micro>(end - mid).count() /
+        kRepetitions;
+    std::printf("%12zu %12.2f %12.2f %14.1f %14.1f %9.1fx%s\n", numCandidates,
+                graphUs, fusedUs,
+                static_cast<double>(allocsMid - allocsStart) / kRepetitions,
+                static_cast<double>(allocsEnd - allocsMid) / kRepetitions,
+                graphUs / fusedUs, same ? "" : " (mismatch!)");
+  }
+  return 0;
+}
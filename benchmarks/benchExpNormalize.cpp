@@ -0,0 +1,106 @@
+/**
+ * @file    benchExpNormalize.cpp
+ * @brief   Allocating vs. in-place normalization of log probabilities
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "dcsam/DCSAM_utils.h"
+
+namespace {
+
+const size_t kTotalValues = 1 << 22;
+
+// The previous implementation of dcsam::expNormalize: three scalar passes,
+// two allocations and a normalization check.
+std::vector<double> Reference(const std::vector<double> &logProbs) {
+  std::vector<double> cleanLogProbs;
+  double maxLogProb = -std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < logProbs.size(); i++) {
+    double logProb = (!std::isnan(logProbs[i]))
+                         ? logProbs[i]
+                         : -std::numeric_limits<double>::infinity();
+    if ((logProb != std::numeric_limits<double>::infinity()) &&
+        logProb > maxLogProb) {
+      maxLogProb = logProb;
+    }
+    cleanLogProbs.push_back(logProb);
+  }
+  double total = 0.0;
+  for (size_t i = 0; i < cleanLogProbs.size(); i++) {
+    total += exp(cleanLogProbs[i] - maxLogProb);
+  }
+  double logTotal = log(total);
+  double checkNormalization = 0.0;
+  std::vector<double> probs;
+  for (size_t i = 0; i < cleanLogProbs.size(); i++) {
+    double prob = exp(cleanLogProbs[i] - maxLogProb - logTotal);
+    probs.push_back(prob);
+    checkNormalization += prob;
+  }
+  if (!gtsam::fpEqual(checkNormalization, 1.0, 1e-9)) {
+    throw std::logic_error("Reference failed to normalize probabilities.");
+  }
+  return probs;
+}
+
+}  // namespace
+
+/*
+ * Normalizes batches of random log probabilities of a range of sizes (from the
+ * handful of components of a DCEMFactor to large discrete variables), with
+ * the previous implementation of dcsam::expNormalize, the current one (a
+ * wrapper that copies its input) and the in-place kernel
+ * dcsam::expNormalizeInPlace. Every size normalizes the same total number of
+ * values, and we report the mean time per call.
+ */
+int main() {
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> uniform(-50.0, 0.0);
+
+  std::printf("%8s %16s %16s %16s %10s\n", "size", "reference (ns)",
+              "wrapper (ns)", "in-place (ns)", "speedup");
+  for (size_t size : {2, 4, 8, 16, 64, 256, 1024}) {
+    const size_t calls = kTotalValues / size;
+    std::vector<double> logProbs(size), buffer(size);
+    for (double &l : logProbs) l = uniform(rng);
+
+    // Accumulate a value from each result so the work can't be skipped.
+    double checksum = 0.0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t c = 0; c < calls; c++) {
+      checksum += Reference(logProbs)[c % size];
+    }
+    auto mid = std::chrono::steady_clock::now();
+    for (size_t c = 0; c < calls; c++) {
+      checksum -= dcsam::expNormalize(logProbs)[c % size];
+    }
+    auto mid2 = std::chrono::steady_clock::now();
+    for (size_t c = 0; c < calls; c++) {
+      buffer = logProbs;
+      dcsam::expNormalizeInPlace(buffer.data(), size);
+      checksum += buffer[c % size];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    const double referenceNs =
+        std::chrono::duration<double, std::nano>(mid - start).count() / calls;
+    const double wrapperNs =
+        std::chrono::duration<double, std::nano>(mid2 - mid).count() / calls;
+    const double inPlaceNs =
+        std::chrono::duration<double, std::nano>(end - mid2).count() / calls;
+    std::printf("%8zu %16.2f %16.2f %16.2f %9.1fx (checksum %g)\n", size,
+                referenceNs, wrapperNs, inPlaceNs, referenceNs / inPlaceNs,
+                checksum);
+  }
+  return 0;
+}
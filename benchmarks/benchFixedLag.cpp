@@ -0,0 +1,122 @@
+/**
+ * @file    benchFixedLag.cpp
+ * @brief   Long-run latency and memory of DCFixedLagSmoother
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "dcsam/DCFixedLagSmoother.h"
+#include "dcsam/DCMixtureFactor.h"
+#include "dcsam/DiscretePriorFactor.h"
+
+namespace {
+
+// Resident set size of this process in MB (Linux only; 0 elsewhere).
+double ResidentMB() {
+  long pages = 0, resident = 0;
+  FILE *statm = std::fopen("/proc/self/statm", "r");
+  if (!statm) return 0.0;
+  if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  std::fclose(statm);
+  return resident * 4096.0 / (1024.0 * 1024.0);
+}
+
+}  // namespace
+
+/*
+ * Simulates an hour-long run at 5 Hz (18000 steps). At every step a new pose
+ * is added with odometry from the previous one, along with a measurement of
+ * the pose that may be an outlier, as selected by a binary discrete variable
+ * with a prior. Every 50 steps the current pose is also related to the pose
+ * 20 steps earlier by a "loop closure" of unknown validity.
+ *
+ * With a 10 s window, the number of variables in the solver is bounded, so
+ * the per-update time, the size of the factor graphs and the memory use
+ * should all level off after the first window rather than growing over the
+ * run.
+ */
+int main() {
+  const size_t numSteps = 18000;
+  const size_t reportEvery = 1800;
+  const double dt = 0.2, lag = 10.0;
+
+  auto odomNoise = gtsam::noiseModel::Isotropic::Sigma(1, 0.1);
+  auto inlierNoise = gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  auto outlierNoise = gtsam::noiseModel::Isotropic::Sigma(1, 50.0);
+
+  dcsam::DCFixedLagSmoother smoother(lag);
+
+  double intervalTotal = 0.0, intervalMax = 0.0;
+  std::printf("%8s %14s %14s %12s %12s %10s\n", "step", "mean upd (ms)",
+              "max upd (ms)", "continuous", "discrete", "RSS (MB)");
+  for (size_t t = 0; t < numSteps; t++) {
+    dcsam::HybridFactorGraph hfg;
+    gtsam::Values initialGuess;
+    dcsam::DiscreteValues initialGuessDiscrete;
+    dcsam::DCFixedLagSmoother::KeyTimestampMap timestamps;
+
+    gtsam::Symbol xt('x', t);
+    gtsam::DiscreteKey mt(gtsam::Symbol('m', t), 2);
+    if (t == 0) {
+      hfg.push_nonlinear(gtsam::PriorFactor<double>(xt, 0.0, odomNoise));
+    } else {
+      hfg.push_nonlinear(gtsam::BetweenFactor<double>(
+          gtsam::Symbol('x', t - 1), xt, 1.0, odomNoise));
+    }
+
+    const double z = (t % 10 == 9) ? t + 20.0 : static_cast<double>(t);
+    std::vector<gtsam::PriorFactor<double>> measurement{
+        gtsam::PriorFactor<double>(xt, z, inlierNoise),
+        gtsam::PriorFactor<double>(xt, z, outlierNoise)};
+    hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+        gtsam::KeyVector{xt}, mt, measurement));
+    hfg.push_discrete(dcsam::DiscretePriorFactor(mt, {0.9, 0.1}));
+    initialGuessDiscrete[mt.first] = 0;
+    timestamps[mt.first] = t * dt;
+
+    if (t >= 20 && t % 50 == 0) {
+      gtsam::Symbol xs('x', t - 20);
+      gtsam::DiscreteKey lt(gtsam::Symbol('l', t), 2);
+      std::vector<gtsam::BetweenFactor<double>> loop{
+          gtsam::BetweenFactor<double>(xs, xt, 20.0, inlierNoise),
+          gtsam::BetweenFactor<double>(xs, xt, 20.0, outlierNoise)};
+      hfg.push_dc(dcsam::DCMixtureFactor<gtsam::BetweenFactor<double>>(
+          gtsam::KeyVector{xs, xt}, lt, loop));
+      hfg.push_discrete(dcsam::DiscretePriorFactor(lt, {0.5, 0.5}));
+      initialGuessDiscrete[lt.first] = 0;
+      timestamps[lt.first] = t * dt;
+    }
+
+    initialGuess.insert(xt, static_cast<double>(t));
+    timestamps[xt] = t * dt;
+
+    auto start = std::chrono::steady_clock::now();
+    smoother.update(hfg, initialGuess, initialGuessDiscrete, timestamps);
+    const double ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    intervalTotal += ms;
+    intervalMax = std::max(intervalMax, ms);
+
+    if ((t + 1) % reportEvery == 0) {
+      const dcsam::DCSAM &solver = smoother.solver();
+      std::printf("%8zu %14.4f %14.4f %12zu %12zu %10.1f\n", t + 1,
+                  intervalTotal / reportEvery, intervalMax,
+                  solver.getNonlinearFactorGraph().nrFactors(),
+                  solver.getDiscreteFactorGraph().nrFactors(), ResidentMB());
+      intervalTotal = 0.0;
+      intervalMax = 0.0;
+    }
+  }
+  return 0;
+}
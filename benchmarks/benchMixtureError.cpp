@@ -0,0 +1,122 @@
+/**
+ * @file    benchMixtureError.cpp
+ * @brief   Per-call vs. precomputed normalizing constants in mixture errors
+ * @author  Kevin Doherty
+ *
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include <gtsam/geometry/Pose2.h>
+#include <gtsam/geometry/Pose3.h>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/nonlinear/Values.h>
+#include <gtsam/slam/BetweenFactor.h>
+
+#include <boost/make_shared.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "dcsam/DCMixtureFactor.h"
+
+namespace {
+
+const size_t kCalls = 200000;
+
+// The negative log normalizing constant as DCFactor used to compute it on
+// every call: copy the factor to the heap, cast it, and take the determinant
+// of its information matrix.
+template <typename NonlinearFactorType>
+double LegacyLogNormalizingConstant(const NonlinearFactorType &factor) {
+  gtsam::Matrix infoMat;
+  boost::shared_ptr<NonlinearFactorType> fPtr =
+      boost::make_shared<NonlinearFactorType>(factor);
+  boost::shared_ptr<gtsam::NoiseModelFactor> noiseModelFactor =
+      boost::dynamic_pointer_cast<gtsam::NoiseModelFactor>(fPtr);
+  if (noiseModelFactor) {
+    boost::shared_ptr<gtsam::noiseModel::Gaussian> gaussianNoiseModel =
+        boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(
+            noiseModelFactor->noiseModel());
+    infoMat = gaussianNoiseModel->information();
+  }
+  return (factor.dim() * log(2.0 * M_PI) / 2.0) -
+         (log(infoMat.determinant()) / 2.0);
+}
+
+/*
+ * Times `kCalls` evaluations of the error of a DCMixtureFactor with
+ * `numComponents` BetweenFactor<PoseType> components (each with a full
+ * covariance), once as before (component error plus the legacy constant) and
+ * once with DCMixtureFactor::error, which uses the constants computed at
+ * construction.
+ */
+template <typename PoseType>
+void Run(const char *name, size_t numComponents, const PoseType &measured,
+         const gtsam::Matrix &covariance) {
+  gtsam::Symbol x0('x', 0), x1('x', 1);
+  gtsam::DiscreteKey dk(gtsam::Symbol('d', 0), numComponents);
+  std::vector<gtsam::BetweenFactor<PoseType>> components;
+  for (size_t i = 0; i < numComponents; i++) {
+    components.emplace_back(
+        x0, x1, measured,
+        gtsam::noiseModel::Gaussian::Covariance((i + 1.0) * covariance));
+  }
+  dcsam::DCMixtureFactor<gtsam::BetweenFactor<PoseType>> mixture(
+      gtsam::KeyVector{x0, x1}, dk, components);
+
+  gtsam::Values values;
+  values.insert(x0, PoseType());
+  values.insert(x1, measured);
+  dcsam::DiscreteValues discreteVals;
+
+  // Accumulate the errors so the work can't be skipped.
+  double before = 0.0, after = 0.0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t c = 0; c < kCalls; c++) {
+    const size_t i = c % numComponents;
+    before += components[i].error(values) +
+              LegacyLogNormalizingConstant(components[i]);
+  }
+  auto mid = std::chrono::steady_clock::now();
+  for (size_t c = 0; c < kCalls; c++) {
+    discreteVals[dk.first] = c % numComponents;
+    after += mixture.error(values, discreteVals);
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  const double beforeNs =
+      std::chrono::duration<double, std::nano>(mid - start).count() / kCalls;
+  const double afterNs =
+      std::chrono::duration<double, std::nano>(end - mid).count() / kCalls;
+  std::printf("%8s %12zu %14.1f %14.1f %9.1fx%s\n", name, numComponents,
+              beforeNs, afterNs, beforeNs / afterNs,
+              (std::abs(before - after) > 1e-6 * std::abs(before))
+                  ? " (mismatch!)"
+                  : "");
+}
+
+}  // namespace
+
+/*
+ * Measures the throughput of DCMixtureFactor::error for unnormalized mixtures
+ * of 2D and 3D pose measurements, before and after precomputing each
+ * component's log normalizing constant. We report the mean time per call.
+ */
+int main() {
+  gtsam::Matrix cov2 = gtsam::Matrix::Identity(3, 3) * 0.1;
+  cov2(0, 1) = cov2(1, 0) = 0.05;
+  gtsam::Matrix cov3 = gtsam::Matrix::Identity(6, 6) * 0.1;
+  cov3(3, 4) = cov3(4, 3) = 0.05;
+
+  std::printf("%8s %12s %14s %14s %10s\n", "pose", "components",
+              "before (ns)", "after (ns)", "speedup");
+  for (size_t numComponents : {2, 4, 8}) {
+    Run("Pose2", numComponents, gtsam::Pose2(1.0, 0.5, 0.1), cov2);
+    Run("Pose3", numComponents,
+        gtsam::Pose3(gtsam::Rot3::Ypr(0.1, 0.0, 0.0),
+                     gtsam::Point3(1.0, 0.5, 0.0)),
+        cov3);
+  }
+  return 0;
+}
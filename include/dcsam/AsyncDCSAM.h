@@ -0,0 +1,138 @@
+/**
+ * @file AsyncDCSAM.h
+ * @brief Asynchronous front-end for DCSAM with a background solver thread
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/nonlinear/Values.h>
+
+#include <boost/shared_ptr.hpp>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "dcsam/DCSAM.h"
+#include "dcsam/DCSAM_types.h"
+#include "dcsam/HybridFactorGraph.h"
+
+namespace dcsam {
+
+/**
+ * @brief A consistent view of the solver state published by AsyncDCSAM after
+ * each update.
+ */
+struct DCEstimateSnapshot {
+  // Estimate of the continuous and discrete variables.
+  DCValues estimate;
+
+  // Number of enqueued batches reflected in `estimate`.
+  size_t batches = 0;
+
+  // Result of the DCSAM update that produced `estimate`.
+  DCSAMUpdateResult result;
+};
+
+/**
+ * @brief Wraps a DCSAM instance in a background worker thread so that callers
+ * (e.g. a perception front-end) never block on a solve.
+ *
+ * Batches of factors are pushed onto a queue with `enqueue`. Whenever the
+ * worker is free, it takes *all* queued batches, merges them into a single
+ * HybridFactorGraph and initial guess, and issues one `DCSAM::update`. This
+ * way a slow solve does not build up a backlog of updates: everything that
+ * arrived in the meantime is handled together in the next one.
+ *
+ * After each update the worker publishes a DCEstimateSnapshot. `estimate`
+ * returns the latest snapshot without touching the solver, so readers never
+ * wait on a solve in progress.
+ *
+ * The underlying DCSAM instance is only ever accessed from the worker thread.
+ */
+class AsyncDCSAM {
+ public:
+  using SnapshotPtr = boost::shared_ptr<const DCEstimateSnapshot>;
+
+  explicit AsyncDCSAM(const DCSAMParams &params = DCSAMParams());
+
+  /**
+   * Stops the worker thread once it has finished any update in progress.
+   * Batches still in the queue are discarded; call `flush` first to process
+   * them.
+   */
+  ~AsyncDCSAM();
+
+  AsyncDCSAM(const AsyncDCSAM &) = delete;
+  AsyncDCSAM &operator=(const AsyncDCSAM &) = delete;
+
+  /**
+   * Queue a batch of factors (and initial guesses for any new variables) to be
+   * added to the solver. Returns immediately.
+   *
+   * If a previous update failed in the worker thread, the exception it threw
+   * is rethrown here (and the batch is not queued).
+   *
+   * @param hfg - the factors to add.
+   * @param initialGuessContinuous - initial guess for new continuous variables.
+   * @param initialGuessDiscrete - initial guess for new discrete variables.
+   * @return the number of batches enqueued so far, including this one.
+   */
+  size_t enqueue(const HybridFactorGraph &hfg,
+                 const gtsam::Values &initialGuessContinuous = gtsam::Values(),
+                 const DiscreteValues &initialGuessDiscrete = DiscreteValues());
+
+  /**
+   * Block until every batch enqueued so far has been added to the solver.
+   * Rethrows any exception thrown by an update in the worker thread.
+   */
+  void flush();
+
+  /**
+   * @return the latest published snapshot, or an empty snapshot (with
+   * `batches == 0`) if no update has completed yet.
+   */
+  SnapshotPtr estimate() const;
+
+  /**
+   * @return the number of calls made to `DCSAM::update` so far. When batches
+   * are coalesced, this is less than the number of batches enqueued.
+   */
+  size_t numUpdates() const;
+
+ private:
+  struct Batch {
+    HybridFactorGraph graph;
+    gtsam::Values initialGuessContinuous;
+    DiscreteValues initialGuessDiscrete;
+  };
+
+  // Main loop of the worker thread.
+  void run();
+
+  DCSAM dcsam_;
+
+  // Batches waiting to be processed, guarded by `queueMutex_`. `idle_` is
+  // signalled whenever the worker finishes an update.
+  mutable std::mutex queueMutex_;
+  std::condition_variable pending_;
+  std::condition_variable idle_;
+  std::deque<Batch> queue_;
+  size_t batchesEnqueued_ = 0;
+  size_t batchesProcessed_ = 0;
+  size_t numUpdates_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+
+  // Latest snapshot. Only the pointer swap is guarded, never a solve.
+  mutable std::mutex snapshotMutex_;
+  SnapshotPtr snapshot_;
+
+  // Declared last so that it starts after everything above is initialized.
+  std::thread worker_;
+};
+
+}  // namespace dcsam
@@ -0,0 +1,123 @@
+/**
+ *
+ * @file ContinuousStateStore.h
+ * @brief Versioned continuous values shared between DCDiscreteFactors
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/base/Value.h>
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include <atomic>
+#include <boost/shared_ptr.hpp>
+
+namespace dcsam {
+
+/**
+ * @brief A single copy of the continuous values seen by the discrete side of
+ * the problem.
+ *
+ * Rather than each DCDiscreteFactor holding its own copy of the values for
+ * its continuous keys, all of the DCDiscreteFactors in a DCSAM instance read
+ * from one shared store, so memory scales with the number of continuous
+ * variables rather than with the number of factors.
+ *
+ * Each key carries a version number that is bumped whenever its value is
+ * changed, so that consumers can cheaply tell whether anything they depend on
+ * has changed since they last looked. Versions are never reused, even across
+ * stores, so the versions of a set of keys identify their values exactly.
+ */
+class ContinuousStateStore {
+ public:
+  using shared_ptr = boost::shared_ptr<ContinuousStateStore>;
+
+  ContinuousStateStore() = default;
+
+  /**
+   * Set the value for `key`. If `key` is already in the store, the value is
+   * only replaced if it has moved by more than `threshold` (in the infinity
+   * norm of its local coordinates), or if it changed at all when `threshold`
+   * is 0.
+   *
+   * @param key - the continuous variable to set
+   * @param value - its latest value
+   * @param threshold - minimum change required to replace an existing value
+   * @return true if the stored value changed.
+   */
+  bool update(const gtsam::Key key, const gtsam::Value &value,
+              double threshold = 0.0) {
+    if (!values_.exists(key)) {
+      values_.insert(key, value);
+    } else {
+      const gtsam::Value &stored = values_.at(key);
+      if (threshold > 0.0) {
+        gtsam::Vector dx = stored.localCoordinates_(value);
+        if (dx.lpNorm<Eigen::Infinity>() <= threshold) return false;
+      } else if (stored.equals_(value, 0.0)) {
+        return false;
+      }
+      values_.update(key, value);
+    }
+    versions_[key] = version_ = nextVersion();
+    return true;
+  }
+
+  /**
+   * Remove `key` from the store, e.g. once no factor depends on it.
+   *
+   * @param key - the continuous variable to remove
+   */
+  void erase(const gtsam::Key key) {
+    if (!values_.exists(key)) return;
+    values_.erase(key);
+    versions_.erase(key);
+    version_ = nextVersion();
+  }
+
+  /**
+   * @return true if a value has been set for `key`.
+   */
+  bool exists(const gtsam::Key key) const { return values_.exists(key); }
+
+  /**
+   * @return all of the stored values.
+   */
+  const gtsam::Values &values() const { return values_; }
+
+  /**
+   * @return the latest version of the store, which increases every time any
+   * value changes.
+   */
+  size_t version() const { return version_; }
+
+  /**
+   * @return the version at which the value for `key` last changed, or 0 if it
+   * is not in the store.
+   */
+  size_t version(const gtsam::Key key) const {
+    auto it = versions_.find(key);
+    return (it == versions_.end()) ? 0 : it->second;
+  }
+
+  /**
+   * @return the number of continuous variables in the store.
+   */
+  size_t size() const { return values_.size(); }
+
+ private:
+  // The next version of any store.
+  static size_t nextVersion() {
+    static std::atomic<size_t> latest(0);
+    return ++latest;
+  }
+
+  gtsam::Values values_;
+  gtsam::FastMap<gtsam::Key, size_t> versions_;
+  size_t version_ = 0;
+};
+
+}  // namespace dcsam
@@ -18,6 +18,7 @@
 #include <memory>
 #include <vector>
 
+#include "ContinuousStateStore.h"
 #include "DCFactor.h"
 #include "DCSAM_types.h"
 
@@ -35,39 +36,55 @@ namespace dcsam {
  * stored discrete value assignment matches the most recent estimate for
  * discrete variables.
  *
+ * If it is given the ContinuousStateStore read by the DCDiscreteFactor wrapping
+ * the same DCFactor, evaluations at the stored values go through the
+ * DCFactor's memo, which the DCDiscreteFactor may share (see
+ * `DCFactor::cachedError`).
+ *
  * The discrete analogue is DCDiscreteFactor.
  */
 class DCContinuousFactor : public gtsam::NonlinearFactor {
  private:
   gtsam::DiscreteKeys discreteKeys_;
   boost::shared_ptr<DCFactor> dcfactor_;
+  ContinuousStateStore::shared_ptr continuousState_;
   DiscreteValues discreteVals_;
 
  public:
   using Base = gtsam::NonlinearFactor;
 
-  DCContinuousFactor() = default;
-
-  explicit DCContinuousFactor(boost::shared_ptr<DCFactor> dcfactor)
-      : discreteKeys_(dcfactor->discreteKeys()), dcfactor_(dcfactor) {
+  DCContinuousFactor()
+      : continuousState_(boost::make_shared<ContinuousStateStore>()) {}
+
+  explicit DCContinuousFactor(boost::shared_ptr<DCFactor> dcfactor,
+                              ContinuousStateStore::shared_ptr continuousState =
+                                  ContinuousStateStore::shared_ptr())
+      : discreteKeys_(dcfactor->discreteKeys()),
+        dcfactor_(dcfactor),
+        continuousState_(continuousState
+                             ? continuousState
+                             : boost::make_shared<ContinuousStateStore>()) {
     keys_ = dcfactor->keys();
   }
 
   double error(const gtsam::Values& continuousVals) const override {
     assert(allInitialized());
-    return dcfactor_->error(continuousVals, discreteVals_);
+    return dcfactor_->cachedError(continuousVals, discreteVals_,
+                                  *continuousState_);
   }
 
   boost::shared_ptr<gtsam::GaussianFactor> linearize(
       const gtsam::Values& continuousVals) const override {
     assert(allInitialized());
-    return dcfactor_->linearize(continuousVals, discreteVals_);
+    return dcfactor_->cachedLinearize(continuousVals, discreteVals_,
+                                      *continuousState_);
   }
 
   DCContinuousFactor& operator=(const DCContinuousFactor& rhs) {
     Base::operator=(rhs);
     discreteKeys_ = rhs.discreteKeys_;
     dcfactor_ = rhs.dcfactor_;
+    continuousState_ = rhs.continuousState_;
     discreteVals_ = rhs.discreteVals_;
     return *this;
   }
@@ -90,6 +107,12 @@ class DCContinuousFactor : public gtsam::NonlinearFactor {
 
   size_t dim() const override { return dcfactor_->dim(); }
 
+  const gtsam::DiscreteKeys& discreteKeys() const { return discreteKeys_; }
+
+  const DiscreteValues& discreteValues() const { return discreteVals_; }
+
+  const boost::shared_ptr<DCFactor>& dcfactor() const { return dcfactor_; }
+
   bool allInitialized() const {
     for (const gtsam::DiscreteKey& dk : discreteKeys_) {
       const gtsam::Key k = dk.first;
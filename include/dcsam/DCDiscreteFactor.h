@@ -8,19 +8,25 @@
 
 #pragma once
 
+#include <gtsam/discrete/DecisionTreeFactor.h>
 #include <gtsam/discrete/DiscreteFactor.h>
 #include <gtsam/discrete/DiscreteKey.h>
+#include <gtsam/inference/Ordering.h>
 #include <gtsam/nonlinear/NonlinearFactor.h>
 #include <gtsam/nonlinear/Symbol.h>
 #include <math.h>
 
 #include <algorithm>
+#include <boost/optional.hpp>
 #include <limits>
 #include <memory>
+#include <utility>
 #include <vector>
 
+#include "ContinuousStateStore.h"
 #include "DCFactor.h"
 #include "DCSAM_types.h"
+#include "DenseDiscreteFactor.h"
 
 namespace dcsam {
 
@@ -36,6 +42,22 @@ namespace dcsam {
  * the stored continuous value assignment matches the most recent estimate for
  * continuous variables.
  *
+ * Continuous values are read from a ContinuousStateStore. Within DCSAM, all
+ * DCDiscreteFactors share a single store owned by the solver, so no
+ * per-factor copies of the continuous values are made. If no store is
+ * supplied, the factor creates its own.
+ *
+ * A factor can also be conditioned on fixed values of some of the DCFactor's
+ * discrete variables (e.g. variables frozen by DCSAM). Those variables are
+ * then not among the factor's keys: the fixed values are always passed to the
+ * DCFactor, and its tables are restricted to the remaining variables.
+ *
+ * The result of `toDecisionTreeFactor` is cached, and only recomputed once the
+ * stored discrete values or any of the factor's continuous values in the store
+ * have changed, or the DCFactor itself has (see
+ * `DCFactor::invalidateEvaluationCache`). The number of cache hits and misses
+ * is kept for profiling.
+ *
  * The continuous analogue is DCContinuousFactor.
  */
 class DCDiscreteFactor : public gtsam::DiscreteFactor {
@@ -43,40 +65,200 @@ class DCDiscreteFactor : public gtsam::DiscreteFactor {
   gtsam::DiscreteKeys discreteKeys_;
   gtsam::KeyVector continuousKeys_;
   boost::shared_ptr<DCFactor> dcfactor_;
-  gtsam::Values continuousVals_;
+  ContinuousStateStore::shared_ptr continuousState_;
   DiscreteValues discreteVals_;
 
+  // Values of the DCFactor's discrete variables this factor is conditioned
+  // on. These are also kept in `discreteVals_`.
+  DiscreteValues fixedVals_;
+
+  // Bumped whenever `discreteVals_` changes.
+  size_t discreteVersion_ = 0;
+
+  // Cached results of `toDecisionTreeFactor` (along with a dense copy) and of
+  // `toDenseErrorFactor`, each computed on demand, and the continuous and
+  // discrete versions (and the DCFactor's evaluation version) they are valid
+  // for.
+  mutable boost::optional<gtsam::DecisionTreeFactor> cachedTable_;
+  mutable boost::optional<DenseDiscreteFactor> cachedDense_;
+  mutable boost::optional<DenseDiscreteFactor> cachedErrors_;
+  mutable size_t cachedContinuousVersion_ = 0;
+  mutable size_t cachedDiscreteVersion_ = 0;
+  mutable size_t cachedFactorVersion_ = 0;
+  mutable size_t cacheHits_ = 0;
+  mutable size_t cacheMisses_ = 0;
+
+  // The largest version of any of this factor's continuous values in the
+  // store. Every change to a value gives it a version larger than any before,
+  // so this changes whenever any of them change.
+  size_t continuousVersion() const {
+    size_t version = 0;
+    for (const gtsam::Key& k : continuousKeys_) {
+      version = std::max(version, continuousState_->version(k));
+    }
+    return version;
+  }
+
+  // Drop the cached tables if any of their inputs have changed.
+  void validateCache() const {
+    const size_t version = continuousVersion();
+    const size_t factorVersion = dcfactor_->evaluationVersion();
+    if (cachedContinuousVersion_ == version &&
+        cachedDiscreteVersion_ == discreteVersion_ &&
+        cachedFactorVersion_ == factorVersion)
+      return;
+    cachedTable_ = boost::none;
+    cachedDense_ = boost::none;
+    cachedErrors_ = boost::none;
+    cachedContinuousVersion_ = version;
+    cachedDiscreteVersion_ = discreteVersion_;
+    cachedFactorVersion_ = factorVersion;
+  }
+
+  // The up-to-date (possibly cached) result of `toDecisionTreeFactor`.
+  const gtsam::DecisionTreeFactor& cachedTable() const {
+    assert(allInitialized());
+    validateCache();
+    if (cachedTable_) {
+      cacheHits_++;
+      return *cachedTable_;
+    }
+    cacheMisses_++;
+    cachedTable_ = dcfactor_->toDecisionTreeFactor(continuousState_->values(),
+                                                   discreteVals_);
+
+    // Restrict the table to the fixed values by multiplying by an indicator
+    // on each, then summing it out.
+    for (const auto& kv : fixedVals_) {
+      const size_t cardinality = cachedTable_->cardinality(kv.first);
+      std::vector<double> indicator(cardinality, 0.0);
+      indicator[kv.second] = 1.0;
+      gtsam::DecisionTreeFactor indicatorFactor(
+          gtsam::DiscreteKey(kv.first, cardinality), indicator);
+      gtsam::Ordering frontal;
+      frontal.push_back(kv.first);
+      cachedTable_ = *(*cachedTable_ * indicatorFactor).sum(frontal);
+    }
+    return *cachedTable_;
+  }
+
+  // `values` along with the fixed values, for evaluating the DCFactor.
+  DiscreteValues withFixed(const DiscreteValues& values) const {
+    DiscreteValues assignment = values;
+    for (const auto& kv : fixedVals_) assignment[kv.first] = kv.second;
+    return assignment;
+  }
+
+  // Evaluate the error for every assignment to (the distinct keys in)
+  // `discreteKeys_`, a row of the table (over the last key) at a time.
+  DenseDiscreteFactor computeErrors() const {
+    gtsam::DiscreteKeys keys;
+    for (const gtsam::DiscreteKey& dk : discreteKeys_) {
+      if (std::none_of(keys.begin(), keys.end(),
+                       [&](const gtsam::DiscreteKey& other) {
+                         return other.first == dk.first;
+                       }))
+        keys.push_back(dk);
+    }
+    const gtsam::Values& continuousVals = continuousState_->values();
+    if (keys.empty()) {
+      return DenseDiscreteFactor(
+          keys, {dcfactor_->cachedError(continuousVals, discreteVals_,
+                                        *continuousState_)});
+    }
+
+    size_t size = 1;
+    for (const gtsam::DiscreteKey& dk : keys) size *= dk.second;
+    std::vector<double> table(size);
+    DiscreteValues assignment = discreteVals_;
+    for (const gtsam::DiscreteKey& dk : keys) assignment[dk.first] = 0;
+    const gtsam::DiscreteKey& last = keys.back();
+    for (size_t row = 0; row < size; row += last.second) {
+      dcfactor_->cachedEvalErrors(last, continuousVals, assignment,
+                                  *continuousState_, table.data() + row);
+      for (size_t i = keys.size() - 1; i-- > 0;) {
+        size_t& value = assignment[keys[i].first];
+        if (++value < keys[i].second) break;
+        value = 0;
+      }
+    }
+    return DenseDiscreteFactor(keys, std::move(table));
+  }
+
  public:
   using Base = gtsam::DiscreteFactor;
 
-  DCDiscreteFactor() = default;
+  DCDiscreteFactor()
+      : continuousState_(boost::make_shared<ContinuousStateStore>()) {}
 
   DCDiscreteFactor(const gtsam::DiscreteKeys& discreteKeys,
-                   boost::shared_ptr<DCFactor> dcfactor)
+                   boost::shared_ptr<DCFactor> dcfactor,
+                   ContinuousStateStore::shared_ptr continuousState =
+                       ContinuousStateStore::shared_ptr())
       : discreteKeys_(discreteKeys),
         continuousKeys_(dcfactor->keys()),
-        dcfactor_(dcfactor) {
+        dcfactor_(dcfactor),
+        continuousState_(continuousState
+                             ? continuousState
+                             : boost::make_shared<ContinuousStateStore>()) {
     // Since this is a DiscreteFactor, its `keys_` member variable stores the
     // discrete keys only.
     for (const gtsam::DiscreteKey& k : discreteKeys_) keys_.push_back(k.first);
   }
 
-  explicit DCDiscreteFactor(boost::shared_ptr<DCFactor> dcfactor)
+  explicit DCDiscreteFactor(boost::shared_ptr<DCFactor> dcfactor,
+                            ContinuousStateStore::shared_ptr continuousState =
+                                ContinuousStateStore::shared_ptr())
       : discreteKeys_(dcfactor->discreteKeys()),
         continuousKeys_(dcfactor->keys()),
-        dcfactor_(dcfactor) {
+        dcfactor_(dcfactor),
+        continuousState_(continuousState
+                             ? continuousState
+                             : boost::make_shared<ContinuousStateStore>()) {
     // Since this is a DiscreteFactor, its `keys_` member variable stores the
     // discrete keys only.
     for (const gtsam::DiscreteKey& k : discreteKeys_) keys_.push_back(k.first);
   }
 
+  /**
+   * Construct a factor from `dcfactor` conditioned on `fixedVals`, the values
+   * of some of its discrete variables. The factor's keys are the remaining
+   * discrete variables.
+   */
+  DCDiscreteFactor(boost::shared_ptr<DCFactor> dcfactor,
+                   const DiscreteValues& fixedVals,
+                   ContinuousStateStore::shared_ptr continuousState)
+      : continuousKeys_(dcfactor->keys()),
+        dcfactor_(dcfactor),
+        continuousState_(continuousState
+                             ? continuousState
+                             : boost::make_shared<ContinuousStateStore>()),
+        discreteVals_(fixedVals),
+        fixedVals_(fixedVals) {
+    for (const gtsam::DiscreteKey& dk : dcfactor->discreteKeys()) {
+      if (fixedVals_.count(dk.first)) continue;
+      discreteKeys_.push_back(dk);
+      keys_.push_back(dk.first);
+    }
+  }
+
   DCDiscreteFactor& operator=(const DCDiscreteFactor& rhs) {
     Base::operator=(rhs);
     discreteKeys_ = rhs.discreteKeys_;
     dcfactor_ = rhs.dcfactor_;
     continuousKeys_ = rhs.continuousKeys_;
-    continuousVals_ = rhs.continuousVals_;
+    continuousState_ = rhs.continuousState_;
     discreteVals_ = rhs.discreteVals_;
+    fixedVals_ = rhs.fixedVals_;
+    discreteVersion_ = rhs.discreteVersion_;
+    cachedTable_ = rhs.cachedTable_;
+    cachedContinuousVersion_ = rhs.cachedContinuousVersion_;
+    cachedDiscreteVersion_ = rhs.cachedDiscreteVersion_;
+    cachedFactorVersion_ = rhs.cachedFactorVersion_;
+    cacheHits_ = rhs.cacheHits_;
+    cacheMisses_ = rhs.cacheMisses_;
+    cachedDense_ = rhs.cachedDense_;
+    cachedErrors_ = rhs.cachedErrors_;
     return *this;
   }
 
@@ -85,57 +267,190 @@ class DCDiscreteFactor : public gtsam::DiscreteFactor {
   bool equals(const DiscreteFactor& other, double tol = 1e-9) const override {
     if (!dynamic_cast<const DCDiscreteFactor*>(&other)) return false;
     const DCDiscreteFactor& f(static_cast<const DCDiscreteFactor&>(other));
-    return (dcfactor_->equals(*f.dcfactor_) &&
-            (discreteKeys_ == f.discreteKeys_) &&
-            continuousVals_.equals(f.continuousVals_) &&
-            discreteVals_ == f.discreteVals_);
+    if (!(dcfactor_->equals(*f.dcfactor_) &&
+          (discreteKeys_ == f.discreteKeys_) &&
+          discreteVals_ == f.discreteVals_ && fixedVals_ == f.fixedVals_))
+      return false;
+
+    // Compare the continuous values this factor depends on.
+    for (const gtsam::Key& k : continuousKeys_) {
+      const bool exists = continuousState_->exists(k);
+      if (exists != f.continuousState_->exists(k)) return false;
+      if (exists && !continuousState_->values().at(k).equals_(
+                        f.continuousState_->values().at(k), tol))
+        return false;
+    }
+    return true;
   }
 
   gtsam::DecisionTreeFactor toDecisionTreeFactor() const override {
-    assert(allInitialized());
-    return dcfactor_->toDecisionTreeFactor(continuousVals_, discreteVals_);
+    return cachedTable();
   }
 
+  // Equivalent to DCFactor::conditionalTimes, using the cached table.
   gtsam::DecisionTreeFactor operator*(
       const gtsam::DecisionTreeFactor& f) const override {
+    return cachedTable() * f;
+  }
+
+  /**
+   * @return the result of `toDecisionTreeFactor` as a DenseDiscreteFactor,
+   * which is cached along with it.
+   */
+  DenseDiscreteFactor toDenseFactor() const {
+    const gtsam::DecisionTreeFactor& table = cachedTable();
+    if (!cachedDense_) cachedDense_ = DenseDiscreteFactor(table);
+    return *cachedDense_;
+  }
+
+  /**
+   * @return the error of the underlying DCFactor for every assignment to this
+   * factor's discrete variables, at the stored continuous values, as a table
+   * for min-sum inference. Like the other tables, this is cached.
+   *
+   * If the DCFactor's table does not come from its error (see
+   * `DCFactor::errorMatchesTable`), this is the negative log of
+   * `toDecisionTreeFactor` instead, so that min-sum and max-product inference
+   * agree.
+   */
+  DenseDiscreteFactor toDenseErrorFactor() const {
     assert(allInitialized());
-    return dcfactor_->conditionalTimes(f, continuousVals_, discreteVals_);
+    validateCache();
+    if (cachedErrors_) {
+      cacheHits_++;
+    } else if (dcfactor_->errorMatchesTable()) {
+      cacheMisses_++;
+      cachedErrors_ = computeErrors();
+    } else {
+      cachedErrors_ = toDenseFactor();
+      cachedErrors_->negLog();
+    }
+    return *cachedErrors_;
   }
 
+  /**
+   * @return the number of requests for one of the tables above answered
+   * from the cache, and the number that had to compute it.
+   */
+  size_t cacheHits() const { return cacheHits_; }
+  size_t cacheMisses() const { return cacheMisses_; }
+
   double operator()(const DiscreteValues& values) const override {
     assert(allInitialized());
-    return exp(-dcfactor_->error(continuousVals_, values));
+    return exp(-error(values));
+  }
+
+  /**
+   * @return the negative log of this factor for the assignment `values`,
+   * i.e. the error of the underlying DCFactor at the stored continuous values.
+   * Unlike `operator()`, this does not underflow for large errors.
+   */
+  double error(const DiscreteValues& values) const {
+    assert(allInitialized());
+    if (fixedVals_.empty())
+      return dcfactor_->cachedError(continuousState_->values(), values,
+                                    *continuousState_);
+    return dcfactor_->cachedError(continuousState_->values(),
+                                  withFixed(values), *continuousState_);
   }
 
-  void updateContinuous(const gtsam::Values& continuousVals) {
+  /**
+   * Batched version of `error` for every assignment to `dk`, with the other
+   * discrete variables at their stored values (see `DCFactor::evalErrors`).
+   * No value needs to be stored for `dk` itself, so the table of a unary
+   * factor can be evaluated as soon as its continuous values are known.
+   */
+  void evalErrors(const gtsam::DiscreteKey& dk, double* errors) const {
+    assert(continuousInitialized());
+    dcfactor_->cachedEvalErrors(dk, continuousState_->values(),
+                                discreteVals_, *continuousState_, errors);
+  }
+
+  /**
+   * Update the stored continuous values with those in `continuousVals`. If
+   * this factor's ContinuousStateStore is shared, the update is seen by every
+   * factor sharing it.
+   *
+   * Analogous to iSAM2's `relinearizeThreshold`, if `threshold` is positive an
+   * existing value is only replaced when it has moved by more than
+   * `threshold` (in the infinity norm of its local coordinates).
+   *
+   * @return true if any of the stored values changed.
+   */
+  bool updateContinuous(const gtsam::Values& continuousVals,
+                        double threshold = 0.0) {
+    bool updated = false;
     for (const gtsam::Key& k : continuousKeys_) {
       // If key `k` is not set continuousVals, skip it.
       if (!continuousVals.exists(k)) continue;
-
-      if (continuousVals_.exists(k)) {
-        // If key `k` is set in stored continuousVals_, update its value
-        continuousVals_.update(k, continuousVals.at(k));
-      } else {
-        // If key `k` is not in the stored continuousVals_, create a new entry
-        // with key `k` and set its value to the one specified in the argument
-        // `continuousVals`
-        continuousVals_.insert(k, continuousVals.at(k));
-      }
+      if (continuousState_->update(k, continuousVals.at(k), threshold))
+        updated = true;
     }
+    return updated;
   }
 
-  void updateDiscrete(const DiscreteValues& discreteVals) {
+  /**
+   * @return the store from which this factor reads its continuous values.
+   */
+  const ContinuousStateStore::shared_ptr& continuousState() const {
+    return continuousState_;
+  }
+
+  /**
+   * @return the DCFactor this factor wraps.
+   */
+  const boost::shared_ptr<DCFactor>& dcfactor() const { return dcfactor_; }
+
+  /**
+   * @return the values of the discrete variables this factor is conditioned
+   * on (empty unless it is conditioned).
+   */
+  const DiscreteValues& fixedValues() const { return fixedVals_; }
+
+  /**
+   * @return the discrete variables this factor depends on.
+   */
+  const gtsam::DiscreteKeys& discreteKeys() const { return discreteKeys_; }
+
+  /**
+   * @return the keys of the continuous variables this factor depends on.
+   */
+  const gtsam::KeyVector& continuousKeys() const { return continuousKeys_; }
+
+  /**
+   * Update the stored discrete values with those in `discreteVals`.
+   *
+   * @return true if any of the stored values changed.
+   */
+  bool updateDiscrete(const DiscreteValues& discreteVals) {
+    bool updated = false;
     for (const gtsam::DiscreteKey& dk : discreteKeys_) {
       const gtsam::Key k = dk.first;
-      if (discreteVals.find(k) != discreteVals.end())
-        discreteVals_[k] = discreteVals.at(k);
+      auto it = discreteVals.find(k);
+      if (it == discreteVals.end()) continue;
+      auto stored = discreteVals_.find(k);
+      if (stored != discreteVals_.end() && stored->second == it->second)
+        continue;
+      discreteVals_[k] = it->second;
+      updated = true;
     }
+    if (updated) discreteVersion_++;
+    return updated;
   }
 
-  bool allInitialized() const {
+  /**
+   * @return true if the store holds a value for each of this factor's
+   * continuous variables.
+   */
+  bool continuousInitialized() const {
     for (const gtsam::Key& k : continuousKeys_) {
-      if (!continuousVals_.exists(k)) return false;
+      if (!continuousState_->exists(k)) return false;
     }
+    return true;
+  }
+
+  bool allInitialized() const {
+    if (!continuousInitialized()) return false;
     for (const gtsam::Key k : keys_) {
       if (discreteVals_.find(k) == discreteVals_.end()) return false;
     }
@@ -7,15 +7,20 @@
 
 #pragma once
 
+#include <gtsam/base/VerticalBlockMatrix.h>
+#include <gtsam/linear/JacobianFactor.h>
 #include <math.h>
 
 #include <algorithm>
+#include <boost/make_shared.hpp>
 #include <limits>
+#include <map>
 #include <utility>
 #include <vector>
 
 #include "dcsam/DCFactor.h"
 #include "dcsam/DCSAM_utils.h"
+#include "dcsam/EvaluationPoint.h"
 
 namespace dcsam {
 
@@ -41,6 +46,49 @@ class DCEMFactor : public DCFactor {
   std::vector<double> log_weights_;
   bool normalized_;
 
+  // Everything `error`, `linearize`, `toDecisionTreeFactor` and
+  // `getActiveFactorIdx` need from the components at one state. The
+  // component log probs and weights are computed together; the rest on first
+  // use.
+  struct Evaluation {
+    std::vector<double> logprobs;
+    std::vector<double> weights;
+
+    // Probability of each class under each component (from `evalProbs`).
+    std::vector<std::vector<double>> classProbs;
+
+    // Linearization of each component.
+    std::vector<boost::shared_ptr<gtsam::JacobianFactor>> jacobians;
+  };
+
+  // Memo of the evaluation at the state most recently passed to any of the
+  // above, which are usually all called at the same state (by the discrete
+  // and continuous sides of DCSAM alike) between updates.
+  mutable EvaluationPoint cachedPoint_;
+  mutable Evaluation cached_;
+  mutable size_t cacheHits_ = 0;
+  mutable size_t cacheMisses_ = 0;
+
+  // The (possibly memoized) evaluation at the given state.
+  Evaluation& evaluate(const gtsam::Values& continuousVals,
+                       const DiscreteValues& discreteVals) const {
+    if (cachedPoint_.matches(keys_, discreteKeys_, continuousVals,
+                             discreteVals)) {
+      cacheHits_++;
+      return cached_;
+    }
+    cacheMisses_++;
+
+    // Weights for each component are obtained by normalizing the errors.
+    cached_.logprobs = computeComponentLogProbs(continuousVals, discreteVals);
+    cached_.weights = cached_.logprobs;
+    expNormalizeInPlace(cached_.weights.data(), cached_.weights.size());
+    cached_.classProbs.clear();
+    cached_.jacobians.clear();
+    cachedPoint_.set(keys_, discreteKeys_, continuousVals, discreteVals);
+    return cached_;
+  }
+
  public:
   using Base = DCFactor;
 
@@ -69,30 +117,65 @@ class DCEMFactor : public DCFactor {
   }
 
   DCEMFactor& operator=(const DCEMFactor& rhs) {
+    Base::operator=(rhs);
     this->factors_ = rhs.factors_;
     this->log_weights_ = rhs.log_weights_;
     this->normalized_ = rhs.normalized_;
+    this->cachedPoint_.invalidate();
+    invalidateEvaluationCache();
+    return *this;
   }
 
   virtual ~DCEMFactor() = default;
 
   double error(const gtsam::Values& continuousVals,
                const DiscreteValues& discreteVals) const override {
-    // Retrieve the log prob for each component.
-    std::vector<double> logprobs =
-        computeComponentLogProbs(continuousVals, discreteVals);
-
-    // Weights for each component are obtained by normalizing the errors.
-    std::vector<double> componentWeights = expNormalize(logprobs);
+    // Retrieve the log prob and weight for each component.
+    const Evaluation& eval = evaluate(continuousVals, discreteVals);
 
     // Compute the total error as the weighted sum of component errors.
     double total_error = 0.0;
-    for (size_t i = 0; i < logprobs.size(); i++) {
-      total_error += componentWeights[i] * (-logprobs[i]);
+    for (size_t i = 0; i < eval.logprobs.size(); i++) {
+      total_error += eval.weights[i] * (-eval.logprobs[i]);
     }
     return total_error;
   }
 
+  // Each component's errors (and normalizing constant) are evaluated once for
+  // all of the assignments to `dk`, then combined as in `error` for each.
+  void evalErrors(const gtsam::DiscreteKey& dk,
+                  const gtsam::Values& continuousVals,
+                  const DiscreteValues& discreteVals,
+                  double* errors) const override {
+    // Log prob of component i for assignment j is in logprobs[i * card + j].
+    const size_t card = dk.second;
+    std::vector<double> logprobs(factors_.size() * card);
+    for (size_t i = 0; i < factors_.size(); i++) {
+      double* componentLogProbs = logprobs.data() + i * card;
+      factors_[i].evalErrors(dk, continuousVals, discreteVals,
+                             componentLogProbs);
+      double offset = -log_weights_[i];
+      if (!normalized_)
+        offset += factors_[i].logNormalizingConstant(continuousVals);
+      for (size_t j = 0; j < card; j++) {
+        componentLogProbs[j] = -(componentLogProbs[j] + offset);
+      }
+    }
+
+    // Normalized in place into the component weights for each assignment.
+    std::vector<double> componentWeights(factors_.size());
+    for (size_t j = 0; j < card; j++) {
+      for (size_t i = 0; i < factors_.size(); i++) {
+        componentWeights[i] = logprobs[i * card + j];
+      }
+      expNormalizeInPlace(componentWeights.data(), componentWeights.size());
+      errors[j] = 0.0;
+      for (size_t i = 0; i < factors_.size(); i++) {
+        errors[j] += componentWeights[i] * (-logprobs[i * card + j]);
+      }
+    }
+  }
+
   std::vector<double> computeComponentLogProbs(
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const {
@@ -111,22 +194,26 @@ class DCEMFactor : public DCFactor {
 
   size_t getActiveFactorIdx(const gtsam::Values& continuousVals,
                             const DiscreteValues& discreteVals) const {
+    const Evaluation& eval = evaluate(continuousVals, discreteVals);
     double min_error = std::numeric_limits<double>::infinity();
-    size_t min_error_idx;
-    for (size_t i = 0; i < factors_.size(); i++) {
-      double error =
-          factors_[i].error(continuousVals, discreteVals) - log_weights_[i];
-      if (!normalized_)
-        error += factors_[i].logNormalizingConstant(continuousVals);
-
-      if (error < min_error) {
-        min_error = error;
+    size_t min_error_idx = 0;
+    for (size_t i = 0; i < eval.logprobs.size(); i++) {
+      if (-eval.logprobs[i] < min_error) {
+        min_error = -eval.logprobs[i];
         min_error_idx = i;
       }
     }
     return min_error_idx;
   }
 
+  /**
+   * @return the number of evaluations (by `error`, `linearize`,
+   * `toDecisionTreeFactor` or `getActiveFactorIdx`) answered from the memo,
+   * and the number that evaluated the components.
+   */
+  size_t cacheHits() const { return cacheHits_; }
+  size_t cacheMisses() const { return cacheMisses_; }
+
   size_t dim() const override {
     size_t total = 0;
     // Each component factor `i` requires `factors_[i].dim()` rows in the
@@ -149,89 +236,120 @@ class DCEMFactor : public DCFactor {
 
   /*
    * Jacobian magic
+   *
+   * The linearized factor stacks the Jacobians of the components, each
+   * weighted by the square root of its component weight, over the union of
+   * their keys (in increasing order, with zero blocks where a component does
+   * not involve a key):
+   *
+   *   [ sqrt(w_1) A_1 | sqrt(w_1) b_1 ]
+   *   [      ...      |      ...      ]
+   *   [ sqrt(w_n) A_n | sqrt(w_n) b_n ]
+   *
+   * The stacked [A b] is allocated once, at its final size, and each
+   * component's blocks are written into it directly.
    */
   boost::shared_ptr<gtsam::GaussianFactor> linearize(
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const override {
-    std::vector<boost::shared_ptr<gtsam::GaussianFactor>> gfs;
-
-    // Start by computing all errors, so we can get the component weights.
-    std::vector<double> errors =
-        computeComponentLogProbs(continuousVals, discreteVals);
-
-    // Weights for each component are obtained by normalizing the errors.
-    std::vector<double> componentWeights = expNormalize(errors);
-
-    // We want to temporarily build a GaussianFactorGraph to construct the
-    // Jacobian for this whole factor.
-    gtsam::GaussianFactorGraph gfg;
-
-    for (size_t i = 0; i < factors_.size(); i++) {
-      // std::cout << "i = " << i << std::endl;
-      // First get the GaussianFactor obtained by linearizing `factors_[i]`
-      boost::shared_ptr<gtsam::GaussianFactor> gf =
-          factors_[i].linearize(continuousVals, discreteVals);
-
-      gtsam::JacobianFactor jf_component(*gf);
-
-      // Recover the [A b] matrix with Jacobian A and right-hand side vector b,
-      // with noise models "baked in," as a vertical block matrix.
-      gtsam::VerticalBlockMatrix Ab = jf_component.matrixObject();
-
-      // Copy Ab so we can reweight it appropriately.
-      gtsam::VerticalBlockMatrix Ab_weighted = Ab;
-
-      // Populate Ab_weighted with weighted Jacobian sqrt(w)*A and right-hand
-      // side vector sqrt(w)*b.
-      double sqrt_weight = sqrt(componentWeights[i]);
-
-      for (size_t k = 0; k < Ab_weighted.nBlocks(); k++) {
-        Ab_weighted(k) = sqrt_weight * Ab(k);
+    // Start with the component weights, and linearize each component (unless
+    // they have already been linearized at this state).
+    Evaluation& eval = evaluate(continuousVals, discreteVals);
+    const std::vector<double>& componentWeights = eval.weights;
+    std::vector<boost::shared_ptr<gtsam::JacobianFactor>>& jacobians =
+        eval.jacobians;
+    if (jacobians.size() != factors_.size()) {
+      jacobians.clear();
+      for (size_t i = 0; i < factors_.size(); i++) {
+        boost::shared_ptr<gtsam::GaussianFactor> gf =
+            factors_[i].linearize(continuousVals, discreteVals);
+        boost::shared_ptr<gtsam::JacobianFactor> jf =
+            boost::dynamic_pointer_cast<gtsam::JacobianFactor>(gf);
+        if (!jf) jf = boost::make_shared<gtsam::JacobianFactor>(*gf);
+        jacobians.push_back(jf);
       }
+    }
 
-      // Create a `JacobianFactor` from the system [A b] and add it to the
-      // `GaussianFactorGraph`.
-      gtsam::JacobianFactor jf(factors_[i].keys(), Ab_weighted);
-      gfg.add(jf);
+    // Collect the keys (with their dimensions) and the number of rows of the
+    // stacked system.
+    std::map<gtsam::Key, size_t> keyDims;
+    size_t rows = 0;
+    for (const boost::shared_ptr<gtsam::JacobianFactor>& jf : jacobians) {
+      for (auto it = jf->begin(); it != jf->end(); ++it) {
+        keyDims[*it] = jf->getDim(it);
+      }
+      rows += jf->rows();
     }
 
-    // Stack Jacobians to build combined factor.
+    gtsam::KeyVector keys;
+    std::vector<size_t> dims;
+    keys.reserve(keyDims.size());
+    dims.reserve(keyDims.size());
+    for (const auto& kd : keyDims) {
+      keys.push_back(kd.first);
+      dims.push_back(kd.second);
+    }
+    gtsam::VerticalBlockMatrix Ab(dims, rows, true);
+    Ab.matrix().setZero();
+
+    // Populate Ab with weighted Jacobians sqrt(w)*A and right-hand side
+    // vectors sqrt(w)*b, one component (a band of rows) at a time.
+    size_t row = 0;
+    for (size_t i = 0; i < jacobians.size(); i++) {
+      const gtsam::JacobianFactor& jf = *jacobians[i];
+      const double sqrt_weight = sqrt(componentWeights[i]);
+      const size_t height = jf.rows();
+      for (auto it = jf.begin(); it != jf.end(); ++it) {
+        const size_t block =
+            std::lower_bound(keys.begin(), keys.end(), *it) - keys.begin();
+        Ab(block).middleRows(row, height) = sqrt_weight * jf.getA(it);
+      }
+      Ab(keys.size()).middleRows(row, height) = sqrt_weight * jf.getb();
+      row += height;
+    }
 
-    return boost::make_shared<gtsam::JacobianFactor>(gfg);
+    return boost::make_shared<gtsam::JacobianFactor>(keys, Ab);
   }
 
   gtsam::DecisionTreeFactor toDecisionTreeFactor(
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const override {
-    // Start by computing all log probs, so we can get the component weights.
-    std::vector<double> logprobs =
-        computeComponentLogProbs(continuousVals, discreteVals);
-
-    // Weights for each component are obtained by normalizing the errors.
-    std::vector<double> componentWeights = expNormalize(logprobs);
+    // Start with the component weights, and the class probabilities under
+    // each component (unless they have already been computed at this state).
+    Evaluation& eval = evaluate(continuousVals, discreteVals);
+    const std::vector<double>& componentWeights = eval.weights;
+    if (eval.classProbs.size() != factors_.size()) {
+      eval.classProbs.clear();
+      for (size_t i = 0; i < factors_.size(); i++) {
+        gtsam::DiscreteKeys factor_dkeys = factors_[i].discreteKeys();
+        assert(factor_dkeys.size() == 1);
+        eval.classProbs.push_back(
+            factors_[i].evalProbs(factor_dkeys[0], continuousVals));
+      }
+    }
 
-    std::vector<gtsam::DecisionTreeFactor> unary_factors;
+    gtsam::DiscreteKeys unary_keys;
+    std::vector<std::vector<double>> unary_probs;
     for (size_t i = 0; i < factors_.size(); i++) {
       gtsam::DiscreteKeys factor_dkeys = factors_[i].discreteKeys();
-      assert(factor_dkeys.size() == 1);
-      std::vector<double> factor_probs =
-          factors_[i].evalProbs(factor_dkeys[0], continuousVals);
+      const std::vector<double>& factor_probs = eval.classProbs[i];
       std::vector<double> log_weighted_factor_probs;
       for (size_t k = 0; k < factor_probs.size(); k++) {
         log_weighted_factor_probs.push_back(componentWeights[i] *
                                             log(factor_probs[k]));
       }
-      std::vector<double> new_probs = expNormalize(log_weighted_factor_probs);
-      gtsam::DecisionTreeFactor unary(factor_dkeys[0], new_probs);
-      unary_factors.push_back(unary);
-    }
-    gtsam::DecisionTreeFactor converted;
-    for (size_t i = 0; i < unary_factors.size(); i++) {
-      converted = converted * unary_factors[i];
+      unary_keys.push_back(factor_dkeys[0]);
+      expNormalizeInPlace(log_weighted_factor_probs.data(),
+                          log_weighted_factor_probs.size());
+      unary_probs.push_back(std::move(log_weighted_factor_probs));
     }
-    return converted;
+    return unaryProductFactor(unary_keys, unary_probs);
   }
 
+  // The table weights each component's class probabilities, rather than its
+  // errors, by the component weights.
+  bool errorMatchesTable() const override { return false; }
+
   gtsam::FastVector<gtsam::Key> getAssociationKeys(
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const {
@@ -248,6 +366,8 @@ class DCEMFactor : public DCFactor {
     for (size_t i = 0; i < weights.size(); i++) {
       log_weights_[i] = log(weights[i]);
     }
+    cachedPoint_.invalidate();
+    invalidateEvaluationCache();
   }
 };
 }  // namespace dcsam
@@ -14,10 +14,13 @@
 #include <math.h>
 
 #include <algorithm>
+#include <boost/optional.hpp>
+#include <cmath>
 #include <limits>
 #include <string>
 #include <vector>
 
+#include "dcsam/ContinuousStateStore.h"
 #include "dcsam/DCSAM_types.h"
 #include "dcsam/DCSAM_utils.h"
 
@@ -29,6 +32,12 @@ namespace dcsam {
  * keys_ member variable stores keys for *continuous* variables.
  * discreteKeys_ contains the keys (plus cardinalities) for *discrete*
  * variables.
+ *
+ * DCSAM evaluates each DCFactor through the memoized `cachedError`,
+ * `cachedEvalErrors` and `cachedLinearize`, which assume that the error
+ * depends only on the values of the factor's variables. Factors with other
+ * state that can change (e.g. mixture weights) must call
+ * `invalidateEvaluationCache` when it does.
  */
 class DCFactor : public gtsam::Factor {
  protected:
@@ -58,6 +67,7 @@ class DCFactor : public gtsam::Factor {
   DCFactor& operator=(const DCFactor& rhs) {
     Base::operator=(rhs);
     discreteKeys_ = rhs.discreteKeys_;
+    invalidateEvaluationCache();
     return *this;
   }
 
@@ -86,6 +96,32 @@ class DCFactor : public gtsam::Factor {
       const gtsam::Values& continuousVals,
       const gtsam::DiscreteFactor::Values& discreteVals) const = 0;
 
+  /**
+   * Evaluate the error for every assignment to the discrete variable `dk` at
+   * once, with any other discrete variables assigned as in `discreteVals`.
+   * Equivalent to calling `error` with `discreteVals[dk.first] = i` for each
+   * i < dk.second, but implementations can share a single evaluation of the
+   * continuous part of the model across all of the assignments.
+   *
+   * The default implementation simply calls `error` once per assignment.
+   *
+   * @param dk - the discrete key to evaluate the error for
+   * @param continuousVals - an assignment to the continuous variables
+   * @param discreteVals - an assignment to any other discrete variables
+   * @param errors - buffer with room for dk.second values, where the error
+   * for each assignment to `dk` is written.
+   */
+  virtual void evalErrors(const gtsam::DiscreteKey& dk,
+                          const gtsam::Values& continuousVals,
+                          const DiscreteValues& discreteVals,
+                          double* errors) const {
+    DiscreteValues testDiscreteVals = discreteVals;
+    for (size_t i = 0; i < dk.second; i++) {
+      testDiscreteVals[dk.first] = i;
+      errors[i] = error(continuousVals, testDiscreteVals);
+    }
+  }
+
   /**
    * Linearize the error function with respect to the continuous
    * variables (given in `keys_`) at the point specified by `continuousVals`.
@@ -156,17 +192,29 @@ class DCFactor : public gtsam::Factor {
   virtual gtsam::DecisionTreeFactor toDecisionTreeFactor(
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const {
-    gtsam::DecisionTreeFactor converted;
+    std::vector<std::vector<double>> probs;
     for (const gtsam::DiscreteKey& dkey : discreteKeys_) {
-      std::vector<double> probs = evalProbs(dkey, continuousVals);
+      probs.push_back(evalProbs(dkey, continuousVals));
       // Cardinality of gtsam::DiscreteKey is located at `second`
-      assert(probs.size() == dkey.second);
-      gtsam::DecisionTreeFactor unary(dkey, probs);
-      converted = converted * unary;
+      assert(probs.back().size() == dkey.second);
     }
-    return converted;
+    return unaryProductFactor(discreteKeys_, probs);
   }
 
+  /**
+   * Whether `toDecisionTreeFactor` is exp(-error), up to normalization over
+   * each discrete variable, as in the default implementation above. If so,
+   * log-domain discrete inference evaluates this factor's error table
+   * directly with `evalErrors`, which cannot underflow.
+   *
+   * Factors whose table comes from a different model than their error (e.g.
+   * mixtures whose table mixes component tables rather than errors) override
+   * this to return false, and their error table is then the negative log of
+   * `toDecisionTreeFactor`, so that both kinds of inference solve the same
+   * problem.
+   */
+  virtual bool errorMatchesTable() const { return true; }
+
   /**
    * Calculate a normalizing constant for this DCFactor. Most implementations
    * will be able to use the helper function
@@ -188,47 +236,60 @@ class DCFactor : public gtsam::Factor {
    * measurement likelihood (since we are minimizing the _negative_
    * log-likelihood), to be used as a utility for computing the
    * DCFactorLogNormalizingConstant.
+   *
+   * For factors with a Gaussian noise model (or none), the constant does not
+   * depend on `values`; mixture factors compute it once per component at
+   * construction with `fixedLogNormalizingConstant` instead.
    */
   template <typename NonlinearFactorType>
   double nonlinearFactorLogNormalizingConstant(
       const NonlinearFactorType& factor, const gtsam::Values& values) const {
-    // Information matrix (inverse covariance matrix) for the factor.
-    gtsam::Matrix infoMat;
-
-    // NOTE: This is sloppy, is there a cleaner way?
-    boost::shared_ptr<NonlinearFactorType> fPtr =
-        boost::make_shared<NonlinearFactorType>(factor);
-    boost::shared_ptr<NonlinearFactorType> factorPtr(fPtr);
-
-    // If this is a NoiseModelFactor, we'll use its noiseModel to
-    // otherwise noiseModelFactor will be nullptr
-    boost::shared_ptr<gtsam::NoiseModelFactor> noiseModelFactor =
-        boost::dynamic_pointer_cast<gtsam::NoiseModelFactor>(factorPtr);
-    if (noiseModelFactor) {
-      // If dynamic cast to NoiseModelFactor succeeded, see if the noise model
-      // is Gaussian
-      gtsam::noiseModel::Base::shared_ptr noiseModel =
-          noiseModelFactor->noiseModel();
+    const boost::optional<double> fixed = fixedLogNormalizingConstant(factor);
+    if (fixed) return *fixed;
 
+    // If the noise model is not Gaussian, we'll linearize the factor to get
+    // something with a normalized noise model.
+    // TODO(kevin): does this make sense to do? I think maybe not in
+    // general? Should we just yell at the user?
+    boost::shared_ptr<gtsam::GaussianFactor> gaussianFactor =
+        factor.linearize(values);
+    return (factor.dim() * log(2.0 * M_PI) / 2.0) -
+           (logDeterminant(gaussianFactor->information()) / 2.0);
+  }
+
+  /**
+   * The (negative) log normalizing constant of `factor`, as in
+   * `nonlinearFactorLogNormalizingConstant`, if it can be computed without a
+   * linearization point: that is, if `factor` has a Gaussian noise model (or
+   * is not a NoiseModelFactor at all, in which case there is no information
+   * matrix to account for).
+   *
+   * @return the constant, or boost::none if it depends on the values.
+   */
+  static boost::optional<double> fixedLogNormalizingConstant(
+      const gtsam::NonlinearFactor& factor) {
+    double logDetInfo = 0.0;
+    auto* noiseModelFactor =
+        dynamic_cast<const gtsam::NoiseModelFactor*>(&factor);
+    if (noiseModelFactor) {
       boost::shared_ptr<gtsam::noiseModel::Gaussian> gaussianNoiseModel =
-          boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(noiseModel);
-      if (gaussianNoiseModel) {
-        // If the noise model is Gaussian, retrieve the information matrix
-        infoMat = gaussianNoiseModel->information();
-      } else {
-        // If the factor is not a Gaussian factor, we'll linearize it to get
-        // something with a normalized noise model
-        // TODO(kevin): does this make sense to do? I think maybe not in
-        // general? Should we just yell at the user?
-        boost::shared_ptr<gtsam::GaussianFactor> gaussianFactor =
-            factor.linearize(values);
-        infoMat = gaussianFactor->information();
-      }
+          boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(
+              noiseModelFactor->noiseModel());
+      if (!gaussianNoiseModel) return boost::none;
+      logDetInfo = logDeterminant(gaussianNoiseModel->information());
     }
+    return (factor.dim() * log(2.0 * M_PI) / 2.0) - (logDetInfo / 2.0);
+  }
 
-    // Compute the (negative) log of the normalizing constant
-    return (factor.dim() * log(2.0 * M_PI) / 2.0) -
-           (log(infoMat.determinant()) / 2.0);
+  /**
+   * Log-determinant of the (symmetric positive definite) information matrix
+   * `infoMat`, from the diagonal of its Cholesky factor, which is cheaper
+   * than, and does not overflow like, the determinant itself.
+   */
+  static double logDeterminant(const gtsam::Matrix& infoMat) {
+    Eigen::LLT<gtsam::Matrix> llt(infoMat);
+    if (llt.info() != Eigen::Success) return log(infoMat.determinant());
+    return 2.0 * llt.matrixLLT().diagonal().array().log().sum();
   }
 
   /**
@@ -253,16 +314,13 @@ class DCFactor : public gtsam::Factor {
    */
   std::vector<double> evalProbs(const gtsam::DiscreteKey& dk,
                                 const gtsam::Values& continuousVals) const {
-    std::vector<double> logProbs;
-    for (size_t i = 0; i < dk.second; i++) {
-      DiscreteValues testDiscreteVals;
-      testDiscreteVals[dk.first] = i;
-      // Recall: `error` returns -log(prob), so we compute exp(-error) to
-      // recover probability
-      double logProb = -error(continuousVals, testDiscreteVals);
-      logProbs.push_back(logProb);
-    }
-    return expNormalize(logProbs);
+    std::vector<double> logProbs(dk.second);
+    evalErrors(dk, continuousVals, DiscreteValues(), logProbs.data());
+    // Recall: `error` returns -log(prob), so we compute exp(-error) to
+    // recover probability
+    for (double& logProb : logProbs) logProb = -logProb;
+    expNormalizeInPlace(logProbs.data(), logProbs.size());
+    return logProbs;
   }
 
   /**
@@ -282,5 +340,209 @@ class DCFactor : public gtsam::Factor {
       const DiscreteValues& discreteVals) const {
     return toDecisionTreeFactor(continuousVals, discreteVals) * f;
   }
+
+  /**
+   * Memoized `error`. DCSAM wraps each DCFactor twice, as a DCContinuousFactor
+   * (for iSAM2) and as a DCDiscreteFactor (for the discrete solver), and both
+   * evaluate its error through this memo. Evaluations are only shared when
+   * both sides evaluate the error at the same values. The discrete side does
+   * so for its tables only with `DCSAMParams::discreteLogDomain` (through
+   * `cachedEvalErrors`; probability tables come from `toDecisionTreeFactor`),
+   * and for the hybrid error. iSAM2 does so with
+   * `ISAM2Params::evaluateNonlinearError`, and when checking a Dogleg step at
+   * its linearization point. Otherwise, the memo only saves repeated
+   * evaluations by the same side.
+   *
+   * Results are only memoized at the values held in `state`, keyed by the
+   * versions of `keys_` there, and are kept for every discrete assignment
+   * evaluated until any of those versions change. Evaluations at any other
+   * `continuousVals` (e.g. an older iSAM2 linearization point) are made
+   * directly and leave the memo as it is.
+   */
+  double cachedError(const gtsam::Values& continuousVals,
+                     const DiscreteValues& discreteVals,
+                     const ContinuousStateStore& state) const {
+    const size_t index = syncEvaluationCache(continuousVals, state)
+                             ? assignmentIndex(discreteVals)
+                             : kUncached;
+    if (index != kUncached && !std::isnan(errorCache_[index])) {
+      evaluationCacheHits_++;
+      return errorCache_[index];
+    }
+    evaluationCacheMisses_++;
+    const double e = error(continuousVals, discreteVals);
+    if (index != kUncached) errorCache_[index] = e;
+    return e;
+  }
+
+  /**
+   * Memoized `evalErrors`, sharing its results with `cachedError`.
+   */
+  void cachedEvalErrors(const gtsam::DiscreteKey& dk,
+                        const gtsam::Values& continuousVals,
+                        const DiscreteValues& discreteVals,
+                        const ContinuousStateStore& state,
+                        double* errors) const {
+    size_t stride = 0;
+    const size_t first = syncEvaluationCache(continuousVals, state)
+                             ? assignmentIndex(discreteVals, &dk, &stride)
+                             : kUncached;
+    if (first != kUncached) {
+      bool hit = true;
+      for (size_t j = 0; j < dk.second && hit; j++) {
+        errors[j] = errorCache_[first + j * stride];
+        hit = !std::isnan(errors[j]);
+      }
+      if (hit) {
+        evaluationCacheHits_++;
+        return;
+      }
+    }
+    evaluationCacheMisses_++;
+    evalErrors(dk, continuousVals, discreteVals, errors);
+    if (first == kUncached) return;
+    for (size_t j = 0; j < dk.second; j++) {
+      errorCache_[first + j * stride] = errors[j];
+    }
+  }
+
+  /**
+   * Memoized `linearize`, kept alongside the errors as in `cachedError`. The
+   * linearization is shared by every caller at the same values, so it must
+   * not be modified.
+   */
+  boost::shared_ptr<gtsam::GaussianFactor> cachedLinearize(
+      const gtsam::Values& continuousVals, const DiscreteValues& discreteVals,
+      const ContinuousStateStore& state) const {
+    const size_t index = syncEvaluationCache(continuousVals, state)
+                             ? assignmentIndex(discreteVals)
+                             : kUncached;
+    if (index != kUncached && linearizationCache_[index]) {
+      evaluationCacheHits_++;
+      return linearizationCache_[index];
+    }
+    evaluationCacheMisses_++;
+    boost::shared_ptr<gtsam::GaussianFactor> gf =
+        linearize(continuousVals, discreteVals);
+    if (index != kUncached) linearizationCache_[index] = gf;
+    return gf;
+  }
+
+  /**
+   * Drop all memoized evaluations, e.g. after a change to this factor that
+   * affects its error other than through the values of its variables. This
+   * also bumps `evaluationVersion`, so that anything derived from this
+   * factor's evaluations elsewhere (e.g. the tables cached by a
+   * DCDiscreteFactor) can tell it is stale.
+   */
+  void invalidateEvaluationCache() const {
+    evaluationVersion_++;
+    clearEvaluationCache();
+  }
+
+  /**
+   * @return a counter incremented by every call to
+   * `invalidateEvaluationCache`.
+   */
+  size_t evaluationVersion() const { return evaluationVersion_; }
+
+  /**
+   * @return the number of calls to `cachedError`, `cachedEvalErrors` and
+   * `cachedLinearize` answered from the memo, and the number that evaluated
+   * the factor.
+   */
+  size_t evaluationCacheHits() const { return evaluationCacheHits_; }
+  size_t evaluationCacheMisses() const { return evaluationCacheMisses_; }
+
+ private:
+  // Marks an evaluation that is not memoized.
+  static constexpr size_t kUncached = std::numeric_limits<size_t>::max();
+
+  // Factors with more discrete assignments than this are not memoized, to
+  // bound the memory the memo can use.
+  static constexpr size_t kMaxCachedAssignments = 1024;
+
+  // Memo for the `cached*` functions: the versions of `keys_` in the store
+  // they were evaluated at, and their results for each assignment to
+  // `discreteKeys_` (NaN and null for those not yet evaluated).
+  mutable bool evaluationValid_ = false;
+  mutable std::vector<size_t> evaluationVersions_;
+  mutable std::vector<double> errorCache_;
+  mutable std::vector<boost::shared_ptr<gtsam::GaussianFactor>>
+      linearizationCache_;
+  mutable size_t evaluationCacheHits_ = 0;
+  mutable size_t evaluationCacheMisses_ = 0;
+  mutable size_t evaluationVersion_ = 0;
+
+  void clearEvaluationCache() const {
+    evaluationValid_ = false;
+    errorCache_.clear();
+    linearizationCache_.clear();
+  }
+
+  // The number of assignments to `discreteKeys_`, or 0 if there are too many
+  // to memoize.
+  size_t evaluationCacheSize() const {
+    size_t size = 1;
+    for (const gtsam::DiscreteKey& dk : discreteKeys_) {
+      size *= dk.second;
+      if (size > kMaxCachedAssignments) return 0;
+    }
+    return size;
+  }
+
+  // Whether the memo can be used for an evaluation at `continuousVals`, i.e.
+  // whether they are the values of `keys_` in `state`. If so, the memo is
+  // first dropped unless it was computed at the same versions of them.
+  // Unlike `invalidateEvaluationCache`, the factor itself has not changed.
+  bool syncEvaluationCache(const gtsam::Values& continuousVals,
+                           const ContinuousStateStore& state) const {
+    const size_t size = evaluationCacheSize();
+    if (size == 0) return false;
+    bool current = evaluationValid_;
+    for (size_t i = 0; i < keys_.size(); i++) {
+      const size_t version = state.version(keys_[i]);
+      if (version == 0) return false;
+      if (current && evaluationVersions_[i] != version) current = false;
+    }
+    if (&continuousVals != &state.values()) {
+      for (const gtsam::Key k : keys_) {
+        if (!continuousVals.exists(k) ||
+            !continuousVals.at(k).equals_(state.values().at(k), 0.0))
+          return false;
+      }
+    }
+    if (current) return true;
+
+    evaluationVersions_.resize(keys_.size());
+    for (size_t i = 0; i < keys_.size(); i++) {
+      evaluationVersions_[i] = state.version(keys_[i]);
+    }
+    errorCache_.assign(size, std::numeric_limits<double>::quiet_NaN());
+    linearizationCache_.assign(size, nullptr);
+    evaluationValid_ = true;
+    return true;
+  }
+
+  // The position in the memo of the assignment `discreteVals` to
+  // `discreteKeys_`, or kUncached if any of them is unassigned. If `free` is
+  // given, it is taken to be 0, and the distance between the positions of
+  // consecutive values of it is added to `freeStride`.
+  size_t assignmentIndex(const DiscreteValues& discreteVals,
+                         const gtsam::DiscreteKey* free = nullptr,
+                         size_t* freeStride = nullptr) const {
+    size_t index = 0, stride = 1;
+    for (const gtsam::DiscreteKey& dk : discreteKeys_) {
+      if (free && dk.first == free->first) {
+        *freeStride += stride;
+      } else {
+        auto it = discreteVals.find(dk.first);
+        if (it == discreteVals.end()) return kUncached;
+        index += it->second * stride;
+      }
+      stride *= dk.second;
+    }
+    return index;
+  }
 };
 }  // namespace dcsam
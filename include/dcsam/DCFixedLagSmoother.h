@@ -0,0 +1,90 @@
+/**
+ * @file DCFixedLagSmoother.h
+ * @brief Fixed-lag smoothing for discrete-continuous factor graphs
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include <map>
+
+#include "dcsam/DCSAM.h"
+#include "dcsam/DCSAM_types.h"
+#include "dcsam/HybridFactorGraph.h"
+
+namespace dcsam {
+
+/**
+ * @brief A fixed-lag variant of DCSAM, in the spirit of
+ * gtsam::IncrementalFixedLagSmoother.
+ *
+ * Each variable is given a timestamp when it is added. After every update,
+ * variables whose timestamp is more than `smootherLag` older than the most
+ * recent timestamp are marginalized with `DCSAM::marginalize`, so that the
+ * size of the problem (and hence memory use and update time) stays bounded
+ * by the number of variables in the window.
+ *
+ * Variables that are never given a timestamp are never marginalized.
+ */
+class DCFixedLagSmoother {
+ public:
+  // Timestamp associated with each (continuous or discrete) variable.
+  using KeyTimestampMap = std::map<gtsam::Key, double>;
+
+  /**
+   * @param smootherLag - length of the window of variables to keep, in the
+   * same units as the timestamps.
+   * @param params - parameters for the underlying DCSAM solver. Unused iSAM2
+   * factor slots are always reused so that the iSAM2 factor graph does not
+   * grow.
+   */
+  explicit DCFixedLagSmoother(double smootherLag,
+                              const DCSAMParams &params = DCSAMParams());
+
+  /**
+   * Add new factors to the smoother, as with `DCSAM::update`, then
+   * marginalize any variables that have fallen outside the window.
+   *
+   * @param timestamps - timestamps for the new variables (or updated
+   * timestamps for existing ones).
+   * @return a DCSAMUpdateResult with information about the update.
+   */
+  DCSAMUpdateResult update(
+      const HybridFactorGraph &hfg,
+      const gtsam::Values &initialGuessContinuous = gtsam::Values(),
+      const DiscreteValues &initialGuessDiscrete = DiscreteValues(),
+      const KeyTimestampMap &timestamps = KeyTimestampMap());
+
+  /**
+   * @return the estimate of the variables currently in the window.
+   */
+  DCValues calculateEstimate() const { return dcsam_.calculateEstimate(); }
+
+  /**
+   * @return the length of the smoothing window.
+   */
+  double smootherLag() const { return smootherLag_; }
+
+  /**
+   * @return the timestamps of the variables currently in the window.
+   */
+  const KeyTimestampMap &timestamps() const { return keyTimestamps_; }
+
+  /**
+   * @return the underlying DCSAM solver.
+   */
+  DCSAM &solver() { return dcsam_; }
+  const DCSAM &solver() const { return dcsam_; }
+
+ private:
+  double smootherLag_;
+  DCSAM dcsam_;
+  KeyTimestampMap keyTimestamps_;
+  std::multimap<double, gtsam::Key> timestampKeys_;
+};
+
+}  // namespace dcsam
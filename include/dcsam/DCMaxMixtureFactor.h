@@ -16,6 +16,7 @@
 #include <vector>
 
 #include "DCFactor.h"
+#include "EvaluationPoint.h"
 
 namespace dcsam {
 
@@ -35,6 +36,47 @@ class DCMaxMixtureFactor : public DCFactor {
   std::vector<double> log_weights_;
   bool normalized_;
 
+  // Memo of the error of every component (including its weight and
+  // normalizing constant) and the active index at the state most recently
+  // passed to `getActiveFactorIdx`. `error`, `linearize`,
+  // `toDecisionTreeFactor` and `getAssociationKeys` are usually all called at
+  // the same state, so only the first of them evaluates the components.
+  mutable EvaluationPoint cachedPoint_;
+  mutable std::vector<double> cachedErrors_;
+  mutable size_t cachedActiveIdx_ = 0;
+  mutable size_t cacheHits_ = 0;
+  mutable size_t cacheMisses_ = 0;
+
+  // Evaluate every component at the given state (unless it is the memoized
+  // one) and memoize the results.
+  void updateCache(const gtsam::Values& continuousVals,
+                   const DiscreteValues& discreteVals) const {
+    if (cachedPoint_.matches(keys_, discreteKeys_, continuousVals,
+                             discreteVals)) {
+      cacheHits_++;
+      return;
+    }
+    cacheMisses_++;
+
+    cachedErrors_.resize(factors_.size());
+    double min_error = std::numeric_limits<double>::infinity();
+    cachedActiveIdx_ = 0;
+    for (size_t i = 0; i < factors_.size(); i++) {
+      double error =
+          factors_[i].error(continuousVals, discreteVals) - log_weights_[i];
+      if (!normalized_)
+        error += factors_[i].logNormalizingConstant(continuousVals);
+      cachedErrors_[i] = error;
+
+      if (error < min_error) {
+        min_error = error;
+        cachedActiveIdx_ = i;
+      }
+    }
+
+    cachedPoint_.set(keys_, discreteKeys_, continuousVals, discreteVals);
+  }
+
  public:
   using Base = DCFactor;
 
@@ -64,9 +106,13 @@ class DCMaxMixtureFactor : public DCFactor {
   }
 
   DCMaxMixtureFactor& operator=(const DCMaxMixtureFactor& rhs) {
+    Base::operator=(rhs);
     this->factors_ = rhs.factors_;
     this->log_weights_ = rhs.log_weights_;
     this->normalized_ = rhs.normalized_;
+    this->cachedPoint_.invalidate();
+    invalidateEvaluationCache();
+    return *this;
   }
 
   virtual ~DCMaxMixtureFactor() = default;
@@ -74,34 +120,50 @@ class DCMaxMixtureFactor : public DCFactor {
   double error(const gtsam::Values& continuousVals,
                const DiscreteValues& discreteVals) const override {
     size_t min_error_idx = getActiveFactorIdx(continuousVals, discreteVals);
-    assert(0 <= min_error_idx);
     assert(min_error_idx < factors_.size());
-    double min_error =
-        factors_[min_error_idx].error(continuousVals, discreteVals);
-    if (normalized_) return min_error - log_weights_[min_error_idx];
-    return min_error +
-           factors_[min_error_idx].logNormalizingConstant(continuousVals) -
-           log_weights_[min_error_idx];
+    return cachedErrors_[min_error_idx];
   }
 
-  size_t getActiveFactorIdx(const gtsam::Values& continuousVals,
-                            const DiscreteValues& discreteVals) const {
-    double min_error = std::numeric_limits<double>::infinity();
-    size_t min_error_idx = 0;
+  // Each component's errors (and normalizing constant) are evaluated once for
+  // all of the assignments to `dk`, taking the min over components for each.
+  void evalErrors(const gtsam::DiscreteKey& dk,
+                  const gtsam::Values& continuousVals,
+                  const DiscreteValues& discreteVals,
+                  double* errors) const override {
+    std::fill(errors, errors + dk.second,
+              std::numeric_limits<double>::infinity());
+    std::vector<double> componentErrors(dk.second);
     for (size_t i = 0; i < factors_.size(); i++) {
-      double error =
-          factors_[i].error(continuousVals, discreteVals) - log_weights_[i];
+      factors_[i].evalErrors(dk, continuousVals, discreteVals,
+                             componentErrors.data());
+      double offset = -log_weights_[i];
       if (!normalized_)
-        error += factors_[i].logNormalizingConstant(continuousVals);
-
-      if (error < min_error) {
-        min_error = error;
-        min_error_idx = i;
+        offset += factors_[i].logNormalizingConstant(continuousVals);
+      for (size_t j = 0; j < dk.second; j++) {
+        errors[j] = std::min(errors[j], componentErrors[j] + offset);
       }
     }
-    return min_error_idx;
   }
 
+  /**
+   * @return the index of the component with the lowest error at the given
+   * state, memoized so that repeated calls at the same state (including those
+   * made by `error`, `linearize`, `toDecisionTreeFactor` and
+   * `getAssociationKeys`) only evaluate the components once.
+   */
+  size_t getActiveFactorIdx(const gtsam::Values& continuousVals,
+                            const DiscreteValues& discreteVals) const {
+    updateCache(continuousVals, discreteVals);
+    return cachedActiveIdx_;
+  }
+
+  /**
+   * @return the number of calls to `getActiveFactorIdx` answered from the
+   * memo, and the number that evaluated the components.
+   */
+  size_t cacheHits() const { return cacheHits_; }
+  size_t cacheMisses() const { return cacheMisses_; }
+
   size_t dim() const override {
     if (factors_.size() > 0) {
       return factors_[0].dim();
@@ -138,20 +200,28 @@ class DCMaxMixtureFactor : public DCFactor {
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const override {
     size_t min_error_idx = getActiveFactorIdx(continuousVals, discreteVals);
-    gtsam::DecisionTreeFactor converted;
+    gtsam::DecisionTreeFactor converted =
+        factors_[min_error_idx].toDecisionTreeFactor(continuousVals,
+                                                     discreteVals);
+
+    // The inactive components contribute uniform factors, which are built as
+    // a single table and multiplied in at once.
+    gtsam::DiscreteKeys uniformKeys;
+    std::vector<std::vector<double>> uniformProbs;
     for (size_t i = 0; i < factors_.size(); i++) {
-      if (i == min_error_idx) {
-        converted = converted * factors_[min_error_idx].toDecisionTreeFactor(
-                                    continuousVals, discreteVals);
-      } else {
-        for (const gtsam::DiscreteKey& dk : factors_[i].discreteKeys()) {
-          converted = converted * uniformDecisionTreeFactor(dk);
-        }
+      if (i == min_error_idx) continue;
+      for (const gtsam::DiscreteKey& dk : factors_[i].discreteKeys()) {
+        uniformKeys.push_back(dk);
+        uniformProbs.emplace_back(dk.second, 1.0 / dk.second);
       }
     }
-    return converted;
+    if (uniformKeys.empty()) return converted;
+    return converted * unaryProductFactor(uniformKeys, uniformProbs);
   }
 
+  // The table only depends on the errors of the active component.
+  bool errorMatchesTable() const override { return false; }
+
   gtsam::FastVector<gtsam::Key> getAssociationKeys(
       const gtsam::Values& continuousVals,
       const DiscreteValues& discreteVals) const {
@@ -168,6 +238,8 @@ class DCMaxMixtureFactor : public DCFactor {
     for (int i = 0; i < weights.size(); i++) {
       log_weights_[i] = log(weights[i]);
     }
+    cachedPoint_.invalidate();
+    invalidateEvaluationCache();
   }
 };
 }  // namespace dcsam
@@ -13,6 +13,7 @@
 #include <math.h>
 
 #include <algorithm>
+#include <boost/optional.hpp>
 #include <limits>
 #include <vector>
 
@@ -33,6 +34,17 @@ class DCMixtureFactor : public DCFactor {
   std::vector<NonlinearFactorType> factors_;
   bool normalized_;
 
+  // Log normalizing constant of each component, computed at construction
+  // (unless `normalized_` is set, or it depends on the continuous values).
+  std::vector<boost::optional<double>> logNormalizingConstants_;
+
+  double componentLogNormalizingConstant(
+      size_t i, const gtsam::Values& continuousVals) const {
+    if (logNormalizingConstants_[i]) return *logNormalizingConstants_[i];
+    return this->nonlinearFactorLogNormalizingConstant(factors_[i],
+                                                       continuousVals);
+  }
+
  public:
   using Base = DCFactor;
 
@@ -47,12 +59,22 @@ class DCMixtureFactor : public DCFactor {
 
     // Add `dk` to `dkeys` list.
     discreteKeys_.push_back(dk);
+
+    if (!normalized_) {
+      for (const NonlinearFactorType& factor : factors_) {
+        logNormalizingConstants_.push_back(
+            this->fixedLogNormalizingConstant(factor));
+      }
+    }
   }
 
   DCMixtureFactor& operator=(const DCMixtureFactor& rhs) {
     Base::operator=(rhs);
     this->dk_ = rhs.dk_;
     this->factors_ = rhs.factors_;
+    this->normalized_ = rhs.normalized_;
+    this->logNormalizingConstants_ = rhs.logNormalizingConstants_;
+    return *this;
   }
 
   ~DCMixtureFactor() = default;
@@ -66,8 +88,28 @@ class DCMixtureFactor : public DCFactor {
     // error.
     const double factorError = factors_[assignment].error(continuousVals);
     if (normalized_) return factorError;
-    return factorError + this->nonlinearFactorLogNormalizingConstant(
-                             this->factors_[assignment], continuousVals);
+    return factorError +
+           componentLogNormalizingConstant(assignment, continuousVals);
+  }
+
+  void evalErrors(const gtsam::DiscreteKey& dk,
+                  const gtsam::Values& continuousVals,
+                  const DiscreteValues& discreteVals,
+                  double* errors) const override {
+    // The error doesn't depend on any other discrete variable.
+    if (dk.first != dk_.first) {
+      const double e = error(continuousVals, discreteVals);
+      std::fill(errors, errors + dk.second, e);
+      return;
+    }
+
+    // Each assignment selects a single component, so there is nothing to
+    // share, but we can skip the lookup of the assignment.
+    for (size_t i = 0; i < dk.second; i++) {
+      errors[i] = factors_[i].error(continuousVals);
+      if (!normalized_)
+        errors[i] += componentLogNormalizingConstant(i, continuousVals);
+    }
   }
 
   size_t dim() const override {
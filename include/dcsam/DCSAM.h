@@ -23,11 +23,16 @@
 #include <utility>
 #include <vector>
 
+#include "dcsam/ContinuousStateStore.h"
 #include "dcsam/DCContinuousFactor.h"
+#include "dcsam/DCDiscreteFactor.h"
 #include "dcsam/DCFactor.h"
 #include "dcsam/DCFactorGraph.h"
 #include "dcsam/DCSAM_types.h"
+#include "dcsam/DiscreteISAM.h"
 #include "dcsam/HybridFactorGraph.h"
+#include "dcsam/ThreadPool.h"
+#include "dcsam/UnaryEvidenceFactor.h"
 
 namespace dcsam {
 
@@ -37,6 +42,8 @@ class DCSAM {
 
   explicit DCSAM(const gtsam::ISAM2Params &isam_params);
 
+  explicit DCSAM(const DCSAMParams &params);
+
   /**
    * For this solver, runs an iteration of alternating minimization between
    * discrete and continuous variables, adding any user-supplied factors (with
@@ -64,6 +71,11 @@ class DCSAM {
    * 6. Update the discrete factors in the discrete factor graph dfg_ with the
    * latest information from the continuous solve.
    *
+   * Steps 2-6 are repeated (without adding any further factors) up to
+   * `DCSAMParams::maxIterations` times, stopping early once the discrete
+   * assignment stops changing or the hybrid error settles (see
+   * `DCSAMParams`).
+   *
    * @param graph - a gtsam::NonlinearFactorGraph containing any
    * *continuous-only* factors to add.
    * @param dfg - a gtsam::DiscreteFactorGraph containing any *discrete-only*
@@ -73,11 +85,13 @@ class DCSAM {
    * @param initialGuess - an initial guess for any new continuous keys that.
    * appear in the updated factors (or if one wants to force override previously
    * obtained continuous values).
+   * @return a DCSAMUpdateResult with information about the update.
    */
-  void update(const gtsam::NonlinearFactorGraph &graph,
-              const gtsam::DiscreteFactorGraph &dfg, const DCFactorGraph &dcfg,
-              const gtsam::Values &initialGuessContinuous = gtsam::Values(),
-              const DiscreteValues &initialGuessDiscrete = DiscreteValues());
+  DCSAMUpdateResult update(
+      const gtsam::NonlinearFactorGraph &graph,
+      const gtsam::DiscreteFactorGraph &dfg, const DCFactorGraph &dcfg,
+      const gtsam::Values &initialGuessContinuous = gtsam::Values(),
+      const DiscreteValues &initialGuessDiscrete = DiscreteValues());
 
   /**
    * A HybridFactorGraph is a container holding a NonlinearFactorGraph, a
@@ -88,24 +102,25 @@ class DCSAM {
    * update(hfg.nonlinearGraph(), hfg.discreteGraph(), hfg.dcGraph(),
    * initialGuess);
    */
-  void update(const HybridFactorGraph &hfg,
-              const gtsam::Values &initialGuessContinuous = gtsam::Values(),
-              const DiscreteValues &initialGuessDiscrete = DiscreteValues());
+  DCSAMUpdateResult update(
+      const HybridFactorGraph &hfg,
+      const gtsam::Values &initialGuessContinuous = gtsam::Values(),
+      const DiscreteValues &initialGuessDiscrete = DiscreteValues());
 
   /**
    * Inline convenience function to allow "skipping" the initial guess for
    * continuous variables while adding an initial guess for discrete variables.
    */
-  inline void update(const HybridFactorGraph &hfg,
-                     const DiscreteValues &initialGuessDiscrete) {
-    update(hfg, gtsam::Values(), initialGuessDiscrete);
+  inline DCSAMUpdateResult update(const HybridFactorGraph &hfg,
+                                  const DiscreteValues &initialGuessDiscrete) {
+    return update(hfg, gtsam::Values(), initialGuessDiscrete);
   }
 
   /**
    * Simply used to call `update` without any new factors. Runs an iteration of
    * optimization.
    */
-  void update();
+  DCSAMUpdateResult update();
 
   /**
    * Add factors in `graph` to member discrete factor graph `dfg_`, then update
@@ -125,16 +140,21 @@ class DCSAM {
 
   /**
    * For any factors in `dfg_`, update their stored local continuous information
-   * with the values from `values`.
+   * with the values from `values`. Factors are only refreshed if one of their
+   * continuous variables moved by more than
+   * `DCSAMParams::discreteRefreshThreshold` (or their discrete values changed).
+   * The keys of any refreshed factors are marked to be re-eliminated on the
+   * next `solveDiscrete`.
    *
    * NOTE: could this be combined with `updateDiscrete` or do these
    * definitely need to be separate?
    *
    * @param values - an assignment to the continuous variables (or subset
    * thereof).
+   * @return the number of factors that were refreshed.
    */
-  void updateDiscreteInfo(const gtsam::Values &continuousVals,
-                          const DiscreteValues &discreteVals);
+  size_t updateDiscreteInfo(const gtsam::Values &continuousVals,
+                            const DiscreteValues &discreteVals);
 
   /**
    * At the moment, this just calls `isam_.update()` internally
@@ -151,31 +171,69 @@ class DCSAM {
   /**
    * Given the latest discrete values (dcValues), a set of new factors
    * (newFactors), and an initial guess for any new keys (initialGuess), this
-   * function updates the continuous values stored in any DC factors (in the
-   * member `isam_` instance), marks any affected keys as such, and calls
-   * `isam_.update` with the new factors and initial guess. See implementation
-   * for more detail.
+   * function updates the discrete values stored in any DC factors (in the
+   * member `isam_` instance), marks the keys of those whose discrete
+   * assignment changed as affected, and calls `isam_.update` with the new
+   * factors and initial guess. See implementation for more detail.
+   *
+   * Affected DC factors are identified to iSAM by their iSAM2 factor index,
+   * which is recorded for each new DC continuous factor from
+   * `ISAM2Result::newFactorsIndices`.
    *
    * NOTE: this is another function that could perhaps be named better.
+   *
+   * @param removeFactorIndices - iSAM2 indices of any factors to remove.
+   * @param numRelinearized - if provided, set to the number of existing DC
+   * factors marked for relinearization.
+   * @return the result of the underlying call to `isam_.update`.
    */
-  void updateContinuousInfo(const DiscreteValues &discreteVals,
-                            const gtsam::NonlinearFactorGraph &newFactors,
-                            const gtsam::Values &initialGuess);
+  gtsam::ISAM2Result updateContinuousInfo(
+      const DiscreteValues &discreteVals,
+      const gtsam::NonlinearFactorGraph &newFactors,
+      const gtsam::Values &initialGuess,
+      const gtsam::FactorIndices &removeFactorIndices = gtsam::FactorIndices(),
+      size_t *numRelinearized = nullptr);
 
   /**
-   * Solve for discrete variables given continuous variables. Internally, calls
-   * `dfg_.optimize()`
+   * Solve for discrete variables given continuous variables. Internally, passes
+   * any discrete factors added (or refreshed) since the last solve to the
+   * incremental discrete solver `discreteIsam_`, so only the affected part of
+   * the discrete problem is re-eliminated.
    *
    * @return an assignment (DiscreteValues) to the discrete variables in the
    * graph.
    */
   DiscreteValues solveDiscrete() const;
 
+  /**
+   * Mark the discrete factors involving `keys` as changed, so that they are
+   * re-eliminated on the next discrete solve.
+   *
+   * The incremental discrete solver only re-eliminates the parts of the
+   * problem touched by new or refreshed factors. Factors are held by pointer,
+   * so one modified in place (e.g. with
+   * `SmartDiscretePriorFactor::updateProbs`) keeps its new values, but the
+   * change is ignored until this is called with (any of) its keys.
+   *
+   * NOTE: with `DCSAMParams::fuseUnaryEvidence`, unary discrete-only factors
+   * are folded into a UnaryEvidenceFactor when they are added, so later
+   * in-place changes to them are never seen.
+   *
+   * @param keys - discrete keys of the factors that were modified.
+   */
+  void markDiscreteFactorsChanged(const gtsam::KeySet &keys);
+
   /**
    * This is the primary function used to extract an estimate from the solver.
-   * Internally, calls `isam_.calculateEstimate()` and `dfg_.optimize()` to
-   * obtain an estimate for the continuous (resp. discrete) variables and
-   * packages them into a `DCValues` pair as (continuousVals, discreteVals).
+   * The continuous estimate is the one cached from the last iSAM solve. The
+   * discrete estimate is cached from the last discrete solve, and is only
+   * recomputed (incrementally, for the affected variables) if any discrete
+   * factors have been added or refreshed with new continuous information
+   * since. The two are packaged into a `DCValues` pair as (continuousVals,
+   * discreteVals).
+   *
+   * Use `estimateVersion` to cheaply check whether the estimate has changed
+   * since it was last retrieved.
    *
    * @return a DCValues object containing an estimate
    * of the most probable assignment to the continuous (DCValues.continuous) and
@@ -183,6 +241,38 @@ class DCSAM {
    */
   DCValues calculateEstimate() const;
 
+  /**
+   * Retrieve the current estimate of a single continuous variable without
+   * copying the full estimate, in the spirit of
+   * `gtsam::ISAM2::calculateEstimate(key)`.
+   *
+   * @param key - the continuous variable to retrieve.
+   * @return the current estimate of `key`.
+   */
+  const gtsam::Value &calculateEstimate(const gtsam::Key key) const;
+
+  template <class VALUE>
+  VALUE calculateEstimate(const gtsam::Key key) const {
+    return currContinuous_.at<VALUE>(key);
+  }
+
+  /**
+   * Retrieve the current estimate of a single discrete variable. As with
+   * `calculateEstimate`, the discrete solution is only updated if the discrete
+   * problem has changed since the last solve.
+   *
+   * @param key - the discrete variable to retrieve.
+   * @return the current most probable assignment to `key`.
+   */
+  size_t calculateDiscreteEstimate(const gtsam::Key key) const;
+
+  /**
+   * @return a counter that is incremented whenever the continuous or discrete
+   * estimate changes, so callers can tell whether a previously retrieved
+   * estimate is still current.
+   */
+  size_t estimateVersion() const { return estimateVersion_; }
+
   /**
    * Used to obtain the marginals from the solver.
    *
@@ -199,23 +289,234 @@ class DCSAM {
                            const gtsam::Values &continuousEst,
                            const gtsam::DiscreteFactorGraph &dfg);
 
-  gtsam::DiscreteFactorGraph getDiscreteFactorGraph() const { return dfg_; }
+  /**
+   * Remove `keys` from the problem, summarizing their information in factors
+   * on the remaining variables. This is the building block for
+   * DCFixedLagSmoother.
+   *
+   * Continuous keys are marginalized out of `isam_` (as in
+   * `gtsam::IncrementalFixedLagSmoother`): they are re-eliminated first, so
+   * they become leaves of the Bayes tree, and then removed with
+   * `ISAM2::marginalizeLeaves`. Any DC continuous factors involving them keep
+   * their current discrete assignment in the resulting marginal factor.
+   * Likewise, the discrete halves of those DCFactors can no longer be
+   * refreshed, so they are re-anchored: replaced by their table at the
+   * current continuous estimate.
+   *
+   * Discrete keys are summed out of `dfg_`: the factors involving them
+   * (with DCDiscreteFactors evaluated at the current continuous estimate) are
+   * multiplied together and the keys summed out one at a time. Resulting
+   * marginals on a single variable are added as DiscretePriorFactors.
+   *
+   * Either way, only the factors involving `keys` are touched, and the
+   * discrete solver only re-eliminates the affected part of the problem.
+   *
+   * @param keys - continuous and/or discrete keys to marginalize.
+   */
+  void marginalize(const gtsam::KeySet &keys);
+
+  /**
+   * @return the joint error of the current estimate: the error of all factors
+   * in `isam_` at the current continuous estimate plus the negative log of
+   * each discrete-only factor at the current discrete estimate. This is the
+   * objective minimized by alternating between `solveDiscrete` and the
+   * continuous update, so it is non-increasing over alternations (up to the
+   * approximations made by iSAM2).
+   */
+  double hybridError() const;
+
+  /**
+   * @return the discrete factors in the problem (without the slots of any
+   * that have been removed).
+   */
+  gtsam::DiscreteFactorGraph getDiscreteFactorGraph() const;
+
+  /**
+   * @return the incremental discrete solver, whose factor indices match
+   * those of the discrete factors in `dfg_` (as of the last discrete solve).
+   */
+  const DiscreteISAM &getDiscreteSolver() const { return discreteIsam_; }
 
   gtsam::NonlinearFactorGraph getNonlinearFactorGraph() const {
     return isam_.getFactorsUnsafe();
   }
 
  private:
+  /**
+   * Run a single alternation: solve for the discrete variables (unless
+   * `skipDiscrete`), add `newFactors` and the continuous halves of `dcfg` to
+   * iSAM, update the continuous estimate and refresh the DCDiscreteFactors.
+   * Timings and counters are accumulated into `result`.
+   *
+   * @param previousContinuous - if provided, set to the continuous estimate
+   * from before this alternation.
+   * @return the number of discrete variables whose assignment changed.
+   */
+  size_t alternate(gtsam::NonlinearFactorGraph *newFactors,
+                   const DCFactorGraph &dcfg, const gtsam::Values &initialGuess,
+                   bool skipDiscrete, DCSAMUpdateResult *result,
+                   gtsam::Values *previousContinuous = nullptr);
+
+  /**
+   * @return the change in `hybridError` from the estimate
+   * (`previousContinuous`, `previousDiscrete`), over the same variables, to
+   * the current estimate. Only the factors involving variables whose
+   * estimate differs between the two are evaluated.
+   */
+  double hybridErrorChange(const gtsam::Values &previousContinuous,
+                           const DiscreteValues &previousDiscrete) const;
+
+  /**
+   * Freeze any discrete variables whose marginal probability (see
+   * `DiscreteISAM::marginal`) exceeds `DCSAMParams::discreteFreezeThreshold`.
+   * Frozen variables are removed from the discrete problem: every factor
+   * involving them is replaced by one conditioned on their value (factors
+   * involving only frozen variables are dropped), and their DC continuous
+   * factors are no longer updated. DCFactors added later are likewise
+   * conditioned.
+   *
+   * Only the variables whose marginal may have changed since the last call
+   * are checked: those in the components of factors added, removed or
+   * refreshed (see `freezeCandidates_`).
+   *
+   * @return the number of variables frozen.
+   */
+  size_t freezeConfidentDiscrete();
+
+  /**
+   * @return true if every key in `keys` is frozen.
+   */
+  bool isFrozen(const gtsam::DiscreteKeys &keys) const;
+
+  /**
+   * @return `factor` conditioned on the values of any frozen variables it
+   * involves: `factor` itself if there are none, or nullptr if all of its
+   * variables are frozen.
+   */
+  gtsam::DiscreteFactor::shared_ptr conditionOnFrozen(
+      const gtsam::DiscreteFactor::shared_ptr &factor) const;
+
+  /**
+   * @return the discrete half of `dcfactor`, conditioned on the values of any
+   * frozen variables it involves, or nullptr if all of them are frozen.
+   */
+  boost::shared_ptr<DCDiscreteFactor> conditionOnFrozen(
+      const boost::shared_ptr<DCFactor> &dcfactor) const;
+
+  /**
+   * If `DCSAMParams::fuseUnaryEvidence` is set and `factor` is unary, fold it
+   * into the UnaryEvidenceFactor for its variable, adding that to `newFactors`
+   * if it is new. DCDiscreteFactors are attached rather than folded in, so
+   * that they can be refreshed.
+   *
+   * @return the UnaryEvidenceFactor `factor` was fused into and, for a
+   * DCDiscreteFactor, its slot; or nullptr if it was not fused.
+   */
+  std::pair<UnaryEvidenceFactor::shared_ptr, size_t> fuseUnaryEvidence(
+      const gtsam::DiscreteFactor::shared_ptr &factor,
+      gtsam::DiscreteFactorGraph *newFactors);
+
+  /**
+   * Add `factor` to `dfg_`, in the slot of a removed factor if there is one,
+   * to be passed to `discreteIsam_` on its next update.
+   *
+   * @return the index of `factor` in `dfg_`.
+   */
+  size_t addDiscreteFactor(const gtsam::DiscreteFactor::shared_ptr &factor);
+
+  /**
+   * Remove the factor at `index` in `dfg_`, from `discreteIsam_` as well on
+   * its next update, along with the bookkeeping for any DCDiscreteFactors it
+   * holds.
+   */
+  void removeDiscreteFactor(size_t index);
+
+  /**
+   * Keep track of the DCDiscreteFactor `factor`, which is in `dfg_` at
+   * `index`, or attached to the UnaryEvidenceFactor `fused` in `slot`.
+   */
+  void addDCDiscreteFactor(const boost::shared_ptr<DCDiscreteFactor> &factor,
+                           size_t index,
+                           const UnaryEvidenceFactor::shared_ptr &fused,
+                           size_t slot);
+
+  /**
+   * Stop keeping track of the DCDiscreteFactor `factor`, dropping any
+   * continuous values no other DCDiscreteFactor depends on from
+   * `continuousState_`.
+   */
+  void removeDCDiscreteFactor(const DCDiscreteFactor *factor);
+
+  /**
+   * Bring `discreteIsam_` up to date with any discrete factors added or
+   * refreshed since it was last updated.
+   *
+   * @param result - if provided, set to the result of the discrete update.
+   * @return the current discrete estimate.
+   */
+  const DiscreteValues &discreteEstimate(
+      DiscreteISAMResult *result = nullptr) const;
+
   // Global factor graph and iSAM2 instance
   gtsam::NonlinearFactorGraph fg_;  // NOTE: unused
-  gtsam::ISAM2Params isam_params_;
+  DCSAMParams params_;
   gtsam::ISAM2 isam_;
   gtsam::DiscreteFactorGraph dfg_;
   gtsam::Values currContinuous_;
   DiscreteValues currDiscrete_;
 
+  // Incremental discrete solver, along with the discrete factors added and the
+  // keys of those refreshed since it was last updated. Independent components
+  // are solved on `threadPool_` when `DCSAMParams::discreteThreads > 1`.
+  // Factors keep the same index in `dfg_` and `discreteIsam_`: the indices
+  // of the factors yet to be added are passed along with them. The slots of
+  // removed factors are reused by the next factors added, so neither graph
+  // grows beyond the largest number of discrete factors held at once.
+  // As with iSAM2's delta, the discrete solve is finished lazily by the const
+  // estimate accessors, so its state is mutable.
+  ThreadPool::shared_ptr threadPool_;
+  mutable DiscreteISAM discreteIsam_;
+  mutable gtsam::DiscreteFactorGraph newDiscreteFactors_;
+  mutable gtsam::FactorIndices newDiscreteIndices_;
+  mutable gtsam::KeySet discreteAffectedKeys_;
+  mutable gtsam::FactorIndices discreteRemoveIndices_;
+  std::vector<size_t> freeDiscreteSlots_;
+
+  // Indices into `dfg_` of the factors involving each discrete key.
+  gtsam::FastMap<gtsam::Key, std::vector<size_t>> discreteFactorsByKey_;
+
+  // Discrete variables frozen by `freezeConfidentDiscrete`, with their values,
+  // and the variables it has yet to check.
+  DiscreteValues frozenDiscrete_;
+  mutable gtsam::KeySet freezeCandidates_;
+
+  // Incremented whenever the continuous or discrete estimate changes.
+  mutable size_t estimateVersion_ = 0;
+
+  // DC continuous factors in `isam_`, keyed by their iSAM2 factor index.
+  gtsam::FastMap<gtsam::FactorIndex, boost::shared_ptr<DCContinuousFactor>>
+      dcContinuousFactors_;
+
+  // A DCDiscreteFactor in the discrete problem: either in `dfg_` at `index`
+  // or, with `DCSAMParams::fuseUnaryEvidence`, attached to the
+  // UnaryEvidenceFactor `fused` in `slot`.
+  struct DCDiscreteEntry {
+    boost::shared_ptr<DCDiscreteFactor> factor;
+    size_t index = 0;
+    UnaryEvidenceFactor::shared_ptr fused;
+    size_t slot = 0;
+  };
+
+  // DCDiscreteFactors in the discrete problem, which all read their
+  // continuous values from `continuousState_`, along with the positions of
+  // those involving each continuous key and the position of each factor.
+  std::vector<DCDiscreteEntry> dcDiscreteFactors_;
+  ContinuousStateStore::shared_ptr continuousState_;
+  gtsam::FastMap<gtsam::Key, std::vector<size_t>> dcDiscreteFactorsByKey_;
+  gtsam::FastMap<const DCDiscreteFactor *, size_t> dcDiscretePositions_;
 
-  std::vector<DCContinuousFactor::shared_ptr> dcContinuousFactors_;
-  gtsam::FastVector<gtsam::DiscreteFactor::shared_ptr> dcDiscreteFactors_;
+  // With `DCSAMParams::fuseUnaryEvidence`, the UnaryEvidenceFactor in `dfg_`
+  // for each discrete key.
+  gtsam::FastMap<gtsam::Key, UnaryEvidenceFactor::shared_ptr> evidence_;
 };
 }  // namespace dcsam
@@ -10,6 +10,8 @@
 
 #include <gtsam/discrete/DiscreteFactor.h>
 #include <gtsam/discrete/DiscreteMarginals.h>
+#include <gtsam/nonlinear/ISAM2Params.h>
+#include <gtsam/nonlinear/ISAM2Result.h>
 #include <gtsam/nonlinear/Marginals.h>
 
 #include <utility>
@@ -33,4 +35,122 @@ struct DCMarginals {
   gtsam::DiscreteMarginals discrete;
 };
 
+/**
+ * @brief Parameters for the DCSAM solver.
+ */
+struct DCSAMParams {
+  DCSAMParams() {
+    isamParams.relinearizeThreshold = 0.01;
+    isamParams.relinearizeSkip = 1;
+    isamParams.setOptimizationParams(gtsam::ISAM2DoglegParams());
+  }
+
+  // Parameters for the underlying iSAM2 instance used for the continuous
+  // variables. Defaults to Dogleg with relinearizeThreshold = 0.01 and
+  // relinearizeSkip = 1.
+  gtsam::ISAM2Params isamParams;
+
+  // Maximum number of discrete/continuous alternations to run per call to
+  // `DCSAM::update`. New factors are only added in the first one.
+  size_t maxIterations = 1;
+
+  // Stop alternating once the hybrid error (see `DCSAM::hybridError`) changes
+  // by no more than this amount between alternations. The change is computed
+  // from the factors involving variables whose estimate changed, rather than
+  // by re-evaluating the whole graph. Disabled when 0.
+  double hybridErrorTol = 0.0;
+
+  // Stop alternating as soon as an alternation leaves every discrete
+  // assignment unchanged.
+  bool stopOnNoDiscreteChange = true;
+
+  // Discrete variables whose marginal probability (over the connected
+  // component of the discrete graph they belong to) exceeds this threshold
+  // are frozen at their current value: their factors are conditioned on that
+  // value and removed from the active discrete problem, and their DC
+  // continuous factors are treated as plain nonlinear factors from then on.
+  // Variables in components too large to marginalize are never frozen.
+  // Disabled when 1.
+  double discreteFreezeThreshold = 1.0;
+
+  // Number of threads used to solve independent connected components of the
+  // discrete problem in parallel.
+  size_t discreteThreads = 1;
+
+  // Discrete analogue of `gtsam::ISAM2Params::relinearizeThreshold`: a
+  // DCDiscreteFactor is only refreshed with the latest continuous estimate when
+  // one of its continuous variables has moved by more than this amount (in the
+  // infinity norm of its local coordinates). With the default of 0, factors
+  // are refreshed whenever any of their continuous values change.
+  double discreteRefreshThreshold = 0.0;
+
+  // Fuse all unary discrete evidence on each discrete variable (discrete
+  // factors and DCFactors involving only that variable) into a single
+  // UnaryEvidenceFactor, so that repeated observations of a variable do not
+  // grow the discrete factor graph.
+  bool fuseUnaryEvidence = false;
+
+  // Solve the discrete problem by min-sum over factor errors (negative
+  // log-likelihoods) rather than max-product over probabilities. Products of
+  // many small probabilities can underflow to zero, leaving the MAP arbitrary;
+  // sums of errors do not.
+  bool discreteLogDomain = false;
+};
+
+/**
+ * @brief Information about a single call to `DCSAM::update`, in the spirit of
+ * `gtsam::ISAM2Result`.
+ */
+struct DCSAMUpdateResult {
+  // Wall-clock time (in seconds) spent in each phase of the update, summed
+  // over alternations, along with the counts below: splitting
+  // DCFactors into discrete and continuous parts, adding discrete factors
+  // (`updateDiscrete`), solving for the discrete variables
+  // (`solveDiscrete`), updating iSAM2, computing the continuous estimate
+  // (`calculateEstimate`) and refreshing the DCDiscreteFactors
+  // (`updateDiscreteInfo`).
+  double splitTime = 0.0;
+  double updateDiscreteTime = 0.0;
+  double solveDiscreteTime = 0.0;
+  double isamUpdateTime = 0.0;
+  double calculateEstimateTime = 0.0;
+  double updateDiscreteInfoTime = 0.0;
+
+  // Number of discrete variables whose assignment changed in the discrete
+  // solve.
+  size_t discreteVariablesChanged = 0;
+
+  // Number of existing DC continuous factors marked for relinearization
+  // because their discrete assignment changed.
+  size_t dcFactorsRelinearized = 0;
+
+  // Number of alternations between discrete and continuous optimization.
+  size_t iterations = 0;
+
+  // Change in the hybrid error over the last alternation, if more than one
+  // was run and `DCSAMParams::hybridErrorTol` is set.
+  double hybridErrorChange = 0.0;
+
+  // Number of DCDiscreteFactors refreshed with the latest continuous estimate
+  // after the final continuous solve.
+  size_t dcDiscreteFactorsRefreshed = 0;
+
+  // Number of DCDiscreteFactors left as-is because none of their variables
+  // moved by more than `DCSAMParams::discreteRefreshThreshold`.
+  size_t dcDiscreteFactorsSkipped = 0;
+
+  // Number of connected components of the discrete problem re-solved.
+  size_t discreteComponentsSolved = 0;
+
+  // Number of discrete variables re-eliminated in the discrete solve.
+  size_t discreteVariablesReeliminated = 0;
+
+  // Number of discrete variables frozen (see
+  // `DCSAMParams::discreteFreezeThreshold`).
+  size_t discreteVariablesFrozen = 0;
+
+  // Result of the last underlying iSAM2 update.
+  gtsam::ISAM2Result isamResult;
+};
+
 }  // namespace dcsam
@@ -9,15 +9,34 @@
 #pragma once
 
 #include <gtsam/base/Vector.h>
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/discrete/DiscreteKey.h>
 #include <math.h>
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace dcsam {
 
-inline std::vector<double> expNormalize(const std::vector<double> &logProbs) {
+/**
+ * Normalize the `n` log probabilities at `values` in place, replacing them
+ * with the corresponding probabilities. This is the allocation-free kernel
+ * behind `expNormalize`, for hot paths that already have a buffer to work in.
+ *
+ * Invalid inputs are handled without throwing: NaNs are treated as impossible
+ * (log probability -inf); if any value is +inf, the probability is split
+ * evenly between the infinite values; and if every value is -inf, the result
+ * is uniform.
+ *
+ * @return the log of the normalizing constant (the log-sum-exp of the
+ * inputs), which is only finite if the inputs were valid.
+ */
+inline double expNormalizeInPlace(double *values, size_t n) {
   /*
    * Normalizing a set of log probabilities in a numerically stable way is
    * tricky. To avoid overflow/underflow issues, we compute the largest
@@ -32,47 +51,54 @@ inline std::vector<double> expNormalize(const std::vector<double> &logProbs) {
    * of the (unnormalized) log probabilities are either very large or very
    * small.
    */
+  constexpr double kInf = std::numeric_limits<double>::infinity();
+  if (n == 0) return -kInf;
 
-  std::vector<double> cleanLogProbs;
-  double maxLogProb = -std::numeric_limits<double>::infinity();
-  for (size_t i = 0; i < logProbs.size(); i++) {
-    double logProb = (!std::isnan(logProbs[i]))
-                         ? logProbs[i]
-                         : -std::numeric_limits<double>::infinity();
-    if ((logProb != std::numeric_limits<double>::infinity()) &&
-        logProb > maxLogProb) {
-      maxLogProb = logProb;
-    }
-    cleanLogProbs.push_back(logProb);
+  double maxLogProb = -kInf;
+  size_t numInfinite = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (std::isnan(values[i])) values[i] = -kInf;
+    if (values[i] == kInf)
+      numInfinite++;
+    else
+      maxLogProb = std::max(maxLogProb, values[i]);
   }
-
-  // After computing the max = "Z" of the log probabilities L_i, we compute
-  // the log of the normalizing constant, log S, where S = sum_j exp(L_j - Z).
-  double total = 0.0;
-  for (size_t i = 0; i < cleanLogProbs.size(); i++) {
-    double probPrime = exp(cleanLogProbs[i] - maxLogProb);
-    total += probPrime;
+  if (numInfinite > 0) {
+    for (size_t i = 0; i < n; i++) {
+      values[i] = (values[i] == kInf) ? 1.0 / numInfinite : 0.0;
+    }
+    return kInf;
   }
-  double logTotal = log(total);
-
-  // Now we compute the (normalized) probability (for each i):
-  // p_i = exp(L_i - Z - log S)
-  double checkNormalization = 0.0;
-  std::vector<double> probs;
-  for (size_t i = 0; i < cleanLogProbs.size(); i++) {
-    double prob = exp(cleanLogProbs[i] - maxLogProb - logTotal);
-    probs.push_back(prob);
-    checkNormalization += prob;
+  if (maxLogProb == -kInf) {
+    std::fill(values, values + n, 1.0 / n);
+    return -kInf;
   }
 
-  // Numerical tolerance for floating point comparisons
-  double tol = 1e-9;
+  // With Z = "maxLogProb", compute exp(L_i - Z) and the normalizing constant
+  // S = sum_j exp(L_j - Z), then p_i = exp(L_i - Z) / S. Eigen evaluates the
+  // exponentials with SIMD instructions where available, but (unlike std::exp)
+  // clamps its inputs, so impossible values are zeroed explicitly.
+  Eigen::Map<Eigen::ArrayXd> probs(values, n);
+  probs = (probs == -kInf).select(0.0, (probs - maxLogProb).exp());
+  const double total = probs.sum();
+  probs /= total;
+  return maxLogProb + std::log(total);
+}
 
-  if (!gtsam::fpEqual(checkNormalization, 1.0, tol)) {
+/**
+ * Normalize a set of log probabilities, as in `expNormalizeInPlace`.
+ *
+ * @throws std::logic_error if the log probabilities cannot be normalized (they
+ * are empty, all -inf or NaN, or some are +inf).
+ */
+inline std::vector<double> expNormalize(const std::vector<double> &logProbs) {
+  std::vector<double> probs = logProbs;
+  const double logTotal = expNormalizeInPlace(probs.data(), probs.size());
+  if (!std::isfinite(logTotal)) {
     std::string errMsg =
         std::string("expNormalize failed to normalize probabilities. ") +
-        std::string("Expected normalization constant = 1.0. Got value: ") +
-        std::to_string(checkNormalization) +
+        std::string("Log normalization constant: ") +
+        std::to_string(logTotal) +
         std::string(
             "\n This could have resulted from numerical overflow/underflow.");
     throw std::logic_error(errMsg);
@@ -80,4 +106,47 @@ inline std::vector<double> expNormalize(const std::vector<double> &logProbs) {
   return probs;
 }
 
+/**
+ * Build the product of unary factors, where `probs[i]` holds the values of
+ * the factor on `keys[i]`, as a single gtsam::DecisionTreeFactor. The joint
+ * table is filled in directly (one pass per key) rather than multiplying the
+ * unary factors together, which builds and prunes a new tree each time. Keys
+ * may repeat, in which case their values are multiplied together.
+ */
+inline gtsam::DecisionTreeFactor unaryProductFactor(
+    const gtsam::DiscreteKeys &keys,
+    const std::vector<std::vector<double>> &probs) {
+  // Merge repeated keys.
+  gtsam::DiscreteKeys distinctKeys;
+  std::vector<std::vector<double>> distinctProbs;
+  for (size_t i = 0; i < keys.size(); i++) {
+    size_t j = 0;
+    while (j < distinctKeys.size() && distinctKeys[j].first != keys[i].first)
+      j++;
+    if (j == distinctKeys.size()) {
+      distinctKeys.push_back(keys[i]);
+      distinctProbs.push_back(probs[i]);
+      continue;
+    }
+    for (size_t v = 0; v < keys[i].second; v++)
+      distinctProbs[j][v] *= probs[i][v];
+  }
+  if (distinctKeys.empty()) return gtsam::DecisionTreeFactor();
+
+  // The table is indexed with the last key varying fastest, so each key
+  // expands every existing entry into one entry per value of the key.
+  std::vector<double> table(1, 1.0);
+  for (size_t i = 0; i < distinctKeys.size(); i++) {
+    const std::vector<double> &p = distinctProbs[i];
+    std::vector<double> expanded(table.size() * p.size());
+    for (size_t j = 0; j < table.size(); j++) {
+      for (size_t v = 0; v < p.size(); v++) {
+        expanded[j * p.size() + v] = table[j] * p[v];
+      }
+    }
+    table = std::move(expanded);
+  }
+  return gtsam::DecisionTreeFactor(distinctKeys, table);
+}
+
 }  // namespace dcsam
@@ -0,0 +1,177 @@
+/**
+ *
+ * @file DenseDiscreteFactor.h
+ * @brief Discrete factor stored as a dense table
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/discrete/DiscreteFactor.h>
+#include <gtsam/discrete/DiscreteKey.h>
+
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+#include "dcsam/DCSAM_types.h"
+
+namespace dcsam {
+
+/**
+ * @brief A discrete factor stored as a dense, contiguous table of values.
+ *
+ * gtsam::DecisionTreeFactor stores its values in a tree, which pays off for
+ * large, highly structured factors but is mostly pointer-chasing and
+ * allocation for the small tables (a handful of variables with 2-20 values
+ * each) typical of semantic SLAM. Here the table is a flat array indexed with
+ * the last key varying fastest (as in the DecisionTreeFactor constructor from
+ * a vector of values), and products and sum/max marginalization are simple
+ * loops over contiguous rows.
+ *
+ * DiscreteISAM eliminates with DenseDiscreteFactors internally; conversion to
+ * and from gtsam::DecisionTreeFactor only happens at the boundary with GTSAM.
+ *
+ * The same table can instead hold errors (negative log-likelihoods) for
+ * min-sum inference, combining factors with `operator+` and eliminating with
+ * `min`, which is numerically stable and needs no exp/log calls.
+ */
+class DenseDiscreteFactor : public gtsam::DiscreteFactor {
+ protected:
+  // Keys in table order (the last varies fastest), the stride of each in the
+  // table, and the table itself.
+  gtsam::DiscreteKeys dkeys_;
+  std::vector<size_t> strides_;
+  std::vector<double> table_;
+
+ public:
+  using Base = gtsam::DiscreteFactor;
+  using shared_ptr = boost::shared_ptr<DenseDiscreteFactor>;
+
+  /**
+   * Constant factor with value 1 and no keys.
+   */
+  DenseDiscreteFactor();
+
+  /**
+   * @param keys - the discrete variables of the factor, which must be
+   * distinct.
+   * @param table - the value for every assignment to `keys`, with the last key
+   * varying fastest.
+   */
+  DenseDiscreteFactor(const gtsam::DiscreteKeys& keys,
+                      std::vector<double> table);
+
+  /**
+   * Evaluate `f` for every assignment to its keys.
+   */
+  explicit DenseDiscreteFactor(const gtsam::DecisionTreeFactor& f);
+
+  /**
+   * @return the discrete keys of the factor, in table order.
+   */
+  const gtsam::DiscreteKeys& discreteKeys() const { return dkeys_; }
+
+  /**
+   * @return the values of the factor, in table order.
+   */
+  const std::vector<double>& table() const { return table_; }
+
+  /**
+   * @return the cardinality of `key`, or 0 if it is not involved.
+   */
+  size_t cardinality(const gtsam::Key key) const;
+
+  /**
+   * @return the product of this factor with `other`, over the union of their
+   * keys (ours first, followed by any new keys from `other`).
+   */
+  DenseDiscreteFactor operator*(const DenseDiscreteFactor& other) const;
+
+  /**
+   * @return the sum of this factor and `other`, with keys as in `operator*`.
+   * Used to combine error tables.
+   */
+  DenseDiscreteFactor operator+(const DenseDiscreteFactor& other) const;
+
+  /**
+   * @return this factor with `key` summed out, or a copy of this factor if it
+   * does not involve `key`.
+   */
+  DenseDiscreteFactor sum(const gtsam::Key key) const;
+
+  /**
+   * @return this factor with `key` maximized out, or a copy of this factor if
+   * it does not involve `key`.
+   */
+  DenseDiscreteFactor max(const gtsam::Key key) const;
+
+  /**
+   * @return this factor with `key` minimized out, or a copy of this factor if
+   * it does not involve `key`.
+   */
+  DenseDiscreteFactor min(const gtsam::Key key) const;
+
+  /**
+   * Replace every value in the table by its negative log, i.e. convert a table
+   * of probabilities to a table of errors.
+   */
+  void negLog();
+
+  bool equals(const DiscreteFactor& other, double tol = 1e-9) const override;
+
+  double operator()(const DiscreteValues& values) const override;
+
+  gtsam::DecisionTreeFactor toDecisionTreeFactor() const override;
+
+  gtsam::DecisionTreeFactor operator*(
+      const gtsam::DecisionTreeFactor& f) const override {
+    return toDecisionTreeFactor() * f;
+  }
+
+  std::string markdown(const gtsam::KeyFormatter& keyFormatter,
+                       const Names& names) const override {
+    return toDecisionTreeFactor().markdown(keyFormatter, names);
+  }
+
+  std::string html(const gtsam::KeyFormatter& keyFormatter,
+                   const Names& names) const override {
+    return toDecisionTreeFactor().markdown(keyFormatter, names);
+  }
+
+ private:
+  enum class Reduction { kSum, kMax, kMin };
+
+  // Set `keys_` and `strides_` from `dkeys_`.
+  void initialize();
+
+  // Stride of `key` in the table, or 0 if it is not involved.
+  size_t stride(const gtsam::Key key) const;
+
+  // Add (if `add` is set) or multiply `other` into this factor.
+  DenseDiscreteFactor combine(const DenseDiscreteFactor& other,
+                              bool add) const;
+
+  // Sum, max or min out `key`.
+  DenseDiscreteFactor reduce(const gtsam::Key key, Reduction reduction) const;
+};
+
+/**
+ * Convert any discrete factor to a DenseDiscreteFactor, directly from the
+ * factor's own representation for the dense-aware factor types in dcsam
+ * (DenseDiscreteFactor, DiscretePriorFactor, DCDiscreteFactor and
+ * UnaryEvidenceFactor), or by way of its DecisionTreeFactor otherwise.
+ */
+DenseDiscreteFactor toDenseFactor(const gtsam::DiscreteFactor& factor);
+
+/**
+ * Convert any discrete factor to a DenseDiscreteFactor holding its errors
+ * (negative log-likelihoods). DCDiscreteFactors are evaluated directly with
+ * DCFactor::error and UnaryEvidenceFactors from their log-likelihoods, so
+ * neither goes through (possibly underflowing) probabilities.
+ */
+DenseDiscreteFactor toDenseErrorFactor(const gtsam::DiscreteFactor& factor);
+
+}  // namespace dcsam
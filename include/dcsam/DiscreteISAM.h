@@ -0,0 +1,292 @@
+/**
+ * @file DiscreteISAM.h
+ * @brief Incremental MAP inference for discrete factor graphs
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/base/Vector.h>
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/discrete/DiscreteFactor.h>
+#include <gtsam/discrete/DiscreteFactorGraph.h>
+#include <gtsam/inference/Key.h>
+
+#include <boost/optional.hpp>
+#include <unordered_set>
+#include <vector>
+
+#include "dcsam/DCSAM_types.h"
+#include "dcsam/DenseDiscreteFactor.h"
+#include "dcsam/ThreadPool.h"
+
+namespace dcsam {
+
+/**
+ * @brief Summary of the work done by a single call to `DiscreteISAM::update`,
+ * loosely modeled on gtsam::ISAM2Result.
+ */
+struct DiscreteISAMResult {
+  // Number of variables whose cliques were re-eliminated.
+  size_t variablesReeliminated = 0;
+
+  // Number of variables visited during back-substitution.
+  size_t variablesSolved = 0;
+
+  // Number of those variables that only have unary factors, and were solved
+  // directly (see `DiscreteISAM`).
+  size_t unaryVariablesSolved = 0;
+
+  // Keys of the variables whose MAP assignment changed in this update.
+  gtsam::KeySet changedKeys;
+
+  // Indices of the new factors, as in gtsam::ISAM2Result.
+  gtsam::FactorIndices newFactorsIndices;
+
+  // Keys of the variables dropped from the problem because all of their
+  // factors were removed.
+  gtsam::KeySet removedKeys;
+
+  // Number of connected components of the discrete graph that were touched
+  // by this update (and re-solved independently).
+  size_t componentsSolved = 0;
+};
+
+/**
+ * @brief Incremental max-product solver for discrete factor graphs. This is
+ * the discrete analogue of iSAM2 used internally by DCSAM so that the cost of
+ * a discrete solve depends on the part of the graph touched by an update
+ * rather than on the size of the whole graph.
+ *
+ * Internally we keep the result of max-product variable elimination as a
+ * Bayes tree with a single frontal variable per clique. Each clique stores the
+ * product of the factors eliminated into it (used for back-substitution) and
+ * the max-marginal message passed to its parent, as DenseDiscreteFactors.
+ *
+ * On `update`, the cliques containing any new or affected key are removed
+ * along with all of their ancestors (the "top" of the tree). The original
+ * factors belonging to those cliques are re-eliminated together with the new
+ * factors and the cached messages from the untouched (orphaned) subtrees,
+ * which are then re-attached beneath the new top. Back-substitution starts
+ * from the re-eliminated cliques and only descends into subtrees whose
+ * separator assignment has changed.
+ *
+ * Factors are held by pointer, so a factor whose values change in place (for
+ * example a DCDiscreteFactor with refreshed continuous values) is picked up by
+ * passing its keys in `affectedKeys`. As in iSAM2, factors are identified by
+ * their index (in the order they were added, unless the caller places them
+ * in the slots of removed factors), and can be removed by index, which
+ * re-eliminates the cliques involving their keys. Variables left without any
+ * factors are dropped from the problem.
+ *
+ * The connected components of the graph are tracked incrementally: each key
+ * is labeled with its component, and merging two components relabels the
+ * keys of the smaller one. Each component touched by an update is solved as
+ * an independent subproblem, and if a ThreadPool is provided, subproblems are
+ * solved in parallel. When factors are removed, the components they belonged
+ * to are rebuilt by a search over the remaining factors. A component that
+ * split or lost keys is re-eliminated from scratch, so that its parts are
+ * solved independently again (and a variable left alone takes the unary path
+ * below).
+ *
+ * Components consisting of a single variable (i.e. variables with only unary
+ * factors, like most landmark class variables) skip elimination entirely:
+ * the MAP value is the argmax of the summed log-likelihoods of the factors,
+ * which is kept up to date incrementally, so adding a new unary factor costs
+ * O(cardinality).
+ *
+ * By default, elimination is max-product over the factors' probability
+ * tables. With `logDomain` set, it is min-sum over their error (negative
+ * log-likelihood) tables instead (see `toDenseErrorFactor`), which does not
+ * underflow however much evidence is stacked on a variable.
+ */
+class DiscreteISAM {
+ public:
+  /**
+   * @param threadPool - if provided, used to solve independent components of
+   * the problem concurrently.
+   * @param logDomain - if true, use min-sum elimination over error tables
+   * rather than max-product over probability tables.
+   */
+  explicit DiscreteISAM(
+      ThreadPool::shared_ptr threadPool = ThreadPool::shared_ptr(),
+      bool logDomain = false);
+
+  /**
+   * Add `newFactors` to the solver, remove the factors in
+   * `removeFactorIndices`, re-eliminate the cliques involving any of their
+   * keys or `affectedKeys`, and update the MAP estimate.
+   *
+   * @param newFactors - discrete factors to add to the problem. Each is
+   * given the next factor index, including any null factors, unless
+   * `newFactorsIndices` is provided.
+   * @param affectedKeys - keys involved in previously added factors whose
+   * values have changed since the last update.
+   * @param removeFactorIndices - indices of previously added factors to
+   * remove. They are removed before `newFactors` are added.
+   * @param newFactorsIndices - if not empty, the index to give each of
+   * `newFactors`: either the slot of a removed factor (including those in
+   * `removeFactorIndices`) or past the end, leaving any skipped slots empty.
+   * @return a DiscreteISAMResult summarizing the work done.
+   */
+  DiscreteISAMResult update(
+      const gtsam::DiscreteFactorGraph &newFactors =
+          gtsam::DiscreteFactorGraph(),
+      const gtsam::KeySet &affectedKeys = gtsam::KeySet(),
+      const gtsam::FactorIndices &removeFactorIndices = gtsam::FactorIndices(),
+      const gtsam::FactorIndices &newFactorsIndices = gtsam::FactorIndices());
+
+  /**
+   * @return the MAP assignment to the discrete variables as of the last call
+   * to `update`.
+   */
+  const DiscreteValues &estimate() const { return estimate_; }
+
+  /**
+   * @return all of the factors in the solver, indexed by factor index. The
+   * slots of removed factors are null until they are reused.
+   */
+  const gtsam::DiscreteFactorGraph &getFactorsUnsafe() const {
+    return factors_;
+  }
+
+  /**
+   * @return the indices of the factors involving `key` (empty if there are
+   * none).
+   */
+  const std::vector<size_t> &factorsInvolving(const gtsam::Key key) const;
+
+  /**
+   * @return the number of discrete variables in the problem.
+   */
+  size_t size() const { return cliques_.size(); }
+
+  /**
+   * @return the cardinality of the variable `key`, or 0 if it is not part of
+   * the problem.
+   */
+  size_t cardinality(const gtsam::Key key) const {
+    auto it = cliques_.find(key);
+    return (it == cliques_.end()) ? 0 : it->second.cardinality;
+  }
+
+  /**
+   * @return the number of connected components in the discrete graph.
+   */
+  size_t numComponents() const { return componentMembers_.size(); }
+
+  /**
+   * @return the variables in the connected component containing `key`
+   * (starting with `key` itself), or an empty vector if `key` is not part of
+   * the problem or the component has more than `kMaxMarginalAssignments`
+   * joint assignments.
+   */
+  gtsam::KeyVector componentKeys(const gtsam::Key key) const;
+
+  /**
+   * @return the marginal distribution of `key`, or an empty vector if
+   * `componentKeys(key)` is empty. The other variables of its component are
+   * summed out of the product of its factors one at a time (sum-product
+   * variable elimination over dense tables), as of their current values.
+   */
+  std::vector<double> marginal(const gtsam::Key key) const;
+
+  // Components with more joint assignments than this are too large for
+  // `marginal`.
+  static constexpr size_t kMaxMarginalAssignments = 1 << 16;
+
+ private:
+  // A clique in the Bayes tree, with a single frontal variable.
+  struct Clique {
+    // Elimination order of the frontal variable. Parents are always
+    // eliminated after their children.
+    size_t order = 0;
+
+    // Cardinality of the frontal variable.
+    size_t cardinality = 1;
+
+    // Indices into `factors_` of the original factors eliminated here.
+    std::vector<size_t> factors;
+
+    // Product of all factors and child messages eliminated here, over the
+    // frontal variable and its separator (or in the log domain, the sum of
+    // their errors).
+    DenseDiscreteFactor product;
+
+    // Max-marginal passed to the parent: `product` maximized over the
+    // frontal variable (or in the log domain, minimized).
+    DenseDiscreteFactor message;
+
+    // For variables with only unary factors, which skip elimination: the sum
+    // of the log of each factor, for each value of the variable.
+    gtsam::Vector logLikelihood;
+
+    boost::optional<gtsam::Key> parent;
+    std::vector<gtsam::Key> children;
+  };
+
+  // The part of an update falling in a single connected component.
+  struct Subproblem {
+    // Touched keys, and indices into `factors_` of new factors.
+    gtsam::KeyVector touched;
+    std::vector<size_t> newFactors;
+
+    // Keys to re-eliminate, in elimination order, and those among them that
+    // are new to the problem.
+    gtsam::KeyVector ordering;
+    gtsam::KeyVector newKeys;
+    std::unordered_set<gtsam::Key> top;
+
+    // Elimination order assigned to the first key in `ordering`.
+    size_t orderBase = 0;
+
+    // True if the component is a single variable with only unary factors,
+    // and if that variable is in the update's `affectedKeys` (or lost one of
+    // its factors, or was split off from a larger component).
+    bool unary = false;
+    bool refresh = false;
+  };
+
+  // The key identifying the component containing `key`.
+  gtsam::Key findComponent(const gtsam::Key key) const {
+    return components_.at(key);
+  }
+
+  // Merge the components containing `a` and `b`.
+  void mergeComponents(gtsam::Key a, gtsam::Key b);
+
+  // Recompute the components of the keys in the component `root`, after some
+  // of its factors were removed. If it split or lost keys, the Bayes tree
+  // links between its keys are dropped and its remaining keys, which all
+  // need to be re-eliminated, are returned; otherwise nothing is returned.
+  gtsam::KeyVector rebuildComponent(const gtsam::Key root);
+
+  // Work out the keys to re-eliminate (and their order) for `sub`.
+  void prepare(Subproblem *sub) const;
+
+  // Re-eliminate and back-substitute `sub`. Only touches the cliques and
+  // estimates of keys in its component, so different subproblems can be
+  // solved concurrently.
+  void solve(const Subproblem &sub, DiscreteISAMResult *result);
+
+  // Solve a `unary` subproblem directly, without elimination.
+  void solveUnary(const Subproblem &sub, DiscreteISAMResult *result);
+
+  gtsam::DiscreteFactorGraph factors_;
+  gtsam::FastMap<gtsam::Key, std::vector<size_t>> variableIndex_;
+  gtsam::FastMap<gtsam::Key, Clique> cliques_;
+  DiscreteValues estimate_;
+  size_t nextOrder_ = 0;
+
+  // Connected components of the graph, each identified by one of its keys
+  // (the first in its list of keys): the component of each key, and the keys
+  // in each component.
+  gtsam::FastMap<gtsam::Key, gtsam::Key> components_;
+  gtsam::FastMap<gtsam::Key, gtsam::KeyVector> componentMembers_;
+
+  ThreadPool::shared_ptr threadPool_;
+  bool logDomain_ = false;
+};
+
+}  // namespace dcsam
@@ -13,6 +13,8 @@
 
 #include <vector>
 
+#include "dcsam/DenseDiscreteFactor.h"
+
 namespace dcsam {
 
 /**
@@ -78,6 +80,10 @@ class DiscretePriorFactor : public gtsam::DiscreteFactor {
     return toDecisionTreeFactor() * f;
   }
 
+  DenseDiscreteFactor toDenseFactor() const {
+    return DenseDiscreteFactor(gtsam::DiscreteKeys(dk_), probs_);
+  }
+
   double operator()(const DiscreteValues& values) const override {
     size_t assignment = values.at(dk_.first);
     return probs_[assignment];
@@ -0,0 +1,92 @@
+/**
+ *
+ * @file EvaluationPoint.h
+ * @brief State at which a DCFactor's memoized evaluations were computed
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/discrete/DiscreteKey.h>
+#include <gtsam/inference/Key.h>
+#include <gtsam/nonlinear/Values.h>
+
+#include "dcsam/DCSAM_types.h"
+
+namespace dcsam {
+
+/**
+ * @brief The continuous and discrete values of a factor's variables at which
+ * some memoized result was computed.
+ *
+ * Factors whose evaluations share expensive intermediate results (e.g. the
+ * component errors of a mixture) keep an EvaluationPoint alongside the
+ * results, recompute them whenever `matches` fails, and then `set` the new
+ * point. Only the factor's own variables are stored and compared, and
+ * continuous values are compared exactly, so any change to them (however
+ * small) invalidates the results.
+ */
+class EvaluationPoint {
+ public:
+  /**
+   * @return true if a point has been set and `continuousVals` and
+   * `discreteVals` agree with it on `keys` and `discreteKeys` (including on
+   * which of the discrete keys are assigned at all).
+   */
+  bool matches(const gtsam::KeyVector& keys,
+               const gtsam::DiscreteKeys& discreteKeys,
+               const gtsam::Values& continuousVals,
+               const DiscreteValues& discreteVals) const {
+    if (!valid_) return false;
+    for (const gtsam::Key k : keys) {
+      if (!continuousVals.exists(k) ||
+          !continuousVals.at(k).equals_(continuousVals_.at(k), 0.0))
+        return false;
+    }
+    for (const gtsam::DiscreteKey& dk : discreteKeys) {
+      auto it = discreteVals.find(dk.first);
+      auto stored = discreteVals_.find(dk.first);
+      if ((it == discreteVals.end()) != (stored == discreteVals_.end()))
+        return false;
+      if (it != discreteVals.end() && it->second != stored->second)
+        return false;
+    }
+    return true;
+  }
+
+  /**
+   * Store the values of `keys` and `discreteKeys` from `continuousVals` and
+   * `discreteVals` as the current point. If any of `keys` is missing, the
+   * point is left unset, so that nothing matches it.
+   */
+  void set(const gtsam::KeyVector& keys,
+           const gtsam::DiscreteKeys& discreteKeys,
+           const gtsam::Values& continuousVals,
+           const DiscreteValues& discreteVals) {
+    continuousVals_.clear();
+    for (const gtsam::Key k : keys) {
+      if (continuousVals.exists(k))
+        continuousVals_.insert(k, continuousVals.at(k));
+    }
+    discreteVals_.clear();
+    for (const gtsam::DiscreteKey& dk : discreteKeys) {
+      auto it = discreteVals.find(dk.first);
+      if (it != discreteVals.end()) discreteVals_[dk.first] = it->second;
+    }
+    valid_ = continuousVals_.size() == keys.size();
+  }
+
+  /**
+   * Forget the current point, e.g. when something other than the values
+   * that the memoized results depend on has changed.
+   */
+  void invalidate() { valid_ = false; }
+
+ private:
+  bool valid_ = false;
+  gtsam::Values continuousVals_;
+  DiscreteValues discreteVals_;
+};
+
+}  // namespace dcsam
@@ -19,6 +19,7 @@
 #include <math.h>
 
 #include <algorithm>
+#include <boost/optional.hpp>
 #include <limits>
 #include <type_traits>
 #include <vector>
@@ -43,6 +44,9 @@ class SemanticBearingRangeFactor : public DCFactor {
   gtsam::BearingRangeFactor<PoseType, PointType> factor_;
   std::vector<double> probs_;
 
+  // Computed at construction, unless it depends on the continuous values.
+  boost::optional<double> logNormalizingConstant_;
+
  public:
   using Base = DCFactor;
 
@@ -62,6 +66,7 @@ class SemanticBearingRangeFactor : public DCFactor {
     keys_ = keys;
     discreteKeys_ = dks;
     gtsam::BearingRangeFactor<PoseType, PointType> brfactor;
+    logNormalizingConstant_ = fixedLogNormalizingConstant(factor_);
   }
 
   virtual ~SemanticBearingRangeFactor() = default;
@@ -72,6 +77,7 @@ class SemanticBearingRangeFactor : public DCFactor {
     this->probs_ = rhs.probs_;
     this->keys_ = rhs.keys_;
     this->discreteKeys_ = rhs.discreteKeys_;
+    this->logNormalizingConstant_ = rhs.logNormalizingConstant_;
     return *this;
   }
 
@@ -86,6 +92,24 @@ class SemanticBearingRangeFactor : public DCFactor {
     return factor_.error(continuousVals) - discrete_error;
   }
 
+  // The bearing-range error doesn't depend on the semantic class, so it is
+  // only computed once for all of the assignments.
+  void evalErrors(const gtsam::DiscreteKey& dk,
+                  const gtsam::Values& continuousVals,
+                  const DiscreteValues& discreteVals,
+                  double* errors) const override {
+    const double continuous_error = factor_.error(continuousVals);
+    if (dk.first != discreteKeys_[0].first) {
+      const size_t assignment = discreteVals.at(discreteKeys_[0].first);
+      std::fill(errors, errors + dk.second,
+                continuous_error - log(probs_[assignment]));
+      return;
+    }
+    for (size_t i = 0; i < dk.second; i++) {
+      errors[i] = continuous_error - log(probs_[i]);
+    }
+  }
+
   // dim is the dimension of the underlying bearingrange factor
   size_t dim() const override { return factor_.dim(); }
 
@@ -115,6 +139,7 @@ class SemanticBearingRangeFactor : public DCFactor {
   }
 
   double logNormalizingConstant(const gtsam::Values& values) const override {
+    if (logNormalizingConstant_) return *logNormalizingConstant_;
     return nonlinearFactorLogNormalizingConstant(this->factor_, values);
   }
 };
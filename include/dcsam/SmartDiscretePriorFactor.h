@@ -19,6 +19,10 @@ namespace dcsam {
  *
  * Simply augments DiscretePriorFactor with `updateProbs` function to modify the
  * `probs_` member variable directly.
+ *
+ * DCSAM only re-solves the parts of the discrete problem that it knows have
+ * changed, so after calling `updateProbs` on a factor held by a DCSAM
+ * instance, pass its key to `DCSAM::markDiscreteFactorsChanged`.
  */
 class SmartDiscretePriorFactor : public DiscretePriorFactor {
  public:
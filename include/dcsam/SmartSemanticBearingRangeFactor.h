@@ -33,6 +33,7 @@ class SmartSemanticBearingRangeFactor : public SemanticBearingRangeFactor {
   void updateProbs(const std::vector<double>& probs) {
     assert(probs.size() == probs_.size());
     probs_ = probs;
+    invalidateEvaluationCache();
   }
 };
 
@@ -0,0 +1,85 @@
+/**
+ * @file ThreadPool.h
+ * @brief Minimal fixed-size thread pool for data-parallel loops
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <atomic>
+#include <boost/shared_ptr.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dcsam {
+
+/**
+ * @brief A fixed set of worker threads used to run the iterations of a loop
+ * in parallel, e.g. to solve independent pieces of the discrete problem.
+ *
+ * The threads are started once and reused by every call to `parallelFor`, so
+ * there is no per-call thread creation cost. Only one `parallelFor` may run at
+ * a time.
+ */
+class ThreadPool {
+ public:
+  using shared_ptr = boost::shared_ptr<ThreadPool>;
+
+  /**
+   * @param numThreads - total number of threads to use, including the thread
+   * calling `parallelFor`.
+   */
+  explicit ThreadPool(size_t numThreads);
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+   * @return the total number of threads used by `parallelFor`.
+   */
+  size_t size() const { return workers_.size() + 1; }
+
+  /**
+   * Call `f(i)` for each i in [0, n), spreading the calls over the pool, and
+   * return once they have all finished. The calling thread also does work.
+   * Threads claim contiguous chunks of indices, a few per thread, so that
+   * cheap iterations are not dominated by handing them out.
+   * If any call throws, the first exception is rethrown here.
+   */
+  void parallelFor(size_t n, const std::function<void(size_t)> &f);
+
+ private:
+  // Main loop of each worker thread.
+  void run();
+
+  // Run chunks of `chunk` iterations of the current job until there are none
+  // left.
+  void work(const std::function<void(size_t)> &f, size_t n, size_t chunk);
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+
+  // The current job, guarded by `mutex_`. Each job bumps `generation_` so
+  // that workers can tell a new job from one they have already finished.
+  // Iterations are claimed from `next_` without taking the lock.
+  const std::function<void(size_t)> *job_ = nullptr;
+  size_t jobSize_ = 0;
+  size_t chunkSize_ = 1;
+  std::atomic<size_t> next_{0};
+  size_t active_ = 0;
+  size_t generation_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+};
+
+}  // namespace dcsam
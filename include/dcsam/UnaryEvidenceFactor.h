@@ -0,0 +1,223 @@
+/**
+ *
+ * @file UnaryEvidenceFactor.h
+ * @brief Fused unary evidence on a single discrete variable
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#pragma once
+
+#include <gtsam/base/Vector.h>
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/discrete/DiscreteFactor.h>
+#include <gtsam/discrete/DiscreteKey.h>
+
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dcsam/DCDiscreteFactor.h"
+#include "dcsam/DenseDiscreteFactor.h"
+
+namespace dcsam {
+
+/**
+ * @brief A single factor holding all of the unary evidence on a discrete
+ * variable, as a running log-likelihood vector.
+ *
+ * Repeated observations of the same variable (e.g. semantic measurements of a
+ * landmark's class) would otherwise each add a factor to the discrete graph.
+ * Instead, DCSAM fuses them into one UnaryEvidenceFactor per variable, so the
+ * size of the discrete graph scales with the number of variables rather than
+ * the number of observations:
+ *
+ * - Static evidence (e.g. a DiscretePriorFactor) is folded into the
+ * log-likelihood with `add` and then discarded.
+ *
+ * - Unary DCDiscreteFactors depend on continuous values that can change, so
+ * they are kept (with `addDynamic`) along with their latest contribution,
+ * which is recomputed with `refresh` when their continuous values change.
+ *
+ * Either way, incorporating an observation costs O(cardinality).
+ */
+class UnaryEvidenceFactor : public gtsam::DiscreteFactor {
+ protected:
+  gtsam::DiscreteKey dk_;
+  gtsam::Vector staticLogLikelihood_;
+  std::vector<boost::shared_ptr<DCDiscreteFactor>> dynamic_;
+  std::vector<gtsam::Vector> dynamicLogLikelihoods_;
+  gtsam::Vector logLikelihood_;
+
+ public:
+  using Base = gtsam::DiscreteFactor;
+  using shared_ptr = boost::shared_ptr<UnaryEvidenceFactor>;
+
+  UnaryEvidenceFactor() = default;
+
+  explicit UnaryEvidenceFactor(const gtsam::DiscreteKey& dk)
+      : dk_(dk),
+        staticLogLikelihood_(gtsam::Vector::Zero(dk.second)),
+        logLikelihood_(gtsam::Vector::Zero(dk.second)) {
+    keys_.push_back(dk.first);
+  }
+
+  /**
+   * Fold a static unary factor on this variable into the log-likelihood.
+   */
+  void add(const gtsam::DiscreteFactor& factor) {
+    const gtsam::Vector contribution = evaluate(factor);
+    staticLogLikelihood_ += contribution;
+    logLikelihood_ += contribution;
+  }
+
+  /**
+   * Attach a unary DCDiscreteFactor on this variable. Its contribution is
+   * computed on the first call to `refresh`.
+   *
+   * @return the slot of the factor, to be passed to `refresh`.
+   */
+  size_t addDynamic(const boost::shared_ptr<DCDiscreteFactor>& factor) {
+    dynamic_.push_back(factor);
+    dynamicLogLikelihoods_.push_back(gtsam::Vector::Zero(dk_.second));
+    return dynamic_.size() - 1;
+  }
+
+  /**
+   * Recompute the contribution of the DCDiscreteFactor in `slot`, e.g. after
+   * its continuous values have changed. The factor's errors are evaluated
+   * directly over this variable, so no discrete value is needed for it,
+   * unless its table does not come from its error (see
+   * `DCFactor::errorMatchesTable`).
+   */
+  void refresh(size_t slot) {
+    const DCDiscreteFactor& factor = *dynamic_[slot];
+    gtsam::Vector contribution(dk_.second);
+    if (factor.dcfactor()->errorMatchesTable()) {
+      if (!factor.continuousInitialized()) return;
+      factor.evalErrors(dk_, contribution.data());
+    } else {
+      if (!factor.allInitialized()) return;
+      const DenseDiscreteFactor errors = factor.toDenseErrorFactor();
+      std::copy(errors.table().begin(), errors.table().end(),
+                contribution.data());
+    }
+    contribution = -contribution;
+
+    gtsam::Vector& previous = dynamicLogLikelihoods_[slot];
+    if (previous.allFinite() && contribution.allFinite()) {
+      logLikelihood_ += contribution - previous;
+      previous = contribution;
+    } else {
+      // Can't subtract out infinite contributions, so start from scratch.
+      previous = contribution;
+      logLikelihood_ = staticLogLikelihood_;
+      for (const gtsam::Vector& l : dynamicLogLikelihoods_) logLikelihood_ += l;
+    }
+  }
+
+  /**
+   * Detach the DCDiscreteFactor in `slot`, keeping its latest contribution
+   * as static evidence (e.g. once its continuous variables have been
+   * marginalized, so that it can no longer be refreshed). Its slot is left
+   * empty, so the slots of the other factors are unchanged.
+   */
+  void detach(size_t slot) {
+    gtsam::Vector& contribution = dynamicLogLikelihoods_[slot];
+    staticLogLikelihood_ += contribution;
+    contribution.setZero();
+    dynamic_[slot].reset();
+  }
+
+  /**
+   * @return the attached DCDiscreteFactors, with null entries in the slots
+   * of any that have been detached.
+   */
+  const std::vector<boost::shared_ptr<DCDiscreteFactor>>& dynamicFactors()
+      const {
+    return dynamic_;
+  }
+
+  /**
+   * @return the summed log-likelihood of all of the evidence, for each value
+   * of the variable.
+   */
+  const gtsam::Vector& logLikelihood() const { return logLikelihood_; }
+
+  /**
+   * @return the summed log-likelihood of the static evidence only.
+   */
+  const gtsam::Vector& staticLogLikelihood() const {
+    return staticLogLikelihood_;
+  }
+
+  const gtsam::DiscreteKey& discreteKey() const { return dk_; }
+
+  bool equals(const DiscreteFactor& other, double tol = 1e-9) const override {
+    if (!dynamic_cast<const UnaryEvidenceFactor*>(&other)) return false;
+    const UnaryEvidenceFactor& f(
+        static_cast<const UnaryEvidenceFactor&>(other));
+    return dk_ == f.dk_ && dynamic_ == f.dynamic_ &&
+           gtsam::equal_with_abs_tol(logLikelihood_, f.logLikelihood_, tol);
+  }
+
+  /**
+   * The factor values are normalized so that the most likely value has
+   * probability 1, to avoid underflow when a lot of evidence has been fused.
+   */
+  gtsam::DecisionTreeFactor toDecisionTreeFactor() const override {
+    const double maxLogLikelihood = logLikelihood_.maxCoeff();
+    std::vector<double> probs(dk_.second);
+    for (size_t i = 0; i < dk_.second; i++) {
+      probs[i] = std::exp(logLikelihood_(i) - maxLogLikelihood);
+    }
+    return gtsam::DecisionTreeFactor(dk_, probs);
+  }
+
+  // Normalized as in `toDecisionTreeFactor`.
+  DenseDiscreteFactor toDenseFactor() const {
+    const double maxLogLikelihood = logLikelihood_.maxCoeff();
+    std::vector<double> probs(dk_.second);
+    for (size_t i = 0; i < dk_.second; i++) {
+      probs[i] = std::exp(logLikelihood_(i) - maxLogLikelihood);
+    }
+    return DenseDiscreteFactor(gtsam::DiscreteKeys(dk_), std::move(probs));
+  }
+
+  gtsam::DecisionTreeFactor operator*(
+      const gtsam::DecisionTreeFactor& f) const override {
+    return toDecisionTreeFactor() * f;
+  }
+
+  double operator()(const DiscreteValues& values) const override {
+    const size_t assignment = values.at(dk_.first);
+    return std::exp(logLikelihood_(assignment) - logLikelihood_.maxCoeff());
+  }
+
+  std::string markdown(const gtsam::KeyFormatter& keyFormatter,
+                       const Names& names) const override {
+    return toDecisionTreeFactor().markdown(keyFormatter, names);
+  }
+
+  std::string html(const gtsam::KeyFormatter& keyFormatter,
+                   const Names& names) const override {
+    return toDecisionTreeFactor().markdown(keyFormatter, names);
+  }
+
+ private:
+  // Log of `factor` for each value of this variable.
+  gtsam::Vector evaluate(const gtsam::DiscreteFactor& factor) const {
+    gtsam::Vector contribution(dk_.second);
+    DiscreteValues assignment;
+    for (size_t i = 0; i < dk_.second; i++) {
+      assignment[dk_.first] = i;
+      contribution(i) = std::log(factor(assignment));
+    }
+    return contribution;
+  }
+};
+
+}  // namespace dcsam
@@ -0,0 +1,122 @@
+/**
+ * @file AsyncDCSAM.cpp
+ * @brief Asynchronous front-end for DCSAM with a background solver thread
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include "dcsam/AsyncDCSAM.h"
+
+#include <boost/make_shared.hpp>
+#include <utility>
+
+namespace dcsam {
+
+AsyncDCSAM::AsyncDCSAM(const DCSAMParams &params)
+    : dcsam_(params),
+      snapshot_(boost::make_shared<DCEstimateSnapshot>()),
+      worker_(&AsyncDCSAM::run, this) {}
+
+AsyncDCSAM::~AsyncDCSAM() {
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    stop_ = true;
+  }
+  pending_.notify_all();
+  worker_.join();
+}
+
+size_t AsyncDCSAM::enqueue(const HybridFactorGraph &hfg,
+                           const gtsam::Values &initialGuessContinuous,
+                           const DiscreteValues &initialGuessDiscrete) {
+  size_t batches;
+  {
+    std::lock_guard<std::mutex> lock(queueMutex_);
+    if (error_) std::rethrow_exception(error_);
+    queue_.push_back(Batch{hfg, initialGuessContinuous, initialGuessDiscrete});
+    batches = ++batchesEnqueued_;
+  }
+  pending_.notify_one();
+  return batches;
+}
+
+void AsyncDCSAM::flush() {
+  std::unique_lock<std::mutex> lock(queueMutex_);
+  idle_.wait(lock, [this] {
+    return error_ || batchesProcessed_ == batchesEnqueued_;
+  });
+  if (error_) std::rethrow_exception(error_);
+}
+
+AsyncDCSAM::SnapshotPtr AsyncDCSAM::estimate() const {
+  std::lock_guard<std::mutex> lock(snapshotMutex_);
+  return snapshot_;
+}
+
+size_t AsyncDCSAM::numUpdates() const {
+  std::lock_guard<std::mutex> lock(queueMutex_);
+  return numUpdates_;
+}
+
+void AsyncDCSAM::run() {
+  while (true) {
+    std::deque<Batch> batches;
+    {
+      std::unique_lock<std::mutex> lock(queueMutex_);
+      pending_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_) return;
+      batches.swap(queue_);
+    }
+
+    // Coalesce everything that arrived since the last update. Later initial
+    // guesses for the same key take precedence, as they would have if the
+    // batches had been added one at a time.
+    HybridFactorGraph graph;
+    gtsam::Values initialGuessContinuous;
+    DiscreteValues initialGuessDiscrete;
+    for (const Batch &batch : batches) {
+      for (const auto &factor : batch.graph.nonlinearGraph())
+        graph.push_nonlinear(factor);
+      for (const auto &factor : batch.graph.discreteGraph())
+        graph.push_discrete(factor);
+      for (const auto &factor : batch.graph.dcGraph()) graph.push_dc(factor);
+      for (const gtsam::Key k : batch.initialGuessContinuous.keys()) {
+        if (initialGuessContinuous.exists(k))
+          initialGuessContinuous.update(k, batch.initialGuessContinuous.at(k));
+        else
+          initialGuessContinuous.insert(k, batch.initialGuessContinuous.at(k));
+      }
+      for (const auto &kv : batch.initialGuessDiscrete)
+        initialGuessDiscrete[kv.first] = kv.second;
+    }
+
+    auto snapshot = boost::make_shared<DCEstimateSnapshot>();
+    try {
+      snapshot->result =
+          dcsam_.update(graph, initialGuessContinuous, initialGuessDiscrete);
+      snapshot->estimate = dcsam_.calculateEstimate();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(queueMutex_);
+      error_ = std::current_exception();
+      idle_.notify_all();
+      return;
+    }
+
+    // Publish the snapshot before marking the batches as processed, so that
+    // it is visible to anyone returning from `flush`. `batchesProcessed_` is
+    // only ever written by this thread.
+    snapshot->batches = batchesProcessed_ + batches.size();
+    {
+      std::lock_guard<std::mutex> lock(snapshotMutex_);
+      snapshot_ = std::move(snapshot);
+    }
+    {
+      std::lock_guard<std::mutex> lock(queueMutex_);
+      batchesProcessed_ += batches.size();
+      numUpdates_++;
+    }
+    idle_.notify_all();
+  }
+}
+
+}  // namespace dcsam
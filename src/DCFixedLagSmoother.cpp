@@ -0,0 +1,60 @@
+/**
+ * @file DCFixedLagSmoother.cpp
+ * @brief Fixed-lag smoothing for discrete-continuous factor graphs
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include "dcsam/DCFixedLagSmoother.h"
+
+namespace dcsam {
+
+namespace {
+DCSAMParams WithReusedFactorSlots(DCSAMParams params) {
+  params.isamParams.findUnusedFactorSlots = true;
+  return params;
+}
+}  // namespace
+
+DCFixedLagSmoother::DCFixedLagSmoother(double smootherLag,
+                                       const DCSAMParams &params)
+    : smootherLag_(smootherLag), dcsam_(WithReusedFactorSlots(params)) {}
+
+DCSAMUpdateResult DCFixedLagSmoother::update(
+    const HybridFactorGraph &hfg, const gtsam::Values &initialGuessContinuous,
+    const DiscreteValues &initialGuessDiscrete,
+    const KeyTimestampMap &timestamps) {
+  // Record the new timestamps, replacing any previous ones.
+  for (const auto &kv : timestamps) {
+    auto it = keyTimestamps_.find(kv.first);
+    if (it != keyTimestamps_.end()) {
+      auto range = timestampKeys_.equal_range(it->second);
+      for (auto jt = range.first; jt != range.second; ++jt) {
+        if (jt->second == kv.first) {
+          timestampKeys_.erase(jt);
+          break;
+        }
+      }
+    }
+    keyTimestamps_[kv.first] = kv.second;
+    timestampKeys_.emplace(kv.second, kv.first);
+  }
+
+  DCSAMUpdateResult result =
+      dcsam_.update(hfg, initialGuessContinuous, initialGuessDiscrete);
+  if (timestampKeys_.empty()) return result;
+
+  // Marginalize everything that has fallen outside the window.
+  const double cutoff = timestampKeys_.rbegin()->first - smootherLag_;
+  gtsam::KeySet marginalizableKeys;
+  auto it = timestampKeys_.begin();
+  while (it != timestampKeys_.end() && it->first < cutoff) {
+    marginalizableKeys.insert(it->second);
+    keyTimestamps_.erase(it->second);
+    it = timestampKeys_.erase(it);
+  }
+  if (!marginalizableKeys.empty()) dcsam_.marginalize(marginalizableKeys);
+  return result;
+}
+
+}  // namespace dcsam
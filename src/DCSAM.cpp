@@ -8,30 +8,84 @@
 
 #include "dcsam/DCSAM.h"
 
+#include <gtsam/discrete/DecisionTreeFactor.h>
+#include <gtsam/inference/Ordering.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
 #include "dcsam/DCContinuousFactor.h"
 #include "dcsam/DCDiscreteFactor.h"
 #include "dcsam/DiscreteMarginalsOrdered.h"
+#include "dcsam/DiscretePriorFactor.h"
 
 namespace dcsam {
 
-DCSAM::DCSAM() {
-  // Setup isam
-  isam_params_.relinearizeThreshold = 0.01;
-  isam_params_.relinearizeSkip = 1;
-  isam_params_.setOptimizationParams(gtsam::ISAM2DoglegParams());
-  isam_ = gtsam::ISAM2(isam_params_);
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Wall-clock time in seconds since `start`.
+double ElapsedSeconds(const Clock::time_point &start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Contribution of the discrete factor `factor` to DCSAM::hybridError at the
+// assignment `values`. DCDiscreteFactors contribute nothing, since their
+// DCFactors are counted with the continuous factors, and likewise only the
+// static evidence in a UnaryEvidenceFactor counts.
+double DiscreteError(const gtsam::DiscreteFactor::shared_ptr &factor,
+                     const DiscreteValues &values) {
+  if (!factor || boost::dynamic_pointer_cast<DCDiscreteFactor>(factor))
+    return 0.0;
+  if (auto fused = boost::dynamic_pointer_cast<UnaryEvidenceFactor>(factor)) {
+    const gtsam::Key k = fused->discreteKey().first;
+    return -fused->staticLogLikelihood()(values.at(k));
+  }
+  return -log((*factor)(values));
+}
+
+// Collect the frontal keys of `clique` and all of its descendants whose
+// separator contains `key`. These need to be re-eliminated along with `key`
+// for it to become a leaf (as in gtsam::IncrementalFixedLagSmoother).
+void MarkAffectedKeys(const gtsam::Key key,
+                      const gtsam::ISAM2Clique::shared_ptr &clique,
+                      gtsam::KeySet *keys) {
+  const auto &conditional = clique->conditional();
+  if (std::find(conditional->beginParents(), conditional->endParents(), key) ==
+      conditional->endParents())
+    return;
+  for (const gtsam::Key k : conditional->frontals()) keys->insert(k);
+  for (const auto &child : clique->children) MarkAffectedKeys(key, child, keys);
 }
+}  // namespace
+
+DCSAM::DCSAM() : DCSAM(DCSAMParams()) {}
 
 DCSAM::DCSAM(const gtsam::ISAM2Params &isam_params)
-    : isam_params_(isam_params) {
-  isam_ = gtsam::ISAM2(isam_params_);
+    : continuousState_(boost::make_shared<ContinuousStateStore>()) {
+  params_.isamParams = isam_params;
+  isam_ = gtsam::ISAM2(params_.isamParams);
+}
+
+DCSAM::DCSAM(const DCSAMParams &params)
+    : params_(params),
+      continuousState_(boost::make_shared<ContinuousStateStore>()) {
+  isam_ = gtsam::ISAM2(params_.isamParams);
+  if (params_.discreteThreads > 1) {
+    threadPool_ = boost::make_shared<ThreadPool>(params_.discreteThreads);
+  }
+  discreteIsam_ = DiscreteISAM(threadPool_, params_.discreteLogDomain);
 }
 
-void DCSAM::update(const gtsam::NonlinearFactorGraph &graph,
-                   const gtsam::DiscreteFactorGraph &dfg,
-                   const DCFactorGraph &dcfg,
-                   const gtsam::Values &initialGuessContinuous,
-                   const DiscreteValues &initialGuessDiscrete) {
+DCSAMUpdateResult DCSAM::update(const gtsam::NonlinearFactorGraph &graph,
+                                const gtsam::DiscreteFactorGraph &dfg,
+                                const DCFactorGraph &dcfg,
+                                const gtsam::Values &initialGuessContinuous,
+                                const DiscreteValues &initialGuessDiscrete) {
+  DCSAMUpdateResult result;
+  Clock::time_point start = Clock::now();
+
   // First things first: combine currContinuous_ estimate with the new values
   // from initialGuessContinuous to produce the full continuous variable state.
   for (const gtsam::Key k : initialGuessContinuous.keys()) {
@@ -57,116 +111,804 @@ void DCSAM::update(const gtsam::NonlinearFactorGraph &graph,
 
   // Populate combined and discreteCombined with the provided nonlinear and
   // discrete factors, respectively.
+  // Discrete factors involving frozen variables are conditioned on their
+  // frozen values first.
+  // Unary discrete evidence may instead be fused into existing factors.
+  size_t numFused = 0;
   for (auto &factor : graph) combined.add(factor);
-  for (auto &factor : dfg) discreteCombined.push_back(factor);
+  for (auto &factor : dfg) {
+    auto conditioned = conditionOnFrozen(factor);
+    if (!conditioned) continue;
+    if (fuseUnaryEvidence(conditioned, &discreteCombined).first)
+      numFused++;
+    else
+      discreteCombined.push_back(conditioned);
+  }
 
   // Each DCFactor will be split into a separate discrete and continuous
-  // component
+  // component. The discrete halves are tracked once they have been given an
+  // index in `dfg_` (until then, `index` is their position in
+  // `discreteCombined`).
+  std::vector<DCDiscreteEntry> dcDiscreteCombined;
   for (auto &dcfactor : dcfg) {
-    DCDiscreteFactor dcDiscreteFactor(dcfactor);
-    auto sharedDiscrete =
-        boost::make_shared<DCDiscreteFactor>(dcDiscreteFactor);
-    discreteCombined.push_back(sharedDiscrete);
-    dcDiscreteFactors_.push_back(sharedDiscrete);
+    // The discrete half of a DCFactor involving frozen variables is
+    // conditioned on their values, and dropped if they are all frozen (see
+    // `freezeConfidentDiscrete`).
+    auto sharedDiscrete = conditionOnFrozen(dcfactor);
+    if (!sharedDiscrete) continue;
+    auto fused = fuseUnaryEvidence(sharedDiscrete, &discreteCombined);
+    if (fused.first)
+      numFused++;
+    else
+      discreteCombined.push_back(sharedDiscrete);
+    dcDiscreteCombined.push_back(DCDiscreteEntry{
+        sharedDiscrete, discreteCombined.size() - 1, fused.first,
+        fused.second});
   }
+  result.splitTime = ElapsedSeconds(start);
 
-  // Set discrete information in DCDiscreteFactors.
-  updateDiscrete(discreteCombined, currContinuous_, currDiscrete_);
+  // Add the discrete factors and set discrete information in
+  // DCDiscreteFactors.
+  start = Clock::now();
+  std::vector<size_t> indices;
+  for (auto &factor : discreteCombined)
+    indices.push_back(addDiscreteFactor(factor));
+  for (const DCDiscreteEntry &entry : dcDiscreteCombined) {
+    addDCDiscreteFactor(entry.factor, entry.fused ? 0 : indices[entry.index],
+                        entry.fused, entry.slot);
+  }
+  updateDiscreteInfo(currContinuous_, currDiscrete_);
+  result.updateDiscreteTime = ElapsedSeconds(start);
 
+  // Only the initialGuess needs to be provided for the continuous solver (not
+  // the entire continuous state).
+  const bool skipDiscrete = !initialGuessContinuous.empty() &&
+                            initialGuessDiscrete.empty() &&
+                            discreteCombined.empty() && numFused == 0;
+  size_t changed =
+      alternate(&combined, dcfg, initialGuessContinuous, skipDiscrete, &result);
+  result.iterations = 1;
+
+  // Keep alternating (without any new factors) until the discrete assignment
+  // and the hybrid error have settled. The error is only compared between
+  // alternations that add no new factors.
+  bool errorSettled = false;
+  while (result.iterations < params_.maxIterations) {
+    if (params_.stopOnNoDiscreteChange && changed == 0) break;
+    if (errorSettled) break;
+    gtsam::NonlinearFactorGraph noFactors;
+    gtsam::Values previousContinuous;
+    const DiscreteValues previousDiscrete = currDiscrete_;
+    changed = alternate(&noFactors, DCFactorGraph(), gtsam::Values(), false,
+                        &result, &previousContinuous);
+    result.iterations++;
+    if (params_.hybridErrorTol > 0.0) {
+      result.hybridErrorChange =
+          hybridErrorChange(previousContinuous, previousDiscrete);
+      errorSettled =
+          std::abs(result.hybridErrorChange) <= params_.hybridErrorTol;
+    }
+  }
+  return result;
+}
+
+size_t DCSAM::alternate(gtsam::NonlinearFactorGraph *newFactors,
+                        const DCFactorGraph &dcfg,
+                        const gtsam::Values &initialGuess, bool skipDiscrete,
+                        DCSAMUpdateResult *result,
+                        gtsam::Values *previousContinuous) {
   // Update current discrete state estimate.
-  if (!initialGuessContinuous.empty() && initialGuessDiscrete.empty() &&
-      discreteCombined.empty()) {
+  Clock::time_point start = Clock::now();
+  size_t changed = 0;
+  if (skipDiscrete) {
     // This is an odometry?
   } else {
-    currDiscrete_ = solveDiscrete();
+    DiscreteISAMResult discreteResult;
+    DiscreteValues discreteVals = discreteEstimate(&discreteResult);
+    result->discreteComponentsSolved += discreteResult.componentsSolved;
+    result->discreteVariablesReeliminated +=
+        discreteResult.variablesReeliminated;
+    for (const auto &kv : frozenDiscrete_) discreteVals[kv.first] = kv.second;
+    for (const auto &kv : discreteVals) {
+      auto it = currDiscrete_.find(kv.first);
+      if (it != currDiscrete_.end() && it->second != kv.second) changed++;
+    }
+    currDiscrete_ = std::move(discreteVals);
   }
+  result->discreteVariablesChanged += changed;
+  result->solveDiscreteTime += ElapsedSeconds(start);
 
+  start = Clock::now();
   for (auto &dcfactor : dcfg) {
-    DCContinuousFactor dcContinuousFactor(dcfactor);
+    DCContinuousFactor dcContinuousFactor(dcfactor, continuousState_);
     auto sharedContinuous =
         boost::make_shared<DCContinuousFactor>(dcContinuousFactor);
     sharedContinuous->updateDiscrete(currDiscrete_);
-    combined.push_back(sharedContinuous);
-    dcContinuousFactors_.push_back(sharedContinuous);
+    newFactors->push_back(sharedContinuous);
   }
+  result->splitTime += ElapsedSeconds(start);
 
-  // Only the initialGuess needs to be provided for the continuous solver (not
-  // the entire continuous state).
-  updateContinuousInfo(currDiscrete_, combined, initialGuessContinuous);
+  start = Clock::now();
+  size_t relinearized = 0;
+  result->isamResult =
+      updateContinuousInfo(currDiscrete_, *newFactors, initialGuess,
+                           gtsam::FactorIndices(), &relinearized);
+  result->dcFactorsRelinearized += relinearized;
+  result->isamUpdateTime += ElapsedSeconds(start);
+
+  start = Clock::now();
+  if (previousContinuous) previousContinuous->swap(currContinuous_);
   currContinuous_ = isam_.calculateEstimate();
+  estimateVersion_++;
+  result->calculateEstimateTime += ElapsedSeconds(start);
+
   // Update discrete info from last solve and
-  updateDiscreteInfo(currContinuous_, currDiscrete_);
+  start = Clock::now();
+  result->dcDiscreteFactorsRefreshed =
+      updateDiscreteInfo(currContinuous_, currDiscrete_);
+  result->dcDiscreteFactorsSkipped =
+      dcDiscreteFactors_.size() - result->dcDiscreteFactorsRefreshed;
+  result->discreteVariablesFrozen += freezeConfidentDiscrete();
+  result->updateDiscreteInfoTime += ElapsedSeconds(start);
+  return changed;
 }
 
-void DCSAM::update(const HybridFactorGraph &hfg,
-                   const gtsam::Values &initialGuessContinuous,
-                   const DiscreteValues &initialGuessDiscrete) {
-  update(hfg.nonlinearGraph(), hfg.discreteGraph(), hfg.dcGraph(),
-         initialGuessContinuous, initialGuessDiscrete);
+DCSAMUpdateResult DCSAM::update(const HybridFactorGraph &hfg,
+                                const gtsam::Values &initialGuessContinuous,
+                                const DiscreteValues &initialGuessDiscrete) {
+  return update(hfg.nonlinearGraph(), hfg.discreteGraph(), hfg.dcGraph(),
+                initialGuessContinuous, initialGuessDiscrete);
 }
 
-void DCSAM::update() {
-  update(gtsam::NonlinearFactorGraph(), gtsam::DiscreteFactorGraph(),
-         DCFactorGraph());
+DCSAMUpdateResult DCSAM::update() {
+  return update(gtsam::NonlinearFactorGraph(), gtsam::DiscreteFactorGraph(),
+                DCFactorGraph());
 }
 
 void DCSAM::updateDiscrete(
     const gtsam::DiscreteFactorGraph &dfg = gtsam::DiscreteFactorGraph(),
     const gtsam::Values &continuousVals = gtsam::Values(),
     const DiscreteValues &discreteVals = DiscreteValues()) {
-  for (auto &factor : dfg) {
-    dfg_.push_back(factor);
-  }
+  for (auto &factor : dfg) addDiscreteFactor(factor);
   updateDiscreteInfo(continuousVals, discreteVals);
 }
 
-void DCSAM::updateDiscreteInfo(const gtsam::Values &continuousVals,
-                               const DiscreteValues &discreteVals) {
-  if (continuousVals.empty()) return;
-  for (auto factor : dcDiscreteFactors_) {
-    boost::shared_ptr<DCDiscreteFactor> dcDiscrete =
-        boost::static_pointer_cast<DCDiscreteFactor>(factor);
-    dcDiscrete->updateContinuous(continuousVals);
-    dcDiscrete->updateDiscrete(discreteVals);
+size_t DCSAM::updateDiscreteInfo(const gtsam::Values &continuousVals,
+                                 const DiscreteValues &discreteVals) {
+  if (continuousVals.empty()) return 0;
+
+  // Update the continuous state shared by all of the DCDiscreteFactors. Only
+  // keys that moved by more than the threshold are updated, and only the
+  // factors involving those keys need to be refreshed.
+  std::vector<bool> refresh(dcDiscreteFactors_.size(), false);
+  for (const auto &kv : dcDiscreteFactorsByKey_) {
+    if (!continuousVals.exists(kv.first)) continue;
+    if (!continuousState_->update(kv.first, continuousVals.at(kv.first),
+                                  params_.discreteRefreshThreshold))
+      continue;
+    for (const size_t idx : kv.second) refresh[idx] = true;
+  }
+
+  size_t refreshed = 0;
+  for (size_t i = 0; i < dcDiscreteFactors_.size(); i++) {
+    const DCDiscreteEntry &entry = dcDiscreteFactors_[i];
+    if (entry.factor->updateDiscrete(discreteVals)) refresh[i] = true;
+    if (!refresh[i]) continue;
+    if (entry.fused) entry.fused->refresh(entry.slot);
+    for (const gtsam::Key k : entry.factor->keys())
+      discreteAffectedKeys_.insert(k);
+    refreshed++;
   }
+  return refreshed;
 }
 
 void DCSAM::updateContinuous() {
   isam_.update();
   currContinuous_ = isam_.calculateEstimate();
+  estimateVersion_++;
 }
 
-void DCSAM::updateContinuousInfo(const DiscreteValues &discreteVals,
-                                 const gtsam::NonlinearFactorGraph &newFactors,
-                                 const gtsam::Values &initialGuess) {
+gtsam::ISAM2Result DCSAM::updateContinuousInfo(
+    const DiscreteValues &discreteVals,
+    const gtsam::NonlinearFactorGraph &newFactors,
+    const gtsam::Values &initialGuess,
+    const gtsam::FactorIndices &removeFactorIndices,
+    size_t *numRelinearized) {
   gtsam::ISAM2UpdateParams updateParams;
   gtsam::FastMap<gtsam::FactorIndex, gtsam::KeySet> newAffectedKeys;
-  for (size_t j = 0; j < dcContinuousFactors_.size(); j++) {
-    boost::shared_ptr<DCContinuousFactor> dcContinuousFactor =
-        boost::static_pointer_cast<DCContinuousFactor>(dcContinuousFactors_[j]);
-    dcContinuousFactor->updateDiscrete(discreteVals);
-    for (const gtsam::Key &k : dcContinuousFactor->keys()) {
-      newAffectedKeys[j].insert(k);
+  for (const auto &kv : dcContinuousFactors_) {
+    // Only factors whose discrete assignment actually changed need to be
+    // relinearized by iSAM.
+    if (!kv.second->updateDiscrete(discreteVals)) continue;
+    for (const gtsam::Key &k : kv.second->keys()) {
+      newAffectedKeys[kv.first].insert(k);
     }
   }
+  for (const gtsam::FactorIndex idx : removeFactorIndices) {
+    newAffectedKeys.erase(idx);
+    dcContinuousFactors_.erase(idx);
+  }
+  if (numRelinearized) *numRelinearized = newAffectedKeys.size();
   updateParams.newAffectedKeys = std::move(newAffectedKeys);
-  isam_.update(newFactors, initialGuess, updateParams);
+  updateParams.removeFactorIndices = removeFactorIndices;
+  gtsam::ISAM2Result result =
+      isam_.update(newFactors, initialGuess, updateParams);
+
+  // Record the iSAM2 factor index assigned to each new DC continuous factor.
+  // Those whose discrete variables are all frozen will never change, so there
+  // is no need to keep track of them.
+  for (size_t i = 0; i < newFactors.size(); i++) {
+    boost::shared_ptr<DCContinuousFactor> dcContinuousFactor =
+        boost::dynamic_pointer_cast<DCContinuousFactor>(newFactors[i]);
+    if (dcContinuousFactor && !isFrozen(dcContinuousFactor->discreteKeys())) {
+      dcContinuousFactors_[result.newFactorsIndices[i]] = dcContinuousFactor;
+    }
+  }
+  return result;
 }
 
-DiscreteValues DCSAM::solveDiscrete() const {
-  DiscreteValues discreteVals = dfg_.optimize();
-  return discreteVals;
+void DCSAM::marginalize(const gtsam::KeySet &keys) {
+  gtsam::KeySet continuousKeys, discreteKeys;
+  const gtsam::Values &theta = isam_.getLinearizationPoint();
+  for (const gtsam::Key k : keys) {
+    if (theta.exists(k))
+      continuousKeys.insert(k);
+    else
+      discreteKeys.insert(k);
+  }
+
+  if (!continuousKeys.empty()) {
+    // Re-eliminate the keys to marginalize (and anything whose separator
+    // contains them) with the keys constrained to be eliminated first, so
+    // that they become leaves of the Bayes tree.
+    gtsam::FastMap<gtsam::Key, int> constrainedKeys;
+    for (const gtsam::Key k : theta.keys()) {
+      constrainedKeys[k] = continuousKeys.exists(k) ? 0 : 1;
+    }
+    gtsam::KeySet reelimKeys = continuousKeys;
+    for (const gtsam::Key k : continuousKeys) {
+      for (const auto &child : isam_[k]->children) {
+        MarkAffectedKeys(k, child, &reelimKeys);
+      }
+    }
+    gtsam::ISAM2UpdateParams updateParams;
+    updateParams.constrainedKeys = constrainedKeys;
+    updateParams.extraReelimKeys =
+        gtsam::FastList<gtsam::Key>(reelimKeys.begin(), reelimKeys.end());
+    isam_.update(gtsam::NonlinearFactorGraph(), gtsam::Values(), updateParams);
+    gtsam::FactorIndices marginalFactorsIndices, deletedFactorsIndices;
+    isam_.marginalizeLeaves(
+        gtsam::FastList<gtsam::Key>(continuousKeys.begin(),
+                                    continuousKeys.end()),
+        marginalFactorsIndices, deletedFactorsIndices);
+
+    // Forget any DC continuous factors removed by the marginalization.
+    for (const gtsam::FactorIndex idx : deletedFactorsIndices) {
+      dcContinuousFactors_.erase(idx);
+    }
+    currContinuous_ = isam_.calculateEstimate();
+
+    // Re-anchor the DCDiscreteFactors involving the marginalized keys at the
+    // current estimate: attached ones keep their latest contribution to their
+    // UnaryEvidenceFactor, and the rest are replaced by their table.
+    std::vector<DCDiscreteEntry> reanchored;
+    gtsam::FastSet<const DCDiscreteFactor *> seen;
+    for (const gtsam::Key k : continuousKeys) {
+      auto it = dcDiscreteFactorsByKey_.find(k);
+      if (it == dcDiscreteFactorsByKey_.end()) continue;
+      for (const size_t pos : it->second) {
+        const DCDiscreteEntry &entry = dcDiscreteFactors_[pos];
+        if (seen.insert(entry.factor.get()).second) reanchored.push_back(entry);
+      }
+    }
+    for (const DCDiscreteEntry &entry : reanchored) {
+      if (entry.fused) {
+        entry.fused->detach(entry.slot);
+        removeDCDiscreteFactor(entry.factor.get());
+        continue;
+      }
+      auto table = boost::make_shared<gtsam::DecisionTreeFactor>(
+          entry.factor->toDecisionTreeFactor());
+      removeDiscreteFactor(entry.index);
+      addDiscreteFactor(table);
+    }
+  }
+
+  if (!discreteKeys.empty()) {
+    // Remove the discrete factors involving the keys to marginalize.
+    // DCDiscreteFactors are evaluated at the current continuous estimate.
+    gtsam::FastSet<size_t> indices;
+    for (const gtsam::Key d : discreteKeys) {
+      auto it = discreteFactorsByKey_.find(d);
+      if (it != discreteFactorsByKey_.end())
+        indices.insert(it->second.begin(), it->second.end());
+    }
+    std::vector<gtsam::DecisionTreeFactor> removed;
+    for (const size_t idx : indices) {
+      removed.push_back(dfg_[idx]->toDecisionTreeFactor());
+      removeDiscreteFactor(idx);
+    }
+
+    // Sum out the marginalized keys one at a time.
+    for (const gtsam::Key d : discreteKeys) {
+      gtsam::DecisionTreeFactor product;
+      std::vector<gtsam::DecisionTreeFactor> rest;
+      bool found = false;
+      for (const auto &factor : removed) {
+        const gtsam::KeyVector &factorKeys = factor.keys();
+        if (std::find(factorKeys.begin(), factorKeys.end(), d) ==
+            factorKeys.end()) {
+          rest.push_back(factor);
+          continue;
+        }
+        product = factor * product;
+        found = true;
+      }
+      if (!found) continue;
+      gtsam::Ordering frontal;
+      frontal.push_back(d);
+      gtsam::DecisionTreeFactor marginal = *product.sum(frontal);
+      if (!marginal.keys().empty()) rest.push_back(marginal);
+      removed = std::move(rest);
+    }
+
+    // Whatever is left only involves variables we are keeping. Marginals on a
+    // single variable are stored compactly as DiscretePriorFactors.
+    gtsam::DiscreteFactorGraph marginals;
+    for (const auto &factor : removed) {
+      gtsam::DiscreteFactor::shared_ptr marginal;
+      if (factor.keys().size() != 1) {
+        marginal = boost::make_shared<gtsam::DecisionTreeFactor>(factor);
+      } else {
+        const gtsam::Key k = factor.keys().front();
+        const size_t cardinality = factor.cardinality(k);
+        std::vector<double> probs(cardinality);
+        double total = 0.0;
+        DiscreteValues assignment;
+        for (size_t v = 0; v < cardinality; v++) {
+          assignment[k] = v;
+          probs[v] = factor(assignment);
+          total += probs[v];
+        }
+        if (total > 0.0) {
+          for (double &p : probs) p /= total;
+        }
+        marginal = boost::make_shared<DiscretePriorFactor>(
+            gtsam::DiscreteKey(k, cardinality), probs);
+      }
+      if (!fuseUnaryEvidence(marginal, &marginals).first)
+        marginals.push_back(marginal);
+    }
+    for (const auto &factor : marginals) addDiscreteFactor(factor);
+
+    // DC continuous factors on the marginalized keys keep their last
+    // assignment, as they do once their keys are frozen.
+    for (auto it = dcContinuousFactors_.begin();
+         it != dcContinuousFactors_.end();) {
+      const gtsam::DiscreteKeys &factorKeys = it->second->discreteKeys();
+      if (std::any_of(factorKeys.begin(), factorKeys.end(),
+                      [&](const gtsam::DiscreteKey &dk) {
+                        return discreteKeys.exists(dk.first);
+                      }))
+        it = dcContinuousFactors_.erase(it);
+      else
+        ++it;
+    }
+
+    for (const gtsam::Key d : discreteKeys) {
+      currDiscrete_.erase(d);
+      frozenDiscrete_.erase(d);
+    }
+  }
+  estimateVersion_++;
+}
+
+size_t DCSAM::freezeConfidentDiscrete() {
+  if (params_.discreteFreezeThreshold >= 1.0) {
+    freezeCandidates_.clear();
+    return 0;
+  }
+
+  // Only variables in a component whose factors have changed since it was
+  // last checked can have become confident: a change anywhere in a component
+  // changes the marginals of all of its variables. Factors refreshed since
+  // the last discrete update count as changed too.
+  gtsam::KeySet touched;
+  touched.swap(freezeCandidates_);
+  touched.insert(discreteAffectedKeys_.begin(), discreteAffectedKeys_.end());
+  gtsam::KeySet candidates;
+  for (const gtsam::Key k : touched) {
+    if (candidates.exists(k)) continue;
+    // Variables not yet in the discrete solver are checked once they are.
+    if (discreteIsam_.cardinality(k) == 0) {
+      if (discreteFactorsByKey_.count(k)) freezeCandidates_.insert(k);
+      continue;
+    }
+    const gtsam::KeyVector component = discreteIsam_.componentKeys(k);
+    candidates.insert(component.begin(), component.end());
+  }
+
+  // Freeze the candidates whose current value is sufficiently probable,
+  // marginalizing over the rest of their component. Components too large to
+  // marginalize are left active.
+  DiscreteValues newlyFrozen;
+  for (const gtsam::Key k : candidates) {
+    auto current = currDiscrete_.find(k);
+    if (current == currDiscrete_.end()) continue;
+    const std::vector<double> marginal = discreteIsam_.marginal(k);
+    if (current->second < marginal.size() &&
+        marginal[current->second] > params_.discreteFreezeThreshold) {
+      newlyFrozen[k] = current->second;
+    }
+  }
+  if (newlyFrozen.empty()) return 0;
+  for (const auto &kv : newlyFrozen) frozenDiscrete_[kv.first] = kv.second;
+
+  // Replace every factor involving a newly frozen variable by one conditioned
+  // on its value. The replacement is added first, so that any continuous
+  // values it shares with the original stay in `continuousState_`.
+  gtsam::FastSet<size_t> indices;
+  for (const auto &kv : newlyFrozen) {
+    const std::vector<size_t> &involving = discreteFactorsByKey_.at(kv.first);
+    indices.insert(involving.begin(), involving.end());
+  }
+  for (const size_t idx : indices) {
+    const gtsam::DiscreteFactor::shared_ptr factor = dfg_[idx];
+    auto dcDiscreteFactor =
+        boost::dynamic_pointer_cast<DCDiscreteFactor>(factor);
+    if (dcDiscreteFactor) {
+      auto conditioned = conditionOnFrozen(dcDiscreteFactor->dcfactor());
+      if (conditioned) {
+        conditioned->updateDiscrete(currDiscrete_);
+        addDCDiscreteFactor(conditioned, addDiscreteFactor(conditioned),
+                            nullptr, 0);
+      }
+    } else {
+      auto conditioned = conditionOnFrozen(factor);
+      if (conditioned) addDiscreteFactor(conditioned);
+    }
+    removeDiscreteFactor(idx);
+  }
+
+  // DC continuous factors whose discrete variables are all frozen already
+  // hold the frozen assignment, so from now on they can be treated as plain
+  // nonlinear factors.
+  for (auto it = dcContinuousFactors_.begin();
+       it != dcContinuousFactors_.end();) {
+    if (isFrozen(it->second->discreteKeys()))
+      it = dcContinuousFactors_.erase(it);
+    else
+      ++it;
+  }
+  return newlyFrozen.size();
+}
+
+bool DCSAM::isFrozen(const gtsam::DiscreteKeys &keys) const {
+  for (const gtsam::DiscreteKey &dk : keys) {
+    if (frozenDiscrete_.find(dk.first) == frozenDiscrete_.end()) return false;
+  }
+  return true;
+}
+
+gtsam::DiscreteFactor::shared_ptr DCSAM::conditionOnFrozen(
+    const gtsam::DiscreteFactor::shared_ptr &factor) const {
+  if (!factor || frozenDiscrete_.empty()) return factor;
+  gtsam::KeyVector frozenKeys;
+  for (const gtsam::Key k : factor->keys()) {
+    if (frozenDiscrete_.find(k) != frozenDiscrete_.end())
+      frozenKeys.push_back(k);
+  }
+  if (frozenKeys.empty()) return factor;
+  if (frozenKeys.size() == factor->keys().size()) return nullptr;
+
+  // Multiply by an indicator on the frozen value of each key, then sum the key
+  // out.
+  gtsam::DecisionTreeFactor conditioned = factor->toDecisionTreeFactor();
+  for (const gtsam::Key k : frozenKeys) {
+    const size_t cardinality = conditioned.cardinality(k);
+    std::vector<double> indicator(cardinality, 0.0);
+    indicator[frozenDiscrete_.at(k)] = 1.0;
+    gtsam::Ordering frontal;
+    frontal.push_back(k);
+    conditioned = *(conditioned * gtsam::DecisionTreeFactor(
+                                      gtsam::DiscreteKey(k, cardinality),
+                                      indicator))
+                       .sum(frontal);
+  }
+  return boost::make_shared<gtsam::DecisionTreeFactor>(conditioned);
+}
+
+boost::shared_ptr<DCDiscreteFactor> DCSAM::conditionOnFrozen(
+    const boost::shared_ptr<DCFactor> &dcfactor) const {
+  DiscreteValues fixedVals;
+  for (const gtsam::DiscreteKey &dk : dcfactor->discreteKeys()) {
+    auto it = frozenDiscrete_.find(dk.first);
+    if (it != frozenDiscrete_.end()) fixedVals[dk.first] = it->second;
+  }
+  if (fixedVals.empty())
+    return boost::make_shared<DCDiscreteFactor>(dcfactor, continuousState_);
+  auto conditioned = boost::make_shared<DCDiscreteFactor>(dcfactor, fixedVals,
+                                                          continuousState_);
+  if (conditioned->keys().empty()) return nullptr;
+  return conditioned;
+}
+
+std::pair<UnaryEvidenceFactor::shared_ptr, size_t> DCSAM::fuseUnaryEvidence(
+    const gtsam::DiscreteFactor::shared_ptr &factor,
+    gtsam::DiscreteFactorGraph *newFactors) {
+  if (!params_.fuseUnaryEvidence || !factor || factor->keys().size() != 1 ||
+      boost::dynamic_pointer_cast<UnaryEvidenceFactor>(factor))
+    return {nullptr, 0};
+
+  const gtsam::Key k = factor->keys().front();
+  UnaryEvidenceFactor::shared_ptr &fused = evidence_[k];
+  auto dcDiscreteFactor = boost::dynamic_pointer_cast<DCDiscreteFactor>(factor);
+  if (!fused) {
+    const size_t cardinality =
+        dcDiscreteFactor ? dcDiscreteFactor->discreteKeys().front().second
+                         : factor->toDecisionTreeFactor().cardinality(k);
+    fused = boost::make_shared<UnaryEvidenceFactor>(
+        gtsam::DiscreteKey(k, cardinality));
+    newFactors->push_back(fused);
+  }
+
+  // If the fused factor is already in the discrete solver, its key needs to
+  // be re-solved.
+  discreteAffectedKeys_.insert(k);
+  if (dcDiscreteFactor) return {fused, fused->addDynamic(dcDiscreteFactor)};
+  fused->add(*factor);
+  return {fused, 0};
+}
+
+size_t DCSAM::addDiscreteFactor(
+    const gtsam::DiscreteFactor::shared_ptr &factor) {
+  // Reuse the slot of a removed factor if there is one.
+  size_t index = dfg_.size();
+  if (freeDiscreteSlots_.empty()) {
+    dfg_.push_back(factor);
+  } else {
+    index = freeDiscreteSlots_.back();
+    freeDiscreteSlots_.pop_back();
+    dfg_.replace(index, factor);
+  }
+  if (factor) {
+    for (const gtsam::Key k : factor->keys()) {
+      discreteFactorsByKey_[k].push_back(index);
+      freezeCandidates_.insert(k);
+    }
+  }
+  newDiscreteFactors_.push_back(factor);
+  newDiscreteIndices_.push_back(index);
+  return index;
+}
+
+void DCSAM::removeDiscreteFactor(size_t index) {
+  const gtsam::DiscreteFactor::shared_ptr factor = dfg_[index];
+  if (!factor) return;
+  for (const gtsam::Key k : factor->keys()) {
+    freezeCandidates_.insert(k);
+    auto it = discreteFactorsByKey_.find(k);
+    if (it == discreteFactorsByKey_.end()) continue;
+    std::vector<size_t> &indices = it->second;
+    indices.erase(std::remove(indices.begin(), indices.end(), index),
+                  indices.end());
+    if (indices.empty()) discreteFactorsByKey_.erase(it);
+  }
+
+  if (auto dcDiscreteFactor =
+          boost::dynamic_pointer_cast<DCDiscreteFactor>(factor)) {
+    removeDCDiscreteFactor(dcDiscreteFactor.get());
+  } else if (auto fused =
+                 boost::dynamic_pointer_cast<UnaryEvidenceFactor>(factor)) {
+    for (const auto &dynamic : fused->dynamicFactors()) {
+      if (dynamic) removeDCDiscreteFactor(dynamic.get());
+    }
+    auto it = evidence_.find(fused->discreteKey().first);
+    if (it != evidence_.end() && it->second == fused) evidence_.erase(it);
+  }
+
+  // Factors not yet passed to the discrete solver are simply dropped. Either
+  // way, the slot can be reused right away, since `discreteIsam_` removes
+  // factors before adding new ones.
+  dfg_.remove(index);
+  freeDiscreteSlots_.push_back(index);
+  auto pending = std::find(newDiscreteIndices_.begin(),
+                           newDiscreteIndices_.end(), index);
+  if (pending == newDiscreteIndices_.end()) {
+    discreteRemoveIndices_.push_back(index);
+    return;
+  }
+  const size_t pos = pending - newDiscreteIndices_.begin();
+  newDiscreteIndices_.erase(pending);
+  newDiscreteFactors_.erase(newDiscreteFactors_.begin() + pos);
+}
+
+void DCSAM::addDCDiscreteFactor(
+    const boost::shared_ptr<DCDiscreteFactor> &factor, size_t index,
+    const UnaryEvidenceFactor::shared_ptr &fused, size_t slot) {
+  const size_t pos = dcDiscreteFactors_.size();
+  for (const gtsam::Key k : factor->continuousKeys()) {
+    std::vector<size_t> &positions = dcDiscreteFactorsByKey_[k];
+    if (positions.empty() || positions.back() != pos) positions.push_back(pos);
+  }
+  dcDiscretePositions_[factor.get()] = pos;
+  dcDiscreteFactors_.push_back(DCDiscreteEntry{factor, index, fused, slot});
+}
+
+void DCSAM::removeDCDiscreteFactor(const DCDiscreteFactor *factor) {
+  auto it = dcDiscretePositions_.find(factor);
+  if (it == dcDiscretePositions_.end()) return;
+  const size_t pos = it->second;
+  dcDiscretePositions_.erase(it);
+  for (const gtsam::Key k : factor->continuousKeys()) {
+    auto byKey = dcDiscreteFactorsByKey_.find(k);
+    if (byKey == dcDiscreteFactorsByKey_.end()) continue;
+    std::vector<size_t> &positions = byKey->second;
+    positions.erase(std::remove(positions.begin(), positions.end(), pos),
+                    positions.end());
+    if (!positions.empty()) continue;
+    dcDiscreteFactorsByKey_.erase(byKey);
+    continuousState_->erase(k);
+  }
+
+  // Move the last factor into the vacated position.
+  const size_t last = dcDiscreteFactors_.size() - 1;
+  if (pos != last) {
+    dcDiscreteFactors_[pos] = std::move(dcDiscreteFactors_[last]);
+    const DCDiscreteFactor *moved = dcDiscreteFactors_[pos].factor.get();
+    dcDiscretePositions_[moved] = pos;
+    for (const gtsam::Key k : moved->continuousKeys()) {
+      std::vector<size_t> &positions = dcDiscreteFactorsByKey_.at(k);
+      std::replace(positions.begin(), positions.end(), last, pos);
+    }
+  }
+  dcDiscreteFactors_.pop_back();
+}
+
+gtsam::DiscreteFactorGraph DCSAM::getDiscreteFactorGraph() const {
+  gtsam::DiscreteFactorGraph graph;
+  for (const auto &factor : dfg_) {
+    if (factor) graph.push_back(factor);
+  }
+  return graph;
+}
+
+double DCSAM::hybridError() const {
+  // The continuous factors in iSAM (including the continuous half of each
+  // DCFactor, evaluated at its current discrete assignment).
+  double error = isam_.getFactorsUnsafe().error(currContinuous_);
+
+  // The discrete-only factors.
+  for (const auto &factor : dfg_) error += DiscreteError(factor, currDiscrete_);
+  return error;
+}
+
+double DCSAM::hybridErrorChange(const gtsam::Values &previousContinuous,
+                                const DiscreteValues &previousDiscrete) const {
+  // Discrete variables whose assignment changed. Any new to the problem have
+  // no previous error to compare against, and are skipped.
+  gtsam::KeySet changedDiscrete;
+  for (const auto &kv : currDiscrete_) {
+    auto it = previousDiscrete.find(kv.first);
+    if (it != previousDiscrete.end() && it->second != kv.second)
+      changedDiscrete.insert(kv.first);
+  }
+
+  // The continuous factors involving a variable that moved, along with the
+  // DC continuous factors whose discrete assignment changed.
+  const gtsam::VariableIndex &variableIndex = isam_.getVariableIndex();
+  gtsam::FastSet<gtsam::FactorIndex> continuousFactors;
+  for (const gtsam::Key k : currContinuous_.keys()) {
+    if (!previousContinuous.exists(k) ||
+        currContinuous_.at(k).equals_(previousContinuous.at(k), 0.0))
+      continue;
+    for (const gtsam::FactorIndex idx : variableIndex[k])
+      continuousFactors.insert(idx);
+  }
+  if (!changedDiscrete.empty()) {
+    for (const auto &kv : dcContinuousFactors_) {
+      for (const gtsam::DiscreteKey &dk : kv.second->discreteKeys()) {
+        if (!changedDiscrete.exists(dk.first)) continue;
+        continuousFactors.insert(kv.first);
+        break;
+      }
+    }
+  }
+
+  double change = 0.0;
+  const gtsam::NonlinearFactorGraph &factors = isam_.getFactorsUnsafe();
+  for (const gtsam::FactorIndex idx : continuousFactors) {
+    const gtsam::NonlinearFactor::shared_ptr &factor = factors[idx];
+    if (!factor) continue;
+    // The previous error of a DC continuous factor whose assignment changed
+    // is evaluated at its previous assignment. Only those still tracked in
+    // `dcContinuousFactors_` follow the discrete estimate; any others (e.g.
+    // on marginalized variables) keep their last assignment.
+    auto dcContinuousFactor =
+        boost::dynamic_pointer_cast<DCContinuousFactor>(factor);
+    if (dcContinuousFactor && dcContinuousFactors_.count(idx)) {
+      DiscreteValues previousAssignment = dcContinuousFactor->discreteValues();
+      bool assignmentChanged = false;
+      for (const gtsam::DiscreteKey &dk : dcContinuousFactor->discreteKeys()) {
+        if (!changedDiscrete.exists(dk.first)) continue;
+        previousAssignment[dk.first] = previousDiscrete.at(dk.first);
+        assignmentChanged = true;
+      }
+      if (assignmentChanged) {
+        change += dcContinuousFactor->error(currContinuous_) -
+                  dcContinuousFactor->dcfactor()->error(previousContinuous,
+                                                        previousAssignment);
+        continue;
+      }
+    }
+    change +=
+        factor->error(currContinuous_) - factor->error(previousContinuous);
+  }
+
+  // The discrete factors involving a variable whose assignment changed.
+  gtsam::FastSet<size_t> discreteFactors;
+  for (const gtsam::Key k : changedDiscrete) {
+    auto it = discreteFactorsByKey_.find(k);
+    if (it == discreteFactorsByKey_.end()) continue;
+    discreteFactors.insert(it->second.begin(), it->second.end());
+  }
+  for (const size_t idx : discreteFactors) {
+    change += DiscreteError(dfg_[idx], currDiscrete_) -
+              DiscreteError(dfg_[idx], previousDiscrete);
+  }
+  return change;
+}
+
+DiscreteValues DCSAM::solveDiscrete() const { return discreteEstimate(); }
+
+void DCSAM::markDiscreteFactorsChanged(const gtsam::KeySet &keys) {
+  for (const gtsam::Key k : keys) discreteAffectedKeys_.insert(k);
+}
+
+const DiscreteValues &DCSAM::discreteEstimate(
+    DiscreteISAMResult *result) const {
+  if (newDiscreteFactors_.empty() && discreteAffectedKeys_.empty() &&
+      discreteRemoveIndices_.empty()) {
+    return discreteIsam_.estimate();
+  }
+  DiscreteISAMResult isamResult =
+      discreteIsam_.update(newDiscreteFactors_, discreteAffectedKeys_,
+                           discreteRemoveIndices_, newDiscreteIndices_);
+  newDiscreteFactors_.resize(0);
+  newDiscreteIndices_.clear();
+  discreteRemoveIndices_.clear();
+
+  // Refreshed factors change the marginals in their components (see
+  // `freezeConfidentDiscrete`).
+  freezeCandidates_.insert(discreteAffectedKeys_.begin(),
+                           discreteAffectedKeys_.end());
+  discreteAffectedKeys_.clear();
+  if (!isamResult.changedKeys.empty()) estimateVersion_++;
+  if (result) *result = std::move(isamResult);
+  return discreteIsam_.estimate();
 }
 
 DCValues DCSAM::calculateEstimate() const {
-  // NOTE: if we have these cached from solves, we could presumably just return
-  // the cached values.
-  gtsam::Values continuousVals = isam_.calculateEstimate();
-  DiscreteValues discreteVals = dfg_.optimize();
-  DCValues dcValues(continuousVals, discreteVals);
+  // The continuous estimate is cached from the last iSAM solve. The discrete
+  // estimate only needs to be brought up to date with any DCDiscreteFactors
+  // refreshed since the last discrete solve.
+  DCValues dcValues(currContinuous_, discreteEstimate());
+  for (const auto &kv : frozenDiscrete_) {
+    dcValues.discrete[kv.first] = kv.second;
+  }
   return dcValues;
 }
 
+const gtsam::Value &DCSAM::calculateEstimate(const gtsam::Key key) const {
+  return currContinuous_.at(key);
+}
+
+size_t DCSAM::calculateDiscreteEstimate(const gtsam::Key key) const {
+  auto it = frozenDiscrete_.find(key);
+  if (it != frozenDiscrete_.end()) return it->second;
+  return discreteEstimate().at(key);
+}
+
 // NOTE separate dcmarginals class?
 DCMarginals DCSAM::getMarginals(const gtsam::NonlinearFactorGraph &graph,
                                 const gtsam::Values &continuousEst,
@@ -0,0 +1,280 @@
+/**
+ * @file DenseDiscreteFactor.cpp
+ * @brief Discrete factor stored as a dense table
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include "dcsam/DenseDiscreteFactor.h"
+
+#include <gtsam/discrete/AlgebraicDecisionTree.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <utility>
+
+#include "dcsam/DCDiscreteFactor.h"
+#include "dcsam/DiscretePriorFactor.h"
+#include "dcsam/UnaryEvidenceFactor.h"
+
+namespace dcsam {
+
+namespace {
+// out[j] = op(a[j * strideA], b[j * strideB]) for j < n. The common cases of
+// contiguous or broadcast rows get their own loops so that they vectorize.
+template <typename Op>
+void CombineRow(const double *a, size_t strideA, const double *b,
+                size_t strideB, size_t n, double *out, Op op) {
+  if (strideA == 1 && strideB == 1) {
+    for (size_t j = 0; j < n; j++) out[j] = op(a[j], b[j]);
+  } else if (strideA == 1 && strideB == 0) {
+    const double y = *b;
+    for (size_t j = 0; j < n; j++) out[j] = op(a[j], y);
+  } else if (strideA == 0 && strideB == 1) {
+    const double x = *a;
+    for (size_t j = 0; j < n; j++) out[j] = op(x, b[j]);
+  } else {
+    for (size_t j = 0; j < n; j++) out[j] = op(a[j * strideA], b[j * strideB]);
+  }
+}
+
+// Reduce `n` contiguous values of `row` into `out`.
+template <typename Op>
+void ReduceRow(const double *row, size_t n, double *out, Op op) {
+  for (size_t i = 0; i < n; i++) out[i] = op(out[i], row[i]);
+}
+}  // namespace
+
+DenseDiscreteFactor::DenseDiscreteFactor() : table_(1, 1.0) {}
+
+DenseDiscreteFactor::DenseDiscreteFactor(const gtsam::DiscreteKeys &keys,
+                                         std::vector<double> table)
+    : dkeys_(keys), table_(std::move(table)) {
+  initialize();
+}
+
+DenseDiscreteFactor::DenseDiscreteFactor(const gtsam::DecisionTreeFactor &f) {
+  for (const gtsam::Key k : f.keys()) {
+    dkeys_.push_back(gtsam::DiscreteKey(k, f.cardinality(k)));
+  }
+  initialize();
+
+  // Walk through every assignment in table order.
+  DiscreteValues assignment;
+  for (const gtsam::DiscreteKey &dk : dkeys_) assignment[dk.first] = 0;
+  for (size_t idx = 0; idx < table_.size(); idx++) {
+    table_[idx] = f(assignment);
+    for (size_t i = dkeys_.size(); i-- > 0;) {
+      size_t &value = assignment[dkeys_[i].first];
+      if (++value < dkeys_[i].second) break;
+      value = 0;
+    }
+  }
+}
+
+void DenseDiscreteFactor::initialize() {
+  keys_.clear();
+  strides_.assign(dkeys_.size(), 1);
+  size_t size = 1;
+  for (size_t i = dkeys_.size(); i-- > 0;) {
+    strides_[i] = size;
+    size *= dkeys_[i].second;
+  }
+  for (const gtsam::DiscreteKey &dk : dkeys_) keys_.push_back(dk.first);
+  if (table_.empty()) table_.resize(size);
+  assert(table_.size() == size);
+}
+
+size_t DenseDiscreteFactor::cardinality(const gtsam::Key key) const {
+  for (const gtsam::DiscreteKey &dk : dkeys_) {
+    if (dk.first == key) return dk.second;
+  }
+  return 0;
+}
+
+size_t DenseDiscreteFactor::stride(const gtsam::Key key) const {
+  for (size_t i = 0; i < dkeys_.size(); i++) {
+    if (dkeys_[i].first == key) return strides_[i];
+  }
+  return 0;
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::operator*(
+    const DenseDiscreteFactor &other) const {
+  return combine(other, false);
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::operator+(
+    const DenseDiscreteFactor &other) const {
+  return combine(other, true);
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::combine(
+    const DenseDiscreteFactor &other, bool add) const {
+  gtsam::DiscreteKeys keys = dkeys_;
+  for (const gtsam::DiscreteKey &dk : other.dkeys_) {
+    if (cardinality(dk.first) == 0) keys.push_back(dk);
+  }
+  const size_t d = keys.size();
+  if (d == 0) {
+    const double value =
+        add ? table_[0] + other.table_[0] : table_[0] * other.table_[0];
+    return DenseDiscreteFactor(keys, {value});
+  }
+
+  // Stride of each output key in each of the inputs, or 0 where an input
+  // does not involve the key (so that its values are broadcast).
+  std::vector<size_t> cards(d), stridesA(d), stridesB(d);
+  size_t size = 1;
+  for (size_t i = 0; i < d; i++) {
+    cards[i] = keys[i].second;
+    stridesA[i] = stride(keys[i].first);
+    stridesB[i] = other.stride(keys[i].first);
+    size *= cards[i];
+  }
+
+  // Fill in the output a row (of the last key) at a time, keeping track of
+  // where each row starts in the inputs as we go.
+  std::vector<double> table(size);
+  const size_t n = cards[d - 1];
+  std::vector<size_t> counter(d - 1, 0);
+  size_t a = 0, b = 0;
+  for (size_t row = 0; row < size; row += n) {
+    const double *rowA = table_.data() + a;
+    const double *rowB = other.table_.data() + b;
+    if (add) {
+      CombineRow(rowA, stridesA[d - 1], rowB, stridesB[d - 1], n,
+                 table.data() + row, std::plus<double>());
+    } else {
+      CombineRow(rowA, stridesA[d - 1], rowB, stridesB[d - 1], n,
+                 table.data() + row, std::multiplies<double>());
+    }
+    for (size_t i = d - 1; i-- > 0;) {
+      if (++counter[i] < cards[i]) {
+        a += stridesA[i];
+        b += stridesB[i];
+        break;
+      }
+      counter[i] = 0;
+      a -= stridesA[i] * (cards[i] - 1);
+      b -= stridesB[i] * (cards[i] - 1);
+    }
+  }
+  return DenseDiscreteFactor(keys, std::move(table));
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::sum(const gtsam::Key key) const {
+  return reduce(key, Reduction::kSum);
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::max(const gtsam::Key key) const {
+  return reduce(key, Reduction::kMax);
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::min(const gtsam::Key key) const {
+  return reduce(key, Reduction::kMin);
+}
+
+DenseDiscreteFactor DenseDiscreteFactor::reduce(const gtsam::Key key,
+                                                Reduction reduction) const {
+  size_t p = 0;
+  while (p < dkeys_.size() && dkeys_[p].first != key) p++;
+  if (p == dkeys_.size()) return *this;
+
+  // View the table as [outer][cardinality][inner], and reduce over the middle
+  // dimension one contiguous row of `inner` values at a time.
+  const size_t cardinality = dkeys_[p].second;
+  const size_t inner = strides_[p];
+  const size_t outer = table_.size() / (cardinality * inner);
+  gtsam::DiscreteKeys keys;
+  for (size_t i = 0; i < dkeys_.size(); i++) {
+    if (i != p) keys.push_back(dkeys_[i]);
+  }
+  std::vector<double> table(outer * inner);
+  for (size_t o = 0; o < outer; o++) {
+    const double *src = table_.data() + o * cardinality * inner;
+    double *dst = table.data() + o * inner;
+    std::copy(src, src + inner, dst);
+    for (size_t v = 1; v < cardinality; v++) {
+      const double *row = src + v * inner;
+      switch (reduction) {
+        case Reduction::kSum:
+          ReduceRow(row, inner, dst, std::plus<double>());
+          break;
+        case Reduction::kMax:
+          ReduceRow(row, inner, dst,
+                    [](double x, double y) { return std::max(x, y); });
+          break;
+        case Reduction::kMin:
+          ReduceRow(row, inner, dst,
+                    [](double x, double y) { return std::min(x, y); });
+          break;
+      }
+    }
+  }
+  return DenseDiscreteFactor(keys, std::move(table));
+}
+
+void DenseDiscreteFactor::negLog() {
+  for (double &value : table_) value = -std::log(value);
+}
+
+bool DenseDiscreteFactor::equals(const DiscreteFactor &other,
+                                 double tol) const {
+  if (!dynamic_cast<const DenseDiscreteFactor *>(&other)) return false;
+  const DenseDiscreteFactor &f(static_cast<const DenseDiscreteFactor &>(other));
+  if (dkeys_ != f.dkeys_ || table_.size() != f.table_.size()) return false;
+  for (size_t i = 0; i < table_.size(); i++) {
+    if (std::abs(table_[i] - f.table_[i]) > tol) return false;
+  }
+  return true;
+}
+
+double DenseDiscreteFactor::operator()(const DiscreteValues &values) const {
+  size_t idx = 0;
+  for (size_t i = 0; i < dkeys_.size(); i++) {
+    idx += values.at(dkeys_[i].first) * strides_[i];
+  }
+  return table_[idx];
+}
+
+gtsam::DecisionTreeFactor DenseDiscreteFactor::toDecisionTreeFactor() const {
+  if (dkeys_.empty()) {
+    return gtsam::DecisionTreeFactor(
+        dkeys_, gtsam::AlgebraicDecisionTree<gtsam::Key>(table_[0]));
+  }
+  return gtsam::DecisionTreeFactor(dkeys_, table_);
+}
+
+DenseDiscreteFactor toDenseFactor(const gtsam::DiscreteFactor &factor) {
+  if (auto *dense = dynamic_cast<const DenseDiscreteFactor *>(&factor))
+    return *dense;
+  if (auto *prior = dynamic_cast<const DiscretePriorFactor *>(&factor))
+    return prior->toDenseFactor();
+  if (auto *dcDiscrete = dynamic_cast<const DCDiscreteFactor *>(&factor))
+    return dcDiscrete->toDenseFactor();
+  if (auto *fused = dynamic_cast<const UnaryEvidenceFactor *>(&factor))
+    return fused->toDenseFactor();
+  return DenseDiscreteFactor(factor.toDecisionTreeFactor());
+}
+
+DenseDiscreteFactor toDenseErrorFactor(const gtsam::DiscreteFactor &factor) {
+  if (auto *dcDiscrete = dynamic_cast<const DCDiscreteFactor *>(&factor))
+    return dcDiscrete->toDenseErrorFactor();
+  if (auto *fused = dynamic_cast<const UnaryEvidenceFactor *>(&factor)) {
+    const gtsam::Vector &logLikelihood = fused->logLikelihood();
+    std::vector<double> errors(logLikelihood.size());
+    for (size_t i = 0; i < errors.size(); i++) errors[i] = -logLikelihood(i);
+    return DenseDiscreteFactor(gtsam::DiscreteKeys(fused->discreteKey()),
+                               std::move(errors));
+  }
+
+  // Any other factor only gives us probabilities.
+  DenseDiscreteFactor errors = toDenseFactor(factor);
+  errors.negLog();
+  return errors;
+}
+
+}  // namespace dcsam
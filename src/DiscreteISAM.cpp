@@ -0,0 +1,534 @@
+/**
+ * @file DiscreteISAM.cpp
+ * @brief Incremental MAP inference for discrete factor graphs
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include "dcsam/DiscreteISAM.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <unordered_set>
+#include <utility>
+
+#include "dcsam/UnaryEvidenceFactor.h"
+
+namespace dcsam {
+
+namespace {
+// Cardinality of `key` in `factor`, avoiding a conversion to a
+// DecisionTreeFactor where possible.
+size_t Cardinality(const gtsam::DiscreteFactor &factor, const gtsam::Key key) {
+  if (auto *table = dynamic_cast<const gtsam::DecisionTreeFactor *>(&factor))
+    return table->cardinality(key);
+  return factor.toDecisionTreeFactor().cardinality(key);
+}
+}  // namespace
+
+DiscreteISAM::DiscreteISAM(ThreadPool::shared_ptr threadPool, bool logDomain)
+    : threadPool_(threadPool), logDomain_(logDomain) {}
+
+DiscreteISAMResult DiscreteISAM::update(
+    const gtsam::DiscreteFactorGraph &newFactors,
+    const gtsam::KeySet &affectedKeys,
+    const gtsam::FactorIndices &removeFactorIndices,
+    const gtsam::FactorIndices &newFactorsIndices) {
+  if (!newFactorsIndices.empty() &&
+      newFactorsIndices.size() != newFactors.size()) {
+    throw std::invalid_argument(
+        "DiscreteISAM::update: newFactorsIndices must have one index per new "
+        "factor");
+  }
+  DiscreteISAMResult result;
+
+  // Remove factors from the cliques they were eliminated in first, so that
+  // their slots can be reused by the new factors. Their keys need to be
+  // re-eliminated, and any left without factors are dropped.
+  std::unordered_set<gtsam::Key> touched;
+  gtsam::KeySet refreshed = affectedKeys;
+  gtsam::KeySet shrunk;
+  for (const size_t idx : removeFactorIndices) {
+    if (idx >= factors_.size() || !factors_[idx]) continue;
+    for (const gtsam::Key k : factors_[idx]->keys()) {
+      touched.insert(k);
+      refreshed.insert(k);
+      shrunk.insert(findComponent(k));
+      std::vector<size_t> &involving = variableIndex_.at(k);
+      involving.erase(std::remove(involving.begin(), involving.end(), idx),
+                      involving.end());
+      if (involving.empty()) result.removedKeys.insert(k);
+      auto clique = cliques_.find(k);
+      if (clique == cliques_.end()) continue;
+      std::vector<size_t> &cliqueFactors = clique->second.factors;
+      cliqueFactors.erase(
+          std::remove(cliqueFactors.begin(), cliqueFactors.end(), idx),
+          cliqueFactors.end());
+    }
+    factors_.remove(idx);
+  }
+  for (const gtsam::Key k : result.removedKeys) {
+    variableIndex_.erase(k);
+    touched.erase(k);
+  }
+
+  // The components that lost factors may have split or lost keys. The
+  // remaining keys of those that did are re-eliminated from scratch.
+  for (const gtsam::Key root : shrunk) {
+    for (const gtsam::Key k : rebuildComponent(root)) {
+      touched.insert(k);
+      refreshed.insert(k);
+    }
+  }
+  for (const gtsam::Key k : result.removedKeys) {
+    cliques_.erase(k);
+    estimate_.erase(k);
+  }
+
+  // Add the new factors, keeping track of which keys they involve and merging
+  // the connected components they join.
+  std::vector<size_t> newFactorIndices;
+  for (size_t i = 0; i < newFactors.size(); i++) {
+    const size_t index =
+        newFactorsIndices.empty() ? factors_.size() : newFactorsIndices[i];
+    if (index < factors_.size() && factors_[index]) {
+      throw std::invalid_argument(
+          "DiscreteISAM::update: factor index is already in use");
+    }
+    if (index >= factors_.size()) factors_.resize(index + 1);
+    const gtsam::DiscreteFactor::shared_ptr &factor = newFactors[i];
+    factors_.replace(index, factor);
+    result.newFactorsIndices.push_back(index);
+    if (!factor) continue;
+    newFactorIndices.push_back(index);
+    const gtsam::KeyVector &factorKeys = factor->keys();
+    for (const gtsam::Key k : factorKeys) {
+      touched.insert(k);
+      result.removedKeys.erase(k);
+      std::vector<size_t> &involving = variableIndex_[k];
+      if (involving.empty() || involving.back() != index)
+        involving.push_back(index);
+      if (components_.find(k) == components_.end()) {
+        components_[k] = k;
+        componentMembers_[k] = gtsam::KeyVector{k};
+      }
+      mergeComponents(k, factorKeys.front());
+    }
+  }
+
+  // Keys from `affectedKeys` we have never seen are not involved in any
+  // factor, so there is nothing to re-eliminate for them.
+  for (const gtsam::Key k : affectedKeys) {
+    if (cliques_.find(k) != cliques_.end()) touched.insert(k);
+  }
+  if (touched.empty()) return result;
+
+  // Split the touched keys and new factors by connected component. Each
+  // component is an independent subproblem.
+  gtsam::FastMap<gtsam::Key, size_t> componentIndex;
+  std::vector<Subproblem> subproblems;
+  auto subproblem = [&](const gtsam::Key k) -> Subproblem & {
+    auto inserted =
+        componentIndex.emplace(findComponent(k), subproblems.size());
+    if (inserted.second) subproblems.emplace_back();
+    return subproblems[inserted.first->second];
+  };
+  for (const gtsam::Key k : touched) subproblem(k).touched.push_back(k);
+  for (const size_t idx : newFactorIndices) {
+    if (factors_[idx]->keys().empty()) continue;
+    subproblem(factors_[idx]->keys().front()).newFactors.push_back(idx);
+  }
+
+  // Work out the top of the tree for each subproblem, and create the cliques
+  // for new keys up front so that the subproblems can be solved concurrently
+  // without modifying `cliques_` or `estimate_`.
+  for (Subproblem &sub : subproblems) {
+    const gtsam::Key root = findComponent(sub.touched.front());
+    sub.unary = (componentMembers_.at(root).size() == 1);
+    sub.refresh = refreshed.exists(sub.touched.front());
+    prepare(&sub);
+    for (const gtsam::Key k : sub.newKeys) {
+      cliques_[k];
+      estimate_[k] = 0;
+    }
+    sub.orderBase = nextOrder_;
+    nextOrder_ += sub.ordering.size();
+  }
+
+  std::vector<DiscreteISAMResult> results(subproblems.size());
+  auto solveSubproblem = [&](size_t i) {
+    if (subproblems[i].ordering.empty()) return;
+    if (subproblems[i].unary)
+      solveUnary(subproblems[i], &results[i]);
+    else
+      solve(subproblems[i], &results[i]);
+  };
+  if (threadPool_ && subproblems.size() > 1) {
+    threadPool_->parallelFor(subproblems.size(), solveSubproblem);
+  } else {
+    for (size_t i = 0; i < subproblems.size(); i++) solveSubproblem(i);
+  }
+
+  for (size_t i = 0; i < subproblems.size(); i++) {
+    if (subproblems[i].ordering.empty()) continue;
+    const DiscreteISAMResult &r = results[i];
+    result.variablesReeliminated += r.variablesReeliminated;
+    result.variablesSolved += r.variablesSolved;
+    result.unaryVariablesSolved += r.unaryVariablesSolved;
+    for (const gtsam::Key k : r.changedKeys) result.changedKeys.insert(k);
+    result.componentsSolved++;
+  }
+  return result;
+}
+
+const std::vector<size_t> &DiscreteISAM::factorsInvolving(
+    const gtsam::Key key) const {
+  static const std::vector<size_t> kNone;
+  auto it = variableIndex_.find(key);
+  return (it == variableIndex_.end()) ? kNone : it->second;
+}
+
+gtsam::KeyVector DiscreteISAM::componentKeys(const gtsam::Key key) const {
+  if (cliques_.find(key) == cliques_.end()) return gtsam::KeyVector();
+
+  // Breadth-first search over the factors, giving up as soon as the keys
+  // found so far have too many joint assignments.
+  gtsam::KeyVector keys;
+  keys.push_back(key);
+  std::unordered_set<gtsam::Key> seen;
+  seen.insert(key);
+  std::unordered_set<size_t> seenFactors;
+  size_t assignments = std::max<size_t>(cardinality(key), 1);
+  for (size_t i = 0; i < keys.size(); i++) {
+    for (const size_t idx : factorsInvolving(keys[i])) {
+      if (!seenFactors.insert(idx).second) continue;
+      for (const gtsam::Key j : factors_[idx]->keys()) {
+        if (!seen.insert(j).second) continue;
+        assignments *= std::max<size_t>(cardinality(j), 1);
+        if (assignments > kMaxMarginalAssignments) return gtsam::KeyVector();
+        keys.push_back(j);
+      }
+    }
+  }
+  return keys;
+}
+
+std::vector<double> DiscreteISAM::marginal(const gtsam::Key key) const {
+  const gtsam::KeyVector keys = componentKeys(key);
+  if (keys.empty()) return std::vector<double>();
+
+  // The factors of the component as probability tables. Error tables are
+  // shifted by their minimum first, which only scales each table.
+  std::unordered_set<size_t> seenFactors;
+  std::vector<DenseDiscreteFactor> tables;
+  for (const gtsam::Key k : keys) {
+    for (const size_t idx : factorsInvolving(k)) {
+      if (!seenFactors.insert(idx).second) continue;
+      if (!logDomain_) {
+        tables.push_back(toDenseFactor(*factors_[idx]));
+        continue;
+      }
+      const DenseDiscreteFactor errors = toDenseErrorFactor(*factors_[idx]);
+      std::vector<double> table = errors.table();
+      const double minError = *std::min_element(table.begin(), table.end());
+      for (double &value : table) value = std::exp(minError - value);
+      tables.push_back(
+          DenseDiscreteFactor(errors.discreteKeys(), std::move(table)));
+    }
+  }
+
+  // Sum out the other keys, farthest from `key` first.
+  for (size_t i = keys.size(); i-- > 1;) {
+    DenseDiscreteFactor product;
+    std::vector<DenseDiscreteFactor> rest;
+    for (DenseDiscreteFactor &table : tables) {
+      if (table.cardinality(keys[i]) > 0)
+        product = product * table;
+      else
+        rest.push_back(std::move(table));
+    }
+    rest.push_back(product.sum(keys[i]));
+    tables = std::move(rest);
+  }
+  DenseDiscreteFactor product;
+  for (const DenseDiscreteFactor &table : tables) product = product * table;
+  if (product.discreteKeys().size() != 1) return std::vector<double>();
+
+  std::vector<double> probs = product.table();
+  double total = 0.0;
+  for (const double p : probs) total += p;
+  if (!(total > 0.0) || !std::isfinite(total)) return std::vector<double>();
+  for (double &p : probs) p /= total;
+  return probs;
+}
+
+void DiscreteISAM::mergeComponents(gtsam::Key a, gtsam::Key b) {
+  a = findComponent(a);
+  b = findComponent(b);
+  if (a == b) return;
+
+  // Relabel the keys of the smaller component.
+  if (componentMembers_.at(a).size() > componentMembers_.at(b).size())
+    std::swap(a, b);
+  gtsam::KeyVector &members = componentMembers_.at(b);
+  for (const gtsam::Key k : componentMembers_.at(a)) {
+    components_[k] = b;
+    members.push_back(k);
+  }
+  componentMembers_.erase(a);
+}
+
+gtsam::KeyVector DiscreteISAM::rebuildComponent(const gtsam::Key root) {
+  const gtsam::KeyVector members = std::move(componentMembers_.at(root));
+  componentMembers_.erase(root);
+  for (const gtsam::Key k : members) components_.erase(k);
+
+  // Label the remaining keys by breadth-first search over their factors.
+  // Each component is identified by its first key, so an unchanged component
+  // keeps `root`.
+  size_t numParts = 0;
+  size_t numRemaining = 0;
+  for (const gtsam::Key k : members) {
+    if (variableIndex_.find(k) == variableIndex_.end()) continue;
+    if (!components_.emplace(k, k).second) continue;
+    gtsam::KeyVector &part = componentMembers_[k];
+    part.push_back(k);
+    for (size_t i = 0; i < part.size(); i++) {
+      for (const size_t idx : variableIndex_.at(part[i])) {
+        for (const gtsam::Key j : factors_[idx]->keys()) {
+          if (components_.emplace(j, k).second) part.push_back(j);
+        }
+      }
+    }
+    numParts++;
+    numRemaining += part.size();
+  }
+  if (numParts == 1 && numRemaining == members.size()) return {};
+
+  // Drop the Bayes tree links between the remaining keys, so that each part
+  // is re-eliminated on its own.
+  gtsam::KeyVector remaining;
+  for (const gtsam::Key k : members) {
+    auto clique = cliques_.find(k);
+    if (clique == cliques_.end()) continue;
+    clique->second.parent = boost::none;
+    clique->second.children.clear();
+    if (components_.find(k) != components_.end()) remaining.push_back(k);
+  }
+  return remaining;
+}
+
+void DiscreteISAM::prepare(Subproblem *sub) const {
+  // Remove the top of the tree: every clique containing a touched key, along
+  // with all of its ancestors. Keys seen for the first time are eliminated
+  // last, after the existing keys (which keep their relative order).
+  for (const gtsam::Key k : sub->touched) {
+    if (cliques_.find(k) == cliques_.end()) {
+      sub->top.insert(k);
+      sub->newKeys.push_back(k);
+      continue;
+    }
+    boost::optional<gtsam::Key> j = k;
+    while (j && sub->top.insert(*j).second) {
+      sub->ordering.push_back(*j);
+      j = cliques_.at(*j).parent;
+    }
+  }
+  std::sort(sub->ordering.begin(), sub->ordering.end(),
+            [this](const gtsam::Key a, const gtsam::Key b) {
+              return cliques_.at(a).order < cliques_.at(b).order;
+            });
+  std::sort(sub->newKeys.begin(), sub->newKeys.end());
+  sub->ordering.insert(sub->ordering.end(), sub->newKeys.begin(),
+                       sub->newKeys.end());
+}
+
+void DiscreteISAM::solveUnary(const Subproblem &sub,
+                              DiscreteISAMResult *result) {
+  const gtsam::Key k = sub.touched.front();
+  const bool isNew = !sub.newKeys.empty();
+  Clique &clique = cliques_.at(k);
+  clique.order = sub.orderBase;
+  if (isNew) clique.cardinality = Cardinality(*factors_[sub.newFactors[0]], k);
+
+  // Unless existing factors may have changed, only the contributions of the
+  // new factors need to be added.
+  std::vector<size_t> toAdd;
+  if (sub.refresh ||
+      static_cast<size_t>(clique.logLikelihood.size()) != clique.cardinality) {
+    clique.logLikelihood = gtsam::Vector::Zero(clique.cardinality);
+    toAdd = clique.factors;
+  }
+  toAdd.insert(toAdd.end(), sub.newFactors.begin(), sub.newFactors.end());
+  clique.factors.insert(clique.factors.end(), sub.newFactors.begin(),
+                        sub.newFactors.end());
+
+  // Each factor's table is a single row over the values of `k`.
+  for (const size_t idx : toAdd) {
+    // Fused evidence already holds its log-likelihood.
+    if (auto *fused =
+            dynamic_cast<const UnaryEvidenceFactor *>(factors_[idx].get())) {
+      clique.logLikelihood += fused->logLikelihood();
+      continue;
+    }
+    if (logDomain_) {
+      const DenseDiscreteFactor errors = toDenseErrorFactor(*factors_[idx]);
+      clique.logLikelihood -= Eigen::Map<const gtsam::Vector>(
+          errors.table().data(), clique.cardinality);
+      continue;
+    }
+    const DenseDiscreteFactor table = toDenseFactor(*factors_[idx]);
+    clique.logLikelihood += Eigen::Map<const Eigen::ArrayXd>(
+                                table.table().data(), clique.cardinality)
+                                .log()
+                                .matrix();
+  }
+
+  Eigen::Index best = 0;
+  clique.logLikelihood.maxCoeff(&best);
+  size_t &estimate = estimate_.at(k);
+  if (isNew || estimate != static_cast<size_t>(best)) {
+    estimate = best;
+    result->changedKeys.insert(k);
+  }
+  result->variablesReeliminated = 1;
+  result->variablesSolved = 1;
+  result->unaryVariablesSolved = 1;
+}
+
+void DiscreteISAM::solve(const Subproblem &sub, DiscreteISAMResult *result) {
+  const gtsam::KeyVector &ordering = sub.ordering;
+  gtsam::FastMap<gtsam::Key, size_t> position;
+  for (size_t i = 0; i < ordering.size(); i++) position[ordering[i]] = i;
+
+  // Every factor (or message) is eliminated at its earliest key. All of the
+  // keys involved are guaranteed to be in the top of the tree.
+  auto earliest = [&position](const gtsam::KeyVector &keys) {
+    size_t first = std::numeric_limits<size_t>::max();
+    for (const gtsam::Key k : keys) first = std::min(first, position.at(k));
+    return first;
+  };
+
+  // Sort the factors and orphaned subtrees into buckets for elimination.
+  std::vector<std::vector<size_t>> bucketFactors(ordering.size());
+  std::vector<gtsam::KeyVector> bucketChildren(ordering.size());
+  std::unordered_set<gtsam::Key> newKeys(sub.newKeys.begin(),
+                                         sub.newKeys.end());
+  for (const gtsam::Key k : ordering) {
+    if (newKeys.count(k)) continue;
+    const Clique &clique = cliques_.at(k);
+    for (const size_t idx : clique.factors) {
+      bucketFactors[earliest(factors_[idx]->keys())].push_back(idx);
+    }
+    for (const gtsam::Key child : clique.children) {
+      if (sub.top.count(child)) continue;
+      bucketChildren[earliest(cliques_.at(child).message.keys())].push_back(
+          child);
+    }
+  }
+  for (const size_t idx : sub.newFactors) {
+    bucketFactors[earliest(factors_[idx]->keys())].push_back(idx);
+  }
+
+  // Max-product elimination of the top, one variable at a time.
+  for (size_t i = 0; i < ordering.size(); i++) {
+    const gtsam::Key k = ordering[i];
+    Clique &clique = cliques_.at(k);
+    clique.order = sub.orderBase + i;
+    clique.factors = std::move(bucketFactors[i]);
+    clique.children = std::move(bucketChildren[i]);
+
+    DenseDiscreteFactor product =
+        logDomain_ ? DenseDiscreteFactor(gtsam::DiscreteKeys(), {0.0})
+                   : DenseDiscreteFactor();
+    for (const size_t idx : clique.factors) {
+      if (logDomain_)
+        product = product + toDenseErrorFactor(*factors_[idx]);
+      else
+        product = product * toDenseFactor(*factors_[idx]);
+    }
+    for (const gtsam::Key child : clique.children) {
+      Clique &childClique = cliques_.at(child);
+      if (logDomain_)
+        product = product + childClique.message;
+      else
+        product = product * childClique.message;
+      childClique.parent = k;
+    }
+
+    if (product.cardinality(k) > 0) {
+      clique.cardinality = product.cardinality(k);
+      clique.message = logDomain_ ? product.min(k) : product.max(k);
+    } else {
+      clique.cardinality = 1;
+      clique.message = product;
+    }
+    clique.product = std::move(product);
+
+    // The parent of this clique is the earliest key in its separator.
+    clique.parent = boost::none;
+    if (!clique.message.keys().empty()) {
+      const size_t parentPos = earliest(clique.message.keys());
+      clique.parent = ordering[parentPos];
+      bucketChildren[parentPos].push_back(k);
+    }
+  }
+  result->variablesReeliminated = ordering.size();
+
+  // Back-substitution, parents first. A clique's separator is contained in
+  // its parent's frontal and separator variables, so if neither changed we
+  // can skip the whole subtree below it.
+  std::priority_queue<std::pair<size_t, gtsam::Key>> queue;
+  std::unordered_set<gtsam::Key> queued;
+  for (const gtsam::Key k : ordering) {
+    queue.emplace(cliques_.at(k).order, k);
+    queued.insert(k);
+  }
+  while (!queue.empty()) {
+    const gtsam::Key k = queue.top().second;
+    queue.pop();
+    const Clique &clique = cliques_.at(k);
+    result->variablesSolved++;
+
+    DiscreteValues assignment;
+    bool separatorChanged = false;
+    for (const gtsam::Key j : clique.product.keys()) {
+      if (j == k) continue;
+      assignment[j] = estimate_.at(j);
+      if (result->changedKeys.exists(j)) separatorChanged = true;
+    }
+
+    size_t best = 0;
+    double bestValue = -std::numeric_limits<double>::infinity();
+    for (size_t v = 0; v < clique.cardinality; v++) {
+      assignment[k] = v;
+      // Lower error is better in the log domain.
+      const double value = logDomain_ ? -clique.product(assignment)
+                                      : clique.product(assignment);
+      if (value > bestValue) {
+        bestValue = value;
+        best = v;
+      }
+    }
+
+    // New keys always count as changed.
+    size_t &estimate = estimate_.at(k);
+    const bool valueChanged = newKeys.count(k) || estimate != best;
+    if (valueChanged) {
+      estimate = best;
+      result->changedKeys.insert(k);
+    }
+
+    if (!valueChanged && !separatorChanged) continue;
+    for (const gtsam::Key child : clique.children) {
+      if (queued.insert(child).second) {
+        queue.emplace(cliques_.at(child).order, child);
+      }
+    }
+  }
+}
+
+}  // namespace dcsam
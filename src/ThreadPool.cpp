@@ -0,0 +1,98 @@
+/**
+ * @file ThreadPool.cpp
+ * @brief Minimal fixed-size thread pool for data-parallel loops
+ * @author Kevin Doherty, kdoherty@mit.edu
+ * Copyright 2022 The Ambitious Folks of the MRG
+ */
+
+#include "dcsam/ThreadPool.h"
+
+#include <algorithm>
+
+namespace dcsam {
+
+ThreadPool::ThreadPool(size_t numThreads) {
+  for (size_t i = 1; i < numThreads; i++) {
+    workers_.emplace_back(&ThreadPool::run, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  for (std::thread &worker : workers_) worker.join();
+}
+
+void ThreadPool::parallelFor(size_t n, const std::function<void(size_t)> &f) {
+  if (workers_.empty() || n <= 1) {
+    for (size_t i = 0; i < n; i++) f(i);
+    return;
+  }
+
+  // About four chunks per thread balances uneven iterations without
+  // contending on `next_` for every one.
+  const size_t chunk = std::max<size_t>(1, n / (4 * size()));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    job_ = &f;
+    jobSize_ = n;
+    chunkSize_ = chunk;
+    next_.store(0, std::memory_order_relaxed);
+    active_ = workers_.size();
+    error_ = nullptr;
+    generation_++;
+  }
+  start_.notify_all();
+  work(f, n, chunk);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return active_ == 0; });
+  job_ = nullptr;
+  if (error_) std::rethrow_exception(error_);
+}
+
+void ThreadPool::run() {
+  size_t generation = 0;
+  while (true) {
+    const std::function<void(size_t)> *job;
+    size_t n, chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [&] { return stop_ || generation_ != generation; });
+      if (stop_) return;
+      generation = generation_;
+      job = job_;
+      n = jobSize_;
+      chunk = chunkSize_;
+    }
+    work(*job, n, chunk);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--active_ == 0) done_.notify_all();
+    }
+  }
+}
+
+void ThreadPool::work(const std::function<void(size_t)> &f, size_t n,
+                      size_t chunk) {
+  while (true) {
+    // The job was published under `mutex_`, so claiming indices only needs to
+    // be atomic.
+    const size_t begin = next_.fetch_add(chunk, std::memory_order_relaxed);
+    if (begin >= n) return;
+    const size_t end = std::min(n, begin + chunk);
+    for (size_t i = begin; i < end; i++) {
+      try {
+        f(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_) error_ = std::current_exception();
+      }
+    }
+  }
+}
+
+}  // namespace dcsam
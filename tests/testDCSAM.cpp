@@ -14,6 +14,8 @@
 #include <gtsam/discrete/DiscreteMarginals.h>
 #include <gtsam/geometry/Pose2.h>
 #include <gtsam/inference/BayesNet-inst.h>
+#include <gtsam/linear/GaussianFactorGraph.h>
+#include <gtsam/linear/JacobianFactor.h>
 #include <gtsam/nonlinear/GaussNewtonOptimizer.h>
 #include <gtsam/nonlinear/Symbol.h>
 #include <gtsam/sam/BearingRangeFactor.h>
@@ -27,15 +29,23 @@
 #endif
 
 // Our custom DCSAM includes
+#include "dcsam/AsyncDCSAM.h"
+#include "dcsam/ContinuousStateStore.h"
 #include "dcsam/DCContinuousFactor.h"
 #include "dcsam/DCDiscreteFactor.h"
 #include "dcsam/DCEMFactor.h"
+#include "dcsam/DCFixedLagSmoother.h"
 #include "dcsam/DCMaxMixtureFactor.h"
 #include "dcsam/DCMixtureFactor.h"
 #include "dcsam/DCSAM.h"
+#include "dcsam/DCSAM_utils.h"
+#include "dcsam/DenseDiscreteFactor.h"
+#include "dcsam/DiscreteISAM.h"
 #include "dcsam/DiscretePriorFactor.h"
 #include "dcsam/SemanticBearingRangeFactor.h"
 #include "dcsam/SmartDiscretePriorFactor.h"
+#include "dcsam/ThreadPool.h"
+#include "dcsam/UnaryEvidenceFactor.h"
 
 const double tol = 1e-7;
 
@@ -1663,6 +1673,2017 @@ TEST(TestSuite, factor_duplicate) {
 
 }
 
+/**
+ * Test the incremental discrete solver. We build a small loopy discrete graph
+ * (three ternary variables with priors and pairwise factors forming a cycle)
+ * one factor at a time, and check that after each update the DiscreteISAM
+ * estimate agrees with a batch solve of the same factors. Finally, we modify
+ * one prior in place and check that marking its key as affected is enough for
+ * the incremental solver to recover the new batch solution.
+ */
+TEST(TestSuite, discrete_isam) {
+  const size_t cardinality = 3;
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), cardinality);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), cardinality);
+  gtsam::DiscreteKey d3(gtsam::Symbol('d', 3), cardinality);
+
+  // Pairwise factor favoring equal assignments.
+  const std::vector<double> pairwise{0.8, 0.1, 0.1, 0.1, 0.8,
+                                     0.1, 0.1, 0.1, 0.8};
+
+  auto prior1 = boost::make_shared<dcsam::SmartDiscretePriorFactor>(
+      d1, std::vector<double>{0.2, 0.7, 0.1});
+  auto prior2 = boost::make_shared<dcsam::SmartDiscretePriorFactor>(
+      d2, std::vector<double>{0.6, 0.3, 0.1});
+  auto prior3 = boost::make_shared<dcsam::SmartDiscretePriorFactor>(
+      d3, std::vector<double>{0.5, 0.2, 0.3});
+
+  std::vector<gtsam::DiscreteFactor::shared_ptr> factors{
+      prior1,
+      boost::make_shared<gtsam::DecisionTreeFactor>(d1 & d2, pairwise),
+      prior2,
+      boost::make_shared<gtsam::DecisionTreeFactor>(d2 & d3, pairwise),
+      prior3,
+      boost::make_shared<gtsam::DecisionTreeFactor>(d1 & d3, pairwise)};
+
+  gtsam::DiscreteFactorGraph batch;
+  dcsam::DiscreteISAM isam;
+  for (const auto& factor : factors) {
+    gtsam::DiscreteFactorGraph newFactors;
+    newFactors.push_back(factor);
+    batch.push_back(factor);
+    isam.update(newFactors);
+
+    dcsam::DiscreteValues expected = batch.optimize();
+    for (const auto& kv : expected) {
+      EXPECT_EQ(isam.estimate().at(kv.first), kv.second);
+    }
+  }
+  EXPECT_EQ(isam.size(), 3);
+
+  // Strongly favor d3 = 2, which should pull the whole cycle along with it.
+  prior3->updateProbs({0.001, 0.001, 0.998});
+  gtsam::KeySet affectedKeys;
+  affectedKeys.insert(d3.first);
+  dcsam::DiscreteISAMResult result =
+      isam.update(gtsam::DiscreteFactorGraph(), affectedKeys);
+
+  dcsam::DiscreteValues expected = batch.optimize();
+  EXPECT_EQ(expected.at(d3.first), 2);
+  for (const auto& kv : expected) {
+    EXPECT_EQ(isam.estimate().at(kv.first), kv.second);
+  }
+  EXPECT_EQ(result.changedKeys.exists(d3.first), true);
+}
+
+/**
+ * Test that DiscreteISAM tracks connected components as factors join them,
+ * only re-solves the components touched by an update, and gives the same
+ * answer when solving components in parallel on a thread pool.
+ */
+TEST(TestSuite, discrete_isam_components) {
+  const size_t numVariables = 20;
+  const std::vector<double> pairwise{0.8, 0.2, 0.2, 0.8};
+  auto pool = boost::make_shared<dcsam::ThreadPool>(4);
+  dcsam::DiscreteISAM serial, parallel(pool);
+
+  // One prior per variable: every variable is its own component.
+  gtsam::DiscreteFactorGraph batch, priors;
+  for (size_t i = 0; i < numVariables; i++) {
+    gtsam::DiscreteKey di(gtsam::Symbol('d', i), 2);
+    priors.push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+        di, std::vector<double>{(i % 3 == 0) ? 0.3 : 0.6,
+                                (i % 3 == 0) ? 0.7 : 0.4}));
+  }
+  for (const auto& factor : priors) batch.push_back(factor);
+  serial.update(priors);
+  dcsam::DiscreteISAMResult result = parallel.update(priors);
+  EXPECT_EQ(parallel.numComponents(), numVariables);
+  EXPECT_EQ(result.componentsSolved, numVariables);
+  EXPECT_EQ(result.unaryVariablesSolved, numVariables);
+
+  // Variables with only unary factors are solved directly, and incrementally.
+  gtsam::DiscreteFactorGraph morePriors;
+  gtsam::DiscreteKey d0(gtsam::Symbol('d', 0), 2);
+  morePriors.push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+      d0, std::vector<double>{0.8, 0.2}));
+  for (const auto& factor : morePriors) batch.push_back(factor);
+  serial.update(morePriors);
+  result = parallel.update(morePriors);
+  EXPECT_EQ(result.unaryVariablesSolved, 1);
+  EXPECT_EQ(parallel.estimate().at(d0.first), batch.optimize().at(d0.first));
+
+  // Couple pairs of variables, leaving ten components of size two.
+  gtsam::DiscreteFactorGraph pairs;
+  for (size_t i = 0; i < numVariables; i += 2) {
+    gtsam::DiscreteKey di(gtsam::Symbol('d', i), 2);
+    gtsam::DiscreteKey dj(gtsam::Symbol('d', i + 1), 2);
+    pairs.push_back(
+        boost::make_shared<gtsam::DecisionTreeFactor>(di & dj, pairwise));
+  }
+  for (const auto& factor : pairs) batch.push_back(factor);
+  serial.update(pairs);
+  result = parallel.update(pairs);
+  EXPECT_EQ(parallel.numComponents(), numVariables / 2);
+  EXPECT_EQ(result.componentsSolved, numVariables / 2);
+  EXPECT_EQ(result.unaryVariablesSolved, 0);
+
+  dcsam::DiscreteValues expected = batch.optimize();
+  for (const auto& kv : expected) {
+    EXPECT_EQ(serial.estimate().at(kv.first), kv.second);
+    EXPECT_EQ(parallel.estimate().at(kv.first), kv.second);
+  }
+
+  // Touching a single variable only re-solves its component.
+  gtsam::KeySet affectedKeys;
+  affectedKeys.insert(gtsam::Symbol('d', 0));
+  result = parallel.update(gtsam::DiscreteFactorGraph(), affectedKeys);
+  EXPECT_EQ(result.componentsSolved, 1);
+  EXPECT_LE(result.variablesReeliminated, 2);
+}
+
+/**
+ * Test that DCSAM marks the correct iSAM2 factors for relinearization when
+ * plain nonlinear factors and DC factors are interleaved. We add a prior on x0
+ * with a DC mixture on x0, then a between factor on (x0, x1) with a DC mixture
+ * on x1, so that the DC factors end up at iSAM2 indices 1 and 3. Changing only
+ * the discrete assignment for the second mixture should mark only x1.
+ */
+TEST(TestSuite, dc_factor_index_bookkeeping) {
+  gtsam::Symbol x0('x', 0), x1('x', 1);
+  gtsam::DiscreteKey d0(gtsam::Symbol('d', 0), 2);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  gtsam::noiseModel::Isotropic::shared_ptr nullNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 8.0);
+
+  auto makeMixture = [&](const gtsam::Symbol& x, const gtsam::DiscreteKey& d) {
+    std::vector<gtsam::PriorFactor<double>> components{
+        gtsam::PriorFactor<double>(x, 0.0, noise),
+        gtsam::PriorFactor<double>(x, 0.0, nullNoise)};
+    return dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+        gtsam::KeyVector{x}, d, components);
+  };
+
+  // Disable threshold-based relinearization so that the only keys marked by
+  // iSAM2 are those of the factors DCSAM asks it to relinearize.
+  gtsam::ISAM2Params params;
+  params.enableRelinearization = false;
+  dcsam::DCSAM dcsam(params);
+
+  dcsam::HybridFactorGraph hfg;
+  gtsam::Values initialGuess;
+  dcsam::DiscreteValues initialGuessDiscrete;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(x0, 0.0, noise));
+  hfg.push_dc(makeMixture(x0, d0));
+  initialGuess.insert(x0, 0.5);
+  initialGuessDiscrete[d0.first] = 0;
+  dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+
+  hfg.clear();
+  initialGuess.clear();
+  initialGuessDiscrete.clear();
+  hfg.push_nonlinear(gtsam::BetweenFactor<double>(x0, x1, 1.0, noise));
+  hfg.push_dc(makeMixture(x1, d1));
+  initialGuess.insert(x1, 1.5);
+  initialGuessDiscrete[d1.first] = 0;
+  dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+
+  // Bring all of the DC factors to a known discrete assignment.
+  dcsam::DiscreteValues dv;
+  dv[d0.first] = 0;
+  dv[d1.first] = 0;
+  dcsam.updateContinuousInfo(dv, gtsam::NonlinearFactorGraph(),
+                             gtsam::Values());
+
+  // Nothing changed, so nothing should be marked.
+  gtsam::ISAM2Result result = dcsam.updateContinuousInfo(
+      dv, gtsam::NonlinearFactorGraph(), gtsam::Values());
+  EXPECT_EQ(result.markedKeys.size(), 0);
+
+  // Flip only d1: only the mixture on x1 should be relinearized.
+  dv[d1.first] = 1;
+  result = dcsam.updateContinuousInfo(dv, gtsam::NonlinearFactorGraph(),
+                                      gtsam::Values());
+  EXPECT_EQ(result.markedKeys.size(), 1);
+  EXPECT_EQ(result.markedKeys.exists(x1), true);
+}
+
+/**
+ * Test threshold-gated refreshing of DCDiscreteFactors. We initialize a
+ * landmark observed by a semantic bearing-range factor far from its prior, so
+ * that the continuous solve moves it by roughly 0.5. With a small
+ * `discreteRefreshThreshold` the DC factor is refreshed after the solve; with a
+ * large one it is skipped.
+ */
+TEST(TestSuite, discrete_refresh_threshold) {
+  gtsam::Symbol x0('x', 0), l1('l', 1);
+  gtsam::DiscreteKey lc1(gtsam::Symbol('c', 1), 2);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<gtsam::Pose2>(
+      x0, gtsam::Pose2(0, 0, 0), gtsam::noiseModel::Isotropic::Sigma(3, 0.1)));
+  hfg.push_nonlinear(gtsam::PriorFactor<gtsam::Point2>(
+      l1, gtsam::Point2(1, 1), gtsam::noiseModel::Isotropic::Sigma(2, 0.1)));
+  hfg.push_dc(dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>(
+      x0, l1, lc1, std::vector<double>{0.9, 0.1},
+      gtsam::Rot2::fromDegrees(45), std::sqrt(2.0),
+      gtsam::noiseModel::Isotropic::Sigma(2, 0.1)));
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x0, gtsam::Pose2(0, 0, 0));
+  initialGuess.insert(l1, gtsam::Point2(1.5, 1.5));
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[lc1.first] = 0;
+
+  dcsam::DCSAMParams params;
+  params.discreteRefreshThreshold = 1e-3;
+  dcsam::DCSAM refreshing(params);
+  dcsam::DCSAMUpdateResult result =
+      refreshing.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 1);
+  EXPECT_EQ(result.dcDiscreteFactorsSkipped, 0);
+
+  // The two priors and the DC factor are all new to iSAM2, so none of them
+  // count as relinearized DC factors.
+  EXPECT_EQ(result.isamResult.newFactorsIndices.size(), 3);
+  EXPECT_EQ(result.dcFactorsRelinearized, 0);
+
+  params.discreteRefreshThreshold = 10.0;
+  dcsam::DCSAM skipping(params);
+  result = skipping.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 0);
+  EXPECT_EQ(result.dcDiscreteFactorsSkipped, 1);
+}
+
+/**
+ * Test that DCDiscreteFactors constructed with the same ContinuousStateStore
+ * share their continuous values rather than holding copies: updating the
+ * values through one factor is visible to the other, and the store holds one
+ * entry per continuous variable regardless of the number of factors.
+ */
+TEST(TestSuite, shared_continuous_state) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), 2);
+
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  gtsam::noiseModel::Isotropic::shared_ptr nullNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 8.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 0.0, nullNoise)};
+
+  auto mixture1 =
+      boost::make_shared<dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>>(
+          gtsam::KeyVector{x1}, d1, components);
+  auto mixture2 =
+      boost::make_shared<dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>>(
+          gtsam::KeyVector{x1}, d2, components);
+
+  auto store = boost::make_shared<dcsam::ContinuousStateStore>();
+  dcsam::DCDiscreteFactor f1(mixture1, store);
+  dcsam::DCDiscreteFactor f2(mixture2, store);
+
+  gtsam::Values values;
+  values.insert(x1, -2.5);
+  EXPECT_EQ(f1.updateContinuous(values), true);
+  const size_t version = store->version(x1);
+
+  // f2 sees the value set through f1, and there is nothing left to update.
+  EXPECT_EQ(f2.continuousState()->values().at<double>(x1), -2.5);
+  EXPECT_EQ(f2.updateContinuous(values), false);
+  EXPECT_EQ(store->size(), 1);
+
+  // Changes below the threshold are ignored; larger ones bump the version.
+  values.update(x1, -2.45);
+  EXPECT_EQ(f2.updateContinuous(values, 0.1), false);
+  EXPECT_EQ(store->version(x1), version);
+  values.update(x1, -1.0);
+  EXPECT_EQ(f2.updateContinuous(values, 0.1), true);
+  EXPECT_EQ(f1.continuousState()->values().at<double>(x1), -1.0);
+  EXPECT_GT(store->version(x1), version);
+}
+
+/**
+ * Test that DCSAM keeps alternating between discrete and continuous solves up
+ * to `maxIterations` times per update, and that the hybrid error does not
+ * increase when it does.
+ */
+TEST(TestSuite, multi_iteration_alternation) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+
+  // Bimodal measurement of x1: the discrete variable selects the mode, and a
+  // stronger continuous prior pulls x1 toward the second mode. Starting from
+  // the first mode, it takes a second alternation to switch.
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 4.0, noise)};
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(
+      x1, 3.5, gtsam::noiseModel::Isotropic::Sigma(1, 0.2)));
+  hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{x1}, d1, components));
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 0.0);
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+
+  dcsam::DCSAMParams params;
+  params.isamParams.setOptimizationParams(gtsam::ISAM2GaussNewtonParams());
+  params.maxIterations = 5;
+  dcsam::DCSAM dcsam(params);
+  dcsam::DCSAMUpdateResult result =
+      dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_GE(result.iterations, 2);
+  EXPECT_LE(result.iterations, params.maxIterations);
+  EXPECT_EQ(result.discreteVariablesChanged, 1);
+
+  // Further updates with no new information cannot make things worse.
+  const double error = dcsam.hybridError();
+  result = dcsam.update();
+  EXPECT_LE(dcsam.hybridError(), error + 1e-9);
+
+  // Once converged, a single alternation leaves the assignment unchanged.
+  EXPECT_EQ(result.iterations, 1);
+  EXPECT_EQ(result.discreteVariablesChanged, 0);
+  EXPECT_EQ(dcsam.calculateEstimate().discrete.at(d1.first), 1);
+}
+
+/**
+ * Test that the estimate returned by `calculateEstimate` is the cached one
+ * from the last update, that the per-key queries agree with it, and that the
+ * estimate version only changes when the solver does. The discrete half of
+ * the DC mixture is refreshed at the end of the update, so the first query
+ * finishes the discrete solve, and a repeated one does no discrete work.
+ */
+TEST(TestSuite, cached_estimate) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 1.0, noise),
+      gtsam::PriorFactor<double>(x1, 5.0, noise)};
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(
+      x1, 1.0, gtsam::noiseModel::Isotropic::Sigma(1, 0.1)));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(d1, {0.3, 0.7}));
+  hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{x1}, d2, components));
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 0.0);
+
+  dcsam::DCSAM dcsam;
+  dcsam.update(hfg, initialGuess);
+  const size_t version = dcsam.estimateVersion();
+  boost::shared_ptr<dcsam::DCDiscreteFactor> dcDiscrete;
+  for (const auto& factor : dcsam.getDiscreteFactorGraph()) {
+    auto dcDiscreteFactor =
+        boost::dynamic_pointer_cast<dcsam::DCDiscreteFactor>(factor);
+    if (dcDiscreteFactor) dcDiscrete = dcDiscreteFactor;
+  }
+  EXPECT_TRUE(dcDiscrete);
+  const size_t misses = dcDiscrete->cacheMisses();
+
+  // The estimate can be queried through a const reference.
+  const dcsam::DCSAM& constDcsam = dcsam;
+  dcsam::DCValues dcvals = constDcsam.calculateEstimate();
+  EXPECT_NEAR(dcvals.continuous.at<double>(x1), 1.0, 1e-6);
+  EXPECT_EQ(dcvals.discrete.at(d1.first), 1);
+  EXPECT_EQ(dcvals.discrete.at(d2.first), 0);
+  EXPECT_EQ(constDcsam.calculateEstimate<double>(x1),
+            dcvals.continuous.at<double>(x1));
+  EXPECT_EQ(constDcsam.calculateDiscreteEstimate(d1.first), 1);
+  EXPECT_GT(dcDiscrete->cacheMisses(), misses);
+
+  // Querying the estimate again does not change it, and does no discrete
+  // work.
+  EXPECT_EQ(dcsam.estimateVersion(), version);
+  const size_t hits = dcDiscrete->cacheHits();
+  const size_t refreshes = dcDiscrete->cacheMisses();
+  constDcsam.calculateEstimate();
+  EXPECT_EQ(constDcsam.solveDiscrete().at(d2.first), 0);
+  EXPECT_EQ(dcsam.estimateVersion(), version);
+  EXPECT_EQ(dcDiscrete->cacheHits(), hits);
+  EXPECT_EQ(dcDiscrete->cacheMisses(), refreshes);
+}
+
+/**
+ * Test that batches enqueued with AsyncDCSAM are all reflected in the
+ * published estimate once flushed, and agree with a synchronous solve.
+ */
+TEST(TestSuite, async_dcsam) {
+  gtsam::Symbol x0('x', 0), x1('x', 1);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.1);
+
+  dcsam::HybridFactorGraph first, second;
+  first.push_nonlinear(gtsam::PriorFactor<double>(x0, 0.0, noise));
+  second.push_nonlinear(gtsam::BetweenFactor<double>(x0, x1, 1.0, noise));
+  gtsam::Values firstGuess, secondGuess;
+  firstGuess.insert(x0, 0.5);
+  secondGuess.insert(x1, 0.5);
+
+  dcsam::AsyncDCSAM async;
+  EXPECT_EQ(async.estimate()->batches, 0);
+  EXPECT_EQ(async.enqueue(first, firstGuess), 1);
+  EXPECT_EQ(async.enqueue(second, secondGuess), 2);
+  async.flush();
+
+  dcsam::AsyncDCSAM::SnapshotPtr snapshot = async.estimate();
+  EXPECT_EQ(snapshot->batches, 2);
+  EXPECT_GE(async.numUpdates(), 1);
+  EXPECT_LE(async.numUpdates(), 2);
+
+  dcsam::DCSAM dcsam;
+  dcsam.update(first, firstGuess);
+  dcsam.update(second, secondGuess);
+  EXPECT_NEAR(snapshot->estimate.continuous.at<double>(x1),
+              dcsam.calculateEstimate<double>(x1), 1e-6);
+}
+
+/**
+ * Test that DCFixedLagSmoother marginalizes continuous and discrete variables
+ * that fall outside its window, while keeping estimates for the variables in
+ * the window consistent with a full DCSAM solve.
+ */
+TEST(TestSuite, fixed_lag_smoother) {
+  const double lag = 3.0;
+  gtsam::noiseModel::Isotropic::shared_ptr odomNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.1);
+  gtsam::noiseModel::Isotropic::shared_ptr inlierNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  gtsam::noiseModel::Isotropic::shared_ptr outlierNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 50.0);
+
+  dcsam::DCFixedLagSmoother smoother(lag);
+  dcsam::DCSAM dcsam;
+  const size_t numSteps = 10;
+  for (size_t t = 0; t < numSteps; t++) {
+    gtsam::Symbol xt('x', t);
+    gtsam::DiscreteKey mt(gtsam::Symbol('m', t), 2);
+
+    dcsam::HybridFactorGraph hfg;
+    if (t == 0) {
+      hfg.push_nonlinear(gtsam::PriorFactor<double>(xt, 0.0, odomNoise));
+    } else {
+      hfg.push_nonlinear(gtsam::BetweenFactor<double>(
+          gtsam::Symbol('x', t - 1), xt, 1.0, odomNoise));
+    }
+    // The measurement at t = 5 is an outlier.
+    const double z = (t == 5) ? 20.0 : static_cast<double>(t);
+    std::vector<gtsam::PriorFactor<double>> components{
+        gtsam::PriorFactor<double>(xt, z, inlierNoise),
+        gtsam::PriorFactor<double>(xt, z, outlierNoise)};
+    hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+        gtsam::KeyVector{xt}, mt, components));
+    hfg.push_discrete(dcsam::DiscretePriorFactor(mt, {0.9, 0.1}));
+
+    gtsam::Values initialGuess;
+    initialGuess.insert(xt, static_cast<double>(t));
+    dcsam::DiscreteValues initialGuessDiscrete;
+    initialGuessDiscrete[mt.first] = 0;
+    dcsam::DCFixedLagSmoother::KeyTimestampMap timestamps;
+    timestamps[xt] = t;
+    timestamps[mt.first] = t;
+
+    smoother.update(hfg, initialGuess, initialGuessDiscrete, timestamps);
+    dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+  }
+
+  // Only the variables with timestamps in [t - lag, t] remain.
+  const size_t windowSize = 4;
+  dcsam::DCValues window = smoother.calculateEstimate();
+  EXPECT_EQ(smoother.timestamps().size(), 2 * windowSize);
+  EXPECT_EQ(window.continuous.size(), windowSize);
+  EXPECT_EQ(window.discrete.size(), windowSize);
+  EXPECT_FALSE(window.continuous.exists(gtsam::Symbol('x', 0)));
+  EXPECT_EQ(window.discrete.count(gtsam::Symbol('m', 0)), 0);
+
+  dcsam::DCValues full = dcsam.calculateEstimate();
+  for (const gtsam::Key k : window.continuous.keys()) {
+    EXPECT_NEAR(window.continuous.at<double>(k), full.continuous.at<double>(k),
+                1e-3);
+  }
+  for (const auto& kv : window.discrete) {
+    EXPECT_EQ(kv.second, full.discrete.at(kv.first));
+  }
+}
+
+/**
+ * Test that a discrete variable whose value is nearly certain is frozen and
+ * removed from the discrete problem, while its estimate is still reported and
+ * new DCFactors involving it can still be added.
+ */
+TEST(TestSuite, freeze_confident_discrete) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 5.0, noise)};
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(
+      x1, 0.0, gtsam::noiseModel::Isotropic::Sigma(1, 0.1)));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(d1, {0.5, 0.5}));
+  hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{x1}, d1, components));
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 0.0);
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+
+  dcsam::DCSAMParams params;
+  params.discreteFreezeThreshold = 0.99;
+  dcsam::DCSAM dcsam(params);
+  dcsam::DCSAMUpdateResult result =
+      dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.discreteVariablesFrozen, 1);
+  EXPECT_EQ(dcsam.getDiscreteFactorGraph().size(), 0);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 0);
+
+  // A new measurement of the frozen variable only affects the continuous
+  // problem.
+  dcsam::HybridFactorGraph next;
+  next.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{x1}, d1, components));
+  result = dcsam.update(next);
+  EXPECT_EQ(result.discreteVariablesFrozen, 0);
+  EXPECT_EQ(dcsam.getDiscreteFactorGraph().size(), 0);
+  EXPECT_EQ(dcsam.calculateEstimate().discrete.at(d1.first), 0);
+  EXPECT_NEAR(dcsam.calculateEstimate<double>(x1), 0.0, 1e-3);
+}
+
+/**
+ * Test fusing repeated unary evidence on a discrete variable. Static
+ * observations are folded into one UnaryEvidenceFactor, and unary DC
+ * observations are attached to it, so the fused solver keeps a single
+ * discrete factor while agreeing with a plain solver (which keeps every
+ * observation as its own factor) on the estimate and the hybrid error.
+ */
+TEST(TestSuite, fuse_unary_evidence) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey c1(gtsam::Symbol('c', 1), 3);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 1.0, noise),
+      gtsam::PriorFactor<double>(x1, 2.0, noise)};
+
+  dcsam::DCSAMParams params;
+  dcsam::DCSAM plain(params);
+  params.fuseUnaryEvidence = true;
+  dcsam::DCSAM fused(params);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(x1, 1.2, noise));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(c1, {0.3, 0.3, 0.4}));
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 1.2);
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[c1.first] = 0;
+  plain.update(hfg, initialGuess, initialGuessDiscrete);
+  fused.update(hfg, initialGuess, initialGuessDiscrete);
+
+  // Repeated semantic and DC observations of the same variable, mostly
+  // agreeing on class 1.
+  for (size_t i = 0; i < 10; i++) {
+    dcsam::HybridFactorGraph next;
+    if (i % 3 == 2) {
+      next.push_discrete(dcsam::DiscretePriorFactor(c1, {0.1, 0.2, 0.7}));
+    } else {
+      next.push_discrete(dcsam::DiscretePriorFactor(c1, {0.2, 0.6, 0.2}));
+    }
+    next.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+        gtsam::KeyVector{x1}, c1, components));
+    plain.update(next);
+    fused.update(next);
+
+    // All of the evidence is held in a single factor.
+    EXPECT_EQ(fused.getDiscreteFactorGraph().size(), 1);
+    EXPECT_EQ(plain.getDiscreteFactorGraph().size(), 2 * (i + 1) + 1);
+
+    const dcsam::DCValues plainEstimate = plain.calculateEstimate();
+    const dcsam::DCValues fusedEstimate = fused.calculateEstimate();
+    EXPECT_EQ(fusedEstimate.discrete.at(c1.first),
+              plainEstimate.discrete.at(c1.first));
+    EXPECT_NEAR(fusedEstimate.continuous.at<double>(x1),
+                plainEstimate.continuous.at<double>(x1), 1e-6);
+    EXPECT_NEAR(fused.hybridError(), plain.hybridError(), 1e-6);
+  }
+  EXPECT_EQ(fused.calculateDiscreteEstimate(c1.first), 1);
+}
+
+TEST(TestSuite, batched_error_evaluation) {
+  gtsam::Symbol x0('x', 0), l1('l', 1), l2('l', 2);
+  gtsam::DiscreteKey lc1(gtsam::Symbol('c', 1), 3);
+  gtsam::DiscreteKey lc2(gtsam::Symbol('c', 2), 3);
+  gtsam::Values values;
+  values.insert(x0, gtsam::Pose2(0.1, -0.2, 0.3));
+  values.insert(l1, gtsam::Point2(1.0, 1.0));
+  values.insert(l2, gtsam::Point2(2.0, -1.0));
+  auto noise = gtsam::noiseModel::Diagonal::Sigmas(gtsam::Vector2(0.1, 0.2));
+
+  using SBRFactor =
+      dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>;
+  SBRFactor sbr1(x0, l1, lc1, {0.2, 0.5, 0.3}, gtsam::Rot2::fromDegrees(40),
+                 1.5, noise);
+  SBRFactor sbr2(x0, l2, lc2, {0.6, 0.3, 0.1}, gtsam::Rot2::fromDegrees(-30),
+                 2.0, noise);
+  gtsam::DiscreteKeys dks({lc1, lc2});
+  dcsam::DCMaxMixtureFactor<SBRFactor> maxMixture({x0, l1, l2}, dks,
+                                                  {sbr1, sbr2}, {0.4, 0.6},
+                                                  false);
+  dcsam::DCEMFactor<SBRFactor> em({x0, l1, l2}, dks, {sbr1, sbr2},
+                                  {0.4, 0.6}, false);
+
+  auto priorNoise = gtsam::noiseModel::Isotropic::Sigma(2, 0.5);
+  std::vector<gtsam::PriorFactor<gtsam::Point2>> components{
+      gtsam::PriorFactor<gtsam::Point2>(l1, gtsam::Point2(0, 0), priorNoise),
+      gtsam::PriorFactor<gtsam::Point2>(l1, gtsam::Point2(1, 1), priorNoise),
+      gtsam::PriorFactor<gtsam::Point2>(l1, gtsam::Point2(2, 2), priorNoise)};
+  dcsam::DCMixtureFactor<gtsam::PriorFactor<gtsam::Point2>> mixture({l1}, lc1,
+                                                                    components);
+
+  // The batched errors must match a call to `error` for each assignment,
+  // with the other discrete variable held fixed.
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[lc2.first] = 2;
+  std::vector<const dcsam::DCFactor*> factors{&sbr1, &sbr2, &maxMixture, &em,
+                                              &mixture};
+  for (const dcsam::DCFactor* factor : factors) {
+    std::vector<double> errors(lc1.second);
+    factor->evalErrors(lc1, values, discreteVals, errors.data());
+    dcsam::DiscreteValues assignment = discreteVals;
+    for (size_t i = 0; i < lc1.second; i++) {
+      assignment[lc1.first] = i;
+      EXPECT_NEAR(errors[i], factor->error(values, assignment), 1e-9);
+    }
+  }
+}
+
+TEST(TestSuite, unary_product_factor) {
+  gtsam::DiscreteKey a(gtsam::Symbol('a', 1), 2);
+  gtsam::DiscreteKey b(gtsam::Symbol('b', 1), 3);
+  gtsam::DiscreteKey c(gtsam::Symbol('c', 1), 4);
+  gtsam::DiscreteKeys keys;
+  keys.push_back(a);
+  keys.push_back(b);
+  keys.push_back(c);
+  keys.push_back(b);
+  std::vector<std::vector<double>> probs{{0.3, 0.7},
+                                        {0.1, 0.5, 0.4},
+                                        {0.1, 0.2, 0.3, 0.4},
+                                        {0.6, 0.3, 0.1}};
+
+  // Build the same factor by multiplying the unary factors together.
+  gtsam::DecisionTreeFactor expected;
+  for (size_t i = 0; i < keys.size(); i++) {
+    expected = expected * gtsam::DecisionTreeFactor(keys[i], probs[i]);
+  }
+
+  gtsam::DecisionTreeFactor actual = dcsam::unaryProductFactor(keys, probs);
+  EXPECT_EQ(actual.keys().size(), 3);
+  dcsam::DiscreteValues values;
+  for (size_t i = 0; i < a.second; i++) {
+    for (size_t j = 0; j < b.second; j++) {
+      for (size_t k = 0; k < c.second; k++) {
+        values[a.first] = i;
+        values[b.first] = j;
+        values[c.first] = k;
+        EXPECT_NEAR(actual(values), expected(values), 1e-12);
+      }
+    }
+  }
+}
+
+TEST(TestSuite, dc_discrete_factor_table_cache) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 2.0, noise)};
+  auto dcfactor =
+      boost::make_shared<dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>>(
+          gtsam::KeyVector{x1}, d1, components);
+  dcsam::DCDiscreteFactor factor(dcfactor);
+
+  gtsam::Values values;
+  values.insert(x1, 0.5);
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[d1.first] = 0;
+  factor.updateContinuous(values);
+  factor.updateDiscrete(discreteVals);
+
+  gtsam::DecisionTreeFactor first = factor.toDecisionTreeFactor();
+  EXPECT_EQ(factor.cacheMisses(), 1);
+  EXPECT_EQ(factor.cacheHits(), 0);
+
+  // Nothing changed, so the cached table is reused.
+  factor.updateContinuous(values);
+  factor.updateDiscrete(discreteVals);
+  EXPECT_TRUE(factor.toDecisionTreeFactor().equals(first));
+  factor * gtsam::DecisionTreeFactor(d1, "1 1");
+  EXPECT_EQ(factor.cacheMisses(), 1);
+  EXPECT_EQ(factor.cacheHits(), 2);
+
+  // Moving the continuous value invalidates the cache.
+  values.update(x1, 1.5);
+  factor.updateContinuous(values);
+  gtsam::DecisionTreeFactor second = factor.toDecisionTreeFactor();
+  EXPECT_EQ(factor.cacheMisses(), 2);
+  EXPECT_FALSE(second.equals(first));
+  EXPECT_TRUE(second.equals(dcfactor->toDecisionTreeFactor(
+      factor.continuousState()->values(), discreteVals)));
+
+  // As does changing the discrete value.
+  discreteVals[d1.first] = 1;
+  factor.updateDiscrete(discreteVals);
+  factor.toDecisionTreeFactor();
+  EXPECT_EQ(factor.cacheMisses(), 3);
+  EXPECT_EQ(factor.cacheHits(), 2);
+}
+
+TEST(TestSuite, dense_discrete_factor) {
+  gtsam::DiscreteKey a(gtsam::Symbol('a', 1), 2);
+  gtsam::DiscreteKey b(gtsam::Symbol('b', 1), 3);
+  gtsam::DiscreteKey c(gtsam::Symbol('c', 1), 4);
+  gtsam::DecisionTreeFactor fab(a & b, "1 2 3 4 5 6");
+  gtsam::DecisionTreeFactor fcb(c & b,
+                                "0.1 0.2 0.3 0.4 0.5 0.6 0.7 0.8 0.9 1 2 3");
+
+  // Check that two factors agree on every assignment to a, b and c.
+  auto expectSameValues = [&](const gtsam::DiscreteFactor& actual,
+                              const gtsam::DiscreteFactor& expected) {
+    dcsam::DiscreteValues values;
+    for (size_t i = 0; i < a.second; i++) {
+      for (size_t j = 0; j < b.second; j++) {
+        for (size_t k = 0; k < c.second; k++) {
+          values[a.first] = i;
+          values[b.first] = j;
+          values[c.first] = k;
+          EXPECT_NEAR(actual(values), expected(values), 1e-12);
+        }
+      }
+    }
+  };
+
+  dcsam::DenseDiscreteFactor dab(fab), dcb(fcb);
+  EXPECT_EQ(dab.table().size(), 6);
+  expectSameValues(dab, fab);
+  expectSameValues(dab.toDecisionTreeFactor(), fab);
+
+  // Products and marginals must agree with those of the DecisionTreeFactors.
+  gtsam::DecisionTreeFactor expected = fab * fcb;
+  dcsam::DenseDiscreteFactor product = dab * dcb;
+  EXPECT_EQ(product.keys().size(), 3);
+  expectSameValues(product, expected);
+
+  gtsam::Ordering frontal;
+  frontal.push_back(b.first);
+  expectSameValues(product.max(b.first), *expected.max(frontal));
+  expectSameValues(product.sum(b.first), *expected.sum(frontal));
+  EXPECT_EQ(product.sum(b.first).keys().size(), 2);
+
+  // Maximizing out every key leaves a constant.
+  dcsam::DenseDiscreteFactor constant =
+      product.max(a.first).max(b.first).max(c.first);
+  EXPECT_TRUE(constant.keys().empty());
+  EXPECT_NEAR(constant(dcsam::DiscreteValues()), 18.0, 1e-12);
+
+  // Factors from dcsam convert directly.
+  dcsam::DiscretePriorFactor prior(a, {0.25, 0.75});
+  expectSameValues(dcsam::toDenseFactor(prior), prior);
+}
+
+/**
+ * Test log-domain (min-sum) discrete inference. Hundreds of weak priors on a
+ * variable multiply out to probabilities that underflow to zero, so only the
+ * sums of their errors still tell the values apart. We check the MAP of both a
+ * single variable (the unary fast path) and a pair of coupled variables (full
+ * elimination), and that error tables match the factors they come from.
+ */
+TEST(TestSuite, log_domain_discrete_isam) {
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), 2);
+  gtsam::DiscreteKey d3(gtsam::Symbol('d', 3), 2);
+
+  gtsam::DiscreteFactorGraph graph;
+  for (size_t i = 0; i < 400; i++) {
+    graph.push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+        d1, std::vector<double>{1e-3, 2e-3}));
+    graph.push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+        d3, std::vector<double>{1e-3, 2e-3}));
+  }
+  graph.push_back(boost::make_shared<gtsam::DecisionTreeFactor>(
+      d1 & d2, "0.9 0.1 0.1 0.9"));
+
+  dcsam::DiscreteISAM isam(dcsam::ThreadPool::shared_ptr(), true);
+  isam.update(graph);
+  EXPECT_EQ(isam.estimate().at(d1.first), 1);
+  EXPECT_EQ(isam.estimate().at(d2.first), 1);
+  EXPECT_EQ(isam.estimate().at(d3.first), 1);
+
+  // Error tables hold the negative log of each factor.
+  dcsam::DiscretePriorFactor prior(d1, {0.25, 0.75});
+  dcsam::DenseDiscreteFactor errors = dcsam::toDenseErrorFactor(prior);
+  EXPECT_NEAR(errors.table()[0], -log(0.25), 1e-12);
+  EXPECT_NEAR(errors.table()[1], -log(0.75), 1e-12);
+
+  // DCDiscreteFactors get theirs directly from DCFactor::error.
+  gtsam::Symbol x1('x', 1);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 40.0, noise)};
+  auto dcfactor =
+      boost::make_shared<dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>>(
+          gtsam::KeyVector{x1}, d1, components);
+  dcsam::DCDiscreteFactor factor(dcfactor);
+  gtsam::Values values;
+  values.insert(x1, 0.0);
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[d1.first] = 0;
+  factor.updateContinuous(values);
+  factor.updateDiscrete(discreteVals);
+  dcsam::DenseDiscreteFactor dcErrors = dcsam::toDenseErrorFactor(factor);
+  for (size_t i = 0; i < d1.second; i++) {
+    discreteVals[d1.first] = i;
+    EXPECT_NEAR(dcErrors.table()[i], dcfactor->error(values, discreteVals),
+                1e-9);
+  }
+  EXPECT_GT(dcErrors.table()[1], 700.0);
+}
+
+/**
+ * Test the in-place log-sum-exp normalization kernel behind expNormalize,
+ * including its handling of NaN and infinite log probabilities, which only the
+ * (allocating) expNormalize wrapper reports as errors.
+ */
+TEST(TestSuite, exp_normalize_in_place) {
+  // Very small log probabilities normalize without underflow, and NaNs are
+  // treated as impossible.
+  std::vector<double> values{-1000.0, -1000.0 + log(3.0), NAN};
+  double logTotal = dcsam::expNormalizeInPlace(values.data(), values.size());
+  EXPECT_NEAR(values[0], 0.25, 1e-12);
+  EXPECT_NEAR(values[1], 0.75, 1e-12);
+  EXPECT_EQ(values[2], 0.0);
+  EXPECT_NEAR(logTotal, -1000.0 + log(4.0), 1e-9);
+
+  // Infinite log probabilities share all of the probability.
+  const double inf = std::numeric_limits<double>::infinity();
+  values = {inf, 0.0, inf};
+  logTotal = dcsam::expNormalizeInPlace(values.data(), values.size());
+  EXPECT_EQ(values, std::vector<double>({0.5, 0.0, 0.5}));
+  EXPECT_EQ(logTotal, inf);
+
+  // If nothing is possible, the result is uniform.
+  values = {-inf, NAN};
+  logTotal = dcsam::expNormalizeInPlace(values.data(), values.size());
+  EXPECT_EQ(values, std::vector<double>({0.5, 0.5}));
+  EXPECT_EQ(logTotal, -inf);
+
+  // The wrapper agrees with the kernel, but throws on invalid input.
+  std::vector<double> probs = dcsam::expNormalize({0.0, log(3.0)});
+  EXPECT_NEAR(probs[0], 0.25, 1e-12);
+  EXPECT_NEAR(probs[1], 0.75, 1e-12);
+  EXPECT_THROW(dcsam::expNormalize({-inf, -inf}), std::logic_error);
+}
+
+/**
+ * Test that the log normalizing constants DCMixtureFactor computes once at
+ * construction (from a Cholesky log-determinant) match the closed form
+ * dim * log(2 pi) / 2 - log(det(information)) / 2 for each component.
+ */
+TEST(TestSuite, precomputed_log_normalizing_constants) {
+  gtsam::Symbol x0('x', 0), x1('x', 1);
+  gtsam::DiscreteKey dk(gtsam::Symbol('d', 0), 2);
+  gtsam::Matrix cov = gtsam::Matrix::Identity(3, 3) * 0.1;
+  cov(0, 1) = cov(1, 0) = 0.05;
+  gtsam::Pose2 measured(1.0, 0.5, 0.1);
+  std::vector<gtsam::BetweenFactor<gtsam::Pose2>> components{
+      gtsam::BetweenFactor<gtsam::Pose2>(
+          x0, x1, measured, gtsam::noiseModel::Gaussian::Covariance(cov)),
+      gtsam::BetweenFactor<gtsam::Pose2>(
+          x0, x1, measured,
+          gtsam::noiseModel::Gaussian::Covariance(4.0 * cov))};
+  dcsam::DCMixtureFactor<gtsam::BetweenFactor<gtsam::Pose2>> mixture(
+      gtsam::KeyVector{x0, x1}, dk, components);
+
+  gtsam::Values values;
+  values.insert(x0, gtsam::Pose2());
+  values.insert(x1, gtsam::Pose2(1.1, 0.4, 0.0));
+  dcsam::DiscreteValues discreteVals;
+  for (size_t i = 0; i < components.size(); i++) {
+    discreteVals[dk.first] = i;
+    const gtsam::Matrix info =
+        boost::dynamic_pointer_cast<gtsam::noiseModel::Gaussian>(
+            components[i].noiseModel())
+            ->information();
+    const double expected = components[i].error(values) +
+                            3.0 * log(2.0 * M_PI) / 2.0 -
+                            log(info.determinant()) / 2.0;
+    EXPECT_NEAR(mixture.error(values, discreteVals), expected, 1e-9);
+  }
+
+  // The batched errors use the same constants.
+  std::vector<double> errors(dk.second);
+  mixture.evalErrors(dk, values, discreteVals, errors.data());
+  for (size_t i = 0; i < components.size(); i++) {
+    discreteVals[dk.first] = i;
+    EXPECT_NEAR(errors[i], mixture.error(values, discreteVals), 1e-9);
+  }
+}
+
+/**
+ * Test that DCMaxMixtureFactor memoizes its active component: evaluating the
+ * error, linearization and association keys at the same state only
+ * evaluates the components once, while changing the continuous values, the
+ * discrete values or the weights selects the component afresh.
+ */
+TEST(TestSuite, max_mixture_active_index_cache) {
+  gtsam::Symbol x0('x', 0), l1('l', 1), l2('l', 2);
+  gtsam::DiscreteKey c1(gtsam::Symbol('c', 1), 2);
+  gtsam::DiscreteKey c2(gtsam::Symbol('c', 2), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr br_noise =
+      gtsam::noiseModel::Isotropic::Sigma(2, 0.1);
+
+  // A measurement of a landmark 1m ahead, which is either l1 or l2.
+  using SBRFactor =
+      dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>;
+  SBRFactor sbr1(x0, l1, c1, {0.9, 0.1}, gtsam::Rot2(), 1.0, br_noise);
+  SBRFactor sbr2(x0, l2, c2, {0.9, 0.1}, gtsam::Rot2(), 1.0, br_noise);
+  dcsam::DCMaxMixtureFactor<SBRFactor> dcmmf({x0, l1, l2}, c1 & c2,
+                                             {sbr1, sbr2}, {0.5, 0.5}, false);
+
+  gtsam::Values values;
+  values.insert(x0, gtsam::Pose2());
+  values.insert(l1, gtsam::Point2(1.0, 0.0));
+  values.insert(l2, gtsam::Point2(0.0, 3.0));
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[c1.first] = 0;
+  discreteVals[c2.first] = 0;
+
+  EXPECT_EQ(dcmmf.getActiveFactorIdx(values, discreteVals), 0);
+  dcmmf.error(values, discreteVals);
+  dcmmf.linearize(values, discreteVals);
+  EXPECT_EQ(dcmmf.getAssociationKeys(values, discreteVals).back(), l1);
+  EXPECT_EQ(dcmmf.cacheMisses(), 1);
+  EXPECT_EQ(dcmmf.cacheHits(), 3);
+
+  // The memoized error is the active component's.
+  EXPECT_NEAR(dcmmf.error(values, discreteVals),
+              sbr1.error(values, discreteVals) +
+                  sbr1.logNormalizingConstant(values) - log(0.5),
+              1e-9);
+
+  // Moving the landmarks changes the association.
+  values.update(l1, gtsam::Point2(0.0, 3.0));
+  values.update(l2, gtsam::Point2(1.0, 0.0));
+  EXPECT_EQ(dcmmf.getActiveFactorIdx(values, discreteVals), 1);
+  EXPECT_EQ(dcmmf.cacheMisses(), 2);
+
+  // As can the class of either landmark.
+  discreteVals[c2.first] = 1;
+  values.update(l1, gtsam::Point2(1.0, 0.0));
+  values.update(l2, gtsam::Point2(1.0, 0.0));
+  EXPECT_EQ(dcmmf.getActiveFactorIdx(values, discreteVals), 0);
+  EXPECT_EQ(dcmmf.cacheMisses(), 3);
+
+  // And the weights.
+  dcmmf.updateWeights({0.001, 0.999});
+  EXPECT_EQ(dcmmf.getActiveFactorIdx(values, discreteVals), 1);
+  EXPECT_EQ(dcmmf.cacheMisses(), 4);
+}
+
+/**
+ * Test that DCEMFactor::linearize, which writes the weighted component
+ * Jacobians straight into one stacked system, agrees with combining the
+ * weighted components through a GaussianFactorGraph, including the zero
+ * blocks for the landmarks each component does not involve.
+ */
+TEST(TestSuite, em_factor_stacked_linearization) {
+  gtsam::Symbol x0('x', 0), l1('l', 1), l2('l', 2);
+  gtsam::DiscreteKey c1(gtsam::Symbol('c', 1), 2);
+  gtsam::DiscreteKey c2(gtsam::Symbol('c', 2), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr br_noise =
+      gtsam::noiseModel::Isotropic::Sigma(2, 0.1);
+
+  using SBRFactor =
+      dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>;
+  std::vector<SBRFactor> components{
+      SBRFactor(x0, l1, c1, {0.7, 0.3}, gtsam::Rot2(), 1.0, br_noise),
+      SBRFactor(x0, l2, c2, {0.6, 0.4}, gtsam::Rot2(), 1.0, br_noise)};
+  dcsam::DCEMFactor<SBRFactor> dcemf({x0, l1, l2}, c1 & c2, components,
+                                     {0.3, 0.7}, false);
+
+  gtsam::Values values;
+  values.insert(x0, gtsam::Pose2(0.1, -0.1, 0.05));
+  values.insert(l1, gtsam::Point2(1.0, 0.1));
+  values.insert(l2, gtsam::Point2(1.1, -0.2));
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[c1.first] = 0;
+  discreteVals[c2.first] = 1;
+
+  std::vector<double> weights = dcsam::expNormalize(
+      dcemf.computeComponentLogProbs(values, discreteVals));
+  gtsam::GaussianFactorGraph gfg;
+  for (size_t i = 0; i < components.size(); i++) {
+    gtsam::JacobianFactor jf(*components[i].linearize(values, discreteVals));
+    gtsam::VerticalBlockMatrix Ab = jf.matrixObject();
+    for (size_t k = 0; k < Ab.nBlocks(); k++) Ab(k) *= sqrt(weights[i]);
+    gfg.add(gtsam::JacobianFactor(jf.keys(), Ab));
+  }
+  gtsam::JacobianFactor expected(gfg);
+
+  boost::shared_ptr<gtsam::GaussianFactor> actual =
+      dcemf.linearize(values, discreteVals);
+  EXPECT_EQ(actual->keys(), expected.keys());
+  EXPECT_TRUE(actual->equals(expected, 1e-9));
+}
+
+/**
+ * Test that DCEMFactor evaluates its components once per state: the error,
+ * linearization, discrete conversion and active component at the same state
+ * share one evaluation, which agrees with evaluating them from scratch, and
+ * any change to the state or the weights starts a new one.
+ */
+TEST(TestSuite, em_factor_evaluation_cache) {
+  gtsam::Symbol x0('x', 0), l1('l', 1), l2('l', 2);
+  gtsam::DiscreteKey c1(gtsam::Symbol('c', 1), 2);
+  gtsam::DiscreteKey c2(gtsam::Symbol('c', 2), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr br_noise =
+      gtsam::noiseModel::Isotropic::Sigma(2, 0.1);
+
+  using SBRFactor =
+      dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>;
+  std::vector<SBRFactor> components{
+      SBRFactor(x0, l1, c1, {0.7, 0.3}, gtsam::Rot2(), 1.0, br_noise),
+      SBRFactor(x0, l2, c2, {0.6, 0.4}, gtsam::Rot2(), 1.0, br_noise)};
+  auto makeFactor = [&]() {
+    return dcsam::DCEMFactor<SBRFactor>({x0, l1, l2}, c1 & c2, components,
+                                        {0.3, 0.7}, false);
+  };
+  dcsam::DCEMFactor<SBRFactor> dcemf = makeFactor();
+
+  gtsam::Values values;
+  values.insert(x0, gtsam::Pose2());
+  values.insert(l1, gtsam::Point2(1.0, 0.05));
+  values.insert(l2, gtsam::Point2(1.05, -0.1));
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[c1.first] = 0;
+  discreteVals[c2.first] = 1;
+
+  const double error = dcemf.error(values, discreteVals);
+  boost::shared_ptr<gtsam::GaussianFactor> linear =
+      dcemf.linearize(values, discreteVals);
+  gtsam::DecisionTreeFactor table =
+      dcemf.toDecisionTreeFactor(values, discreteVals);
+  const size_t active = dcemf.getActiveFactorIdx(values, discreteVals);
+  EXPECT_EQ(dcemf.cacheMisses(), 1);
+  EXPECT_EQ(dcemf.cacheHits(), 3);
+
+  // Asking again (in another order) gives the same answers from the memo.
+  EXPECT_TRUE(table.equals(dcemf.toDecisionTreeFactor(values, discreteVals)));
+  EXPECT_TRUE(linear->equals(*dcemf.linearize(values, discreteVals)));
+  EXPECT_EQ(dcemf.cacheMisses(), 1);
+
+  // The memoized results match those of new factors evaluating each one
+  // separately.
+  std::vector<double> logprobs =
+      dcemf.computeComponentLogProbs(values, discreteVals);
+  std::vector<double> weights = dcsam::expNormalize(logprobs);
+  EXPECT_NEAR(error, -weights[0] * logprobs[0] - weights[1] * logprobs[1],
+              1e-9);
+  EXPECT_EQ(active, logprobs[0] > logprobs[1] ? 0 : 1);
+  EXPECT_TRUE(makeFactor().linearize(values, discreteVals)->equals(*linear));
+  EXPECT_TRUE(
+      makeFactor().toDecisionTreeFactor(values, discreteVals).equals(table));
+
+  // Changing the continuous values, the discrete values or the weights
+  // invalidates the memo.
+  values.update(l1, gtsam::Point2(1.0, 0.0));
+  dcemf.error(values, discreteVals);
+  EXPECT_EQ(dcemf.cacheMisses(), 2);
+  discreteVals[c1.first] = 1;
+  dcemf.error(values, discreteVals);
+  EXPECT_EQ(dcemf.cacheMisses(), 3);
+  dcemf.updateWeights({0.5, 0.5});
+  dcemf.error(values, discreteVals);
+  EXPECT_EQ(dcemf.cacheMisses(), 4);
+  EXPECT_EQ(dcemf.cacheHits(), 5);
+}
+
+/**
+ * Test that the DCContinuousFactor and DCDiscreteFactor wrapping the same
+ * DCFactor (and reading the same ContinuousStateStore) share its evaluations:
+ * once the discrete side has evaluated every assignment, the continuous side's
+ * error is free, and both see a fresh evaluation after the stored values
+ * change. Evaluations elsewhere bypass the memo without disturbing it.
+ */
+TEST(TestSuite, shared_evaluation_cache) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 2.0, noise)};
+  auto dcfactor =
+      boost::make_shared<dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>>(
+          gtsam::KeyVector{x1}, d1, components);
+  auto state = boost::make_shared<dcsam::ContinuousStateStore>();
+  dcsam::DCDiscreteFactor discrete(dcfactor, state);
+  dcsam::DCContinuousFactor continuous(dcfactor, state);
+
+  gtsam::Values values;
+  values.insert(x1, 0.5);
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[d1.first] = 1;
+  discrete.updateContinuous(values);
+  discrete.updateDiscrete(discreteVals);
+  continuous.updateDiscrete(discreteVals);
+
+  // The discrete side evaluates both assignments at once...
+  dcsam::DenseDiscreteFactor errors = discrete.toDenseErrorFactor();
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 1);
+
+  // ...so neither side needs to evaluate the factor again.
+  EXPECT_NEAR(continuous.error(values), errors.table()[1], 1e-12);
+  EXPECT_NEAR(continuous.error(values), dcfactor->error(values, discreteVals),
+              1e-12);
+  discreteVals[d1.first] = 0;
+  EXPECT_NEAR(discrete.error(discreteVals), errors.table()[0], 1e-12);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 1);
+  EXPECT_EQ(dcfactor->evaluationCacheHits(), 3);
+
+  // Linearizations are memoized too, and shared between callers.
+  boost::shared_ptr<gtsam::GaussianFactor> first = continuous.linearize(values);
+  boost::shared_ptr<gtsam::GaussianFactor> second =
+      continuous.linearize(values);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 2);
+
+  // Values other than the stored ones are evaluated directly.
+  gtsam::Values other;
+  other.insert(x1, 3.0);
+  dcsam::DiscreteValues continuousAssignment;
+  continuousAssignment[d1.first] = 1;
+  EXPECT_NEAR(continuous.error(other),
+              dcfactor->error(other, continuousAssignment), 1e-12);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 3);
+  EXPECT_NEAR(continuous.error(values), errors.table()[1], 1e-12);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 3);
+
+  // New continuous values need a new evaluation.
+  values.update(x1, 1.5);
+  discrete.updateContinuous(values);
+  EXPECT_NEAR(continuous.error(values),
+              components[1].error(values) +
+                  dcfactor->error(values, discreteVals) -
+                  components[0].error(values),
+              1e-9);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 4);
+  discreteVals[d1.first] = 1;
+  EXPECT_NEAR(discrete.error(discreteVals), continuous.error(values), 1e-12);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses(), 4);
+}
+
+/**
+ * Test that in-place changes to a discrete factor held by DCSAM are picked up
+ * once its key is marked as changed. A SmartDiscretePriorFactor favoring
+ * d1 = 1 is flipped with `updateProbs` to favor d1 = 0, and after
+ * `markDiscreteFactorsChanged` the next update re-solves d1.
+ */
+TEST(TestSuite, mark_discrete_factors_changed) {
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  auto prior = boost::make_shared<dcsam::SmartDiscretePriorFactor>(
+      d1, std::vector<double>{0.1, 0.9});
+
+  gtsam::DiscreteFactorGraph dfg;
+  dfg.push_back(prior);
+
+  dcsam::DCSAM dcsam;
+  dcsam.update(gtsam::NonlinearFactorGraph(), dfg, dcsam::DCFactorGraph());
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 1);
+
+  prior->updateProbs({0.9, 0.1});
+  gtsam::KeySet changed;
+  changed.insert(d1.first);
+  dcsam.markDiscreteFactorsChanged(changed);
+  dcsam::DCSAMUpdateResult result = dcsam.update();
+  EXPECT_EQ(result.discreteVariablesChanged, 1);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 0);
+  EXPECT_EQ(dcsam.calculateEstimate().discrete.at(d1.first), 0);
+}
+
+/**
+ * Test the work counters reported by DCSAM::update over a scripted sequence
+ * of updates, each of which touches a known part of the problem: a first
+ * update with two independent discrete variables, an update with nothing to
+ * do, a prior that flips the class of a landmark (so its DC continuous factor
+ * is relinearized), and a pairwise factor joining the two variables.
+ */
+TEST(TestSuite, update_work_counters) {
+  gtsam::Symbol x0('x', 0), l1('l', 1);
+  gtsam::DiscreteKey c1(gtsam::Symbol('c', 1), 2);
+  gtsam::DiscreteKey c2(gtsam::Symbol('c', 2), 2);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<gtsam::Pose2>(
+      x0, gtsam::Pose2(0, 0, 0), gtsam::noiseModel::Isotropic::Sigma(3, 0.1)));
+  hfg.push_nonlinear(gtsam::PriorFactor<gtsam::Point2>(
+      l1, gtsam::Point2(1, 1), gtsam::noiseModel::Isotropic::Sigma(2, 0.1)));
+  hfg.push_dc(dcsam::SemanticBearingRangeFactor<gtsam::Pose2, gtsam::Point2>(
+      x0, l1, c1, std::vector<double>{0.9, 0.1},
+      gtsam::Rot2::fromDegrees(45), std::sqrt(2.0),
+      gtsam::noiseModel::Isotropic::Sigma(2, 0.1)));
+  hfg.push_discrete(
+      dcsam::DiscretePriorFactor(c2, std::vector<double>{0.8, 0.2}));
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x0, gtsam::Pose2(0, 0, 0));
+  initialGuess.insert(l1, gtsam::Point2(1.1, 1.1));
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[c1.first] = 0;
+  initialGuessDiscrete[c2.first] = 0;
+
+  // Keep the DC discrete factor from being refreshed by small continuous
+  // updates, so that it is only refreshed when its class changes.
+  dcsam::DCSAMParams params;
+  params.discreteRefreshThreshold = 10.0;
+  dcsam::DCSAM dcsam(params);
+
+  // Two new single-variable components, neither of which changes from the
+  // initial guess.
+  dcsam::DCSAMUpdateResult result =
+      dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.iterations, 1);
+  EXPECT_EQ(result.discreteComponentsSolved, 2);
+  EXPECT_EQ(result.discreteVariablesReeliminated, 2);
+  EXPECT_EQ(result.discreteVariablesChanged, 0);
+  EXPECT_EQ(result.isamResult.newFactorsIndices.size(), 3);
+  EXPECT_EQ(result.dcFactorsRelinearized, 0);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 0);
+  EXPECT_EQ(result.dcDiscreteFactorsSkipped, 1);
+
+  // Nothing has changed, so there is no discrete work to do.
+  result = dcsam.update();
+  EXPECT_EQ(result.discreteComponentsSolved, 0);
+  EXPECT_EQ(result.discreteVariablesReeliminated, 0);
+  EXPECT_EQ(result.discreteVariablesChanged, 0);
+  EXPECT_EQ(result.dcFactorsRelinearized, 0);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 0);
+
+  // A strong prior flips c1, which only touches its own component. The DC
+  // factor on c1 is relinearized in iSAM2, and its discrete half refreshed.
+  dcsam::HybridFactorGraph flip;
+  flip.push_discrete(
+      dcsam::DiscretePriorFactor(c1, std::vector<double>{0.01, 0.99}));
+  result = dcsam.update(flip);
+  EXPECT_EQ(result.discreteComponentsSolved, 1);
+  EXPECT_EQ(result.discreteVariablesReeliminated, 1);
+  EXPECT_EQ(result.discreteVariablesChanged, 1);
+  EXPECT_EQ(result.dcFactorsRelinearized, 1);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 1);
+  EXPECT_EQ(result.dcDiscreteFactorsSkipped, 0);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(c1.first), 1);
+
+  // Joining c1 and c2 re-eliminates both, as one component. c2 follows c1,
+  // but no DC factor depends on it.
+  dcsam::HybridFactorGraph join;
+  join.push_discrete(gtsam::DecisionTreeFactor(
+      c1 & c2, std::vector<double>{0.9, 0.1, 0.1, 0.9}));
+  result = dcsam.update(join);
+  EXPECT_EQ(result.discreteComponentsSolved, 1);
+  EXPECT_EQ(result.discreteVariablesReeliminated, 2);
+  EXPECT_EQ(result.discreteVariablesChanged, 1);
+  EXPECT_EQ(result.dcFactorsRelinearized, 0);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 0);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(c2.first), 1);
+}
+
+/**
+ * Test the convergence check on the hybrid error. The change in error over an
+ * alternation is computed only from the factors whose variables changed, so
+ * check it against the difference in the full hybrid error between solvers
+ * that ran one and two alternations, and that a loose tolerance stops
+ * alternating as soon as the error is first compared.
+ */
+TEST(TestSuite, hybrid_error_change) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+
+  // Same bimodal problem as in `multi_iteration_alternation`.
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 4.0, noise)};
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(
+      x1, 3.5, gtsam::noiseModel::Isotropic::Sigma(1, 0.2)));
+  hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{x1}, d1, components));
+  hfg.push_discrete(
+      dcsam::DiscretePriorFactor(d1, std::vector<double>{0.6, 0.4}));
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 0.0);
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+
+  dcsam::DCSAMParams params;
+  params.isamParams.setOptimizationParams(gtsam::ISAM2GaussNewtonParams());
+  params.stopOnNoDiscreteChange = false;
+  params.hybridErrorTol = 1e-12;
+  params.maxIterations = 1;
+  dcsam::DCSAM once(params);
+  once.update(hfg, initialGuess, initialGuessDiscrete);
+
+  params.maxIterations = 2;
+  dcsam::DCSAM twice(params);
+  dcsam::DCSAMUpdateResult result =
+      twice.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.iterations, 2);
+  EXPECT_NE(result.hybridErrorChange, 0.0);
+  EXPECT_NEAR(result.hybridErrorChange,
+              twice.hybridError() - once.hybridError(), 1e-9);
+
+  params.maxIterations = 5;
+  params.hybridErrorTol = 1e9;
+  dcsam::DCSAM loose(params);
+  result = loose.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.iterations, 2);
+}
+
+/**
+ * Test removing factors from DiscreteISAM by index. After each removal the
+ * estimate should agree with a batch solve of the remaining factors, and a
+ * variable left without any factors should be dropped from the problem.
+ */
+TEST(TestSuite, discrete_isam_remove_factors) {
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), 2);
+  gtsam::DiscreteKey d3(gtsam::Symbol('d', 3), 2);
+  const std::vector<double> pairwise{0.9, 0.1, 0.1, 0.9};
+
+  gtsam::DiscreteFactorGraph factors;
+  factors.push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+      d1, std::vector<double>{0.6, 0.4}));
+  factors.push_back(
+      boost::make_shared<gtsam::DecisionTreeFactor>(d1 & d2, pairwise));
+  factors.push_back(
+      boost::make_shared<gtsam::DecisionTreeFactor>(d2 & d3, pairwise));
+  factors.push_back(boost::make_shared<dcsam::DiscretePriorFactor>(
+      d3, std::vector<double>{0.05, 0.95}));
+
+  dcsam::DiscreteISAM isam;
+  dcsam::DiscreteISAMResult result = isam.update(factors);
+  EXPECT_EQ(result.newFactorsIndices.size(), 4);
+  EXPECT_EQ(isam.estimate().at(d1.first), 1);
+  EXPECT_EQ(isam.factorsInvolving(d2.first).size(), 2);
+
+  // Without the strong prior on d3, the prior on d1 wins.
+  result = isam.update(gtsam::DiscreteFactorGraph(), gtsam::KeySet(),
+                       gtsam::FactorIndices{3});
+  gtsam::DiscreteFactorGraph batch;
+  for (size_t i = 0; i < 3; i++) batch.push_back(factors[i]);
+  dcsam::DiscreteValues expected = batch.optimize();
+  for (const auto& kv : expected) {
+    EXPECT_EQ(isam.estimate().at(kv.first), kv.second);
+  }
+  EXPECT_EQ(isam.estimate().at(d1.first), 0);
+  EXPECT_TRUE(result.removedKeys.empty());
+
+  // Removing the last factor on d3 drops it from the problem.
+  result = isam.update(gtsam::DiscreteFactorGraph(), gtsam::KeySet(),
+                       gtsam::FactorIndices{2});
+  EXPECT_TRUE(result.removedKeys.exists(d3.first));
+  EXPECT_EQ(isam.size(), 2);
+  EXPECT_EQ(isam.estimate().count(d3.first), 0);
+  EXPECT_TRUE(isam.factorsInvolving(d3.first).empty());
+  EXPECT_FALSE(isam.getFactorsUnsafe()[2]);
+  EXPECT_EQ(isam.estimate().at(d1.first), 0);
+  EXPECT_EQ(isam.estimate().at(d2.first), 0);
+}
+
+/**
+ * Test that marginalizing variables out of DCSAM only touches the factors
+ * involving them. The discrete half of a DCFactor on a marginalized continuous
+ * variable is re-anchored as a table at the current estimate (or, for fused
+ * evidence, kept in its UnaryEvidenceFactor), so later updates re-solve only
+ * its discrete variable, and marginalizing that variable re-solves nothing.
+ */
+TEST(TestSuite, incremental_marginalize) {
+  gtsam::noiseModel::Isotropic::shared_ptr odomNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.1);
+  gtsam::noiseModel::Isotropic::shared_ptr inlierNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  gtsam::noiseModel::Isotropic::shared_ptr outlierNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 50.0);
+  gtsam::Symbol x0('x', 0);
+  gtsam::DiscreteKey m0(gtsam::Symbol('m', 0), 2);
+
+  dcsam::DCSAMParams params;
+  params.discreteRefreshThreshold = 10.0;
+  dcsam::DCSAM dcsam(params);
+  params.fuseUnaryEvidence = true;
+  dcsam::DCSAM fused(params);
+  const size_t numSteps = 3;
+  for (size_t t = 0; t < numSteps; t++) {
+    gtsam::Symbol xt('x', t);
+    gtsam::DiscreteKey mt(gtsam::Symbol('m', t), 2);
+    dcsam::HybridFactorGraph hfg;
+    if (t == 0) {
+      hfg.push_nonlinear(gtsam::PriorFactor<double>(xt, 0.0, odomNoise));
+    } else {
+      hfg.push_nonlinear(gtsam::BetweenFactor<double>(
+          gtsam::Symbol('x', t - 1), xt, 1.0, odomNoise));
+    }
+    std::vector<gtsam::PriorFactor<double>> components{
+        gtsam::PriorFactor<double>(xt, static_cast<double>(t), inlierNoise),
+        gtsam::PriorFactor<double>(xt, static_cast<double>(t), outlierNoise)};
+    hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+        gtsam::KeyVector{xt}, mt, components));
+    hfg.push_discrete(dcsam::DiscretePriorFactor(mt, {0.7, 0.3}));
+
+    gtsam::Values initialGuess;
+    initialGuess.insert(xt, static_cast<double>(t));
+    dcsam::DiscreteValues initialGuessDiscrete;
+    initialGuessDiscrete[mt.first] = 0;
+    dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+    fused.update(hfg, initialGuess, initialGuessDiscrete);
+  }
+  const size_t estimate = dcsam.calculateDiscreteEstimate(m0.first);
+  dcsam::UnaryEvidenceFactor::shared_ptr evidence;
+  for (const auto& factor : fused.getDiscreteFactorGraph()) {
+    auto fusedFactor =
+        boost::dynamic_pointer_cast<dcsam::UnaryEvidenceFactor>(factor);
+    if (fusedFactor && fusedFactor->discreteKey().first == m0.first)
+      evidence = fusedFactor;
+  }
+  EXPECT_TRUE(evidence);
+  const gtsam::DecisionTreeFactor evidenceBefore =
+      evidence->toDecisionTreeFactor();
+  gtsam::KeySet continuousKeys, discreteKeys;
+  continuousKeys.insert(x0);
+  discreteKeys.insert(m0.first);
+
+  auto numDCDiscrete = [](const gtsam::DiscreteFactorGraph& dfg) {
+    size_t count = 0;
+    for (const auto& factor : dfg) {
+      if (boost::dynamic_pointer_cast<dcsam::DCDiscreteFactor>(factor))
+        count++;
+    }
+    return count;
+  };
+  EXPECT_EQ(numDCDiscrete(dcsam.getDiscreteFactorGraph()), numSteps);
+
+  // The DCDiscreteFactor on x0 is replaced by its table (which takes its
+  // slot).
+  dcsam.marginalize(continuousKeys);
+  const gtsam::DiscreteFactorGraph dfg = dcsam.getDiscreteFactorGraph();
+  EXPECT_EQ(numDCDiscrete(dfg), numSteps - 1);
+  boost::shared_ptr<gtsam::DecisionTreeFactor> table;
+  for (const auto& factor : dfg) {
+    auto tableFactor =
+        boost::dynamic_pointer_cast<gtsam::DecisionTreeFactor>(factor);
+    if (tableFactor) table = tableFactor;
+  }
+  EXPECT_TRUE(table);
+  EXPECT_EQ(table->keys(), gtsam::KeyVector{m0.first});
+
+  dcsam::DCSAMUpdateResult result = dcsam.update();
+  EXPECT_EQ(result.discreteComponentsSolved, 1);
+  EXPECT_EQ(result.discreteVariablesReeliminated, 1);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(m0.first), estimate);
+
+  // Fused evidence on m0 keeps the contribution of the DCDiscreteFactor.
+  fused.marginalize(continuousKeys);
+  EXPECT_TRUE(evidence->toDecisionTreeFactor().equals(evidenceBefore, 1e-9));
+  EXPECT_FALSE(evidence->dynamicFactors().front());
+  fused.update();
+  EXPECT_EQ(fused.calculateDiscreteEstimate(m0.first), estimate);
+
+  // m0 is summed out entirely, leaving nothing to re-solve.
+  dcsam.marginalize(discreteKeys);
+  result = dcsam.update();
+  EXPECT_EQ(result.discreteComponentsSolved, 0);
+  EXPECT_EQ(dcsam.calculateEstimate().discrete.count(m0.first), 0);
+}
+
+/**
+ * Test freezing one of the discrete variables of a DCFactor with two. The
+ * discrete half of the DCFactor is replaced by one conditioned on the frozen
+ * value, whose table is the restriction of the original table to that value,
+ * and a new DCFactor on both variables is likewise conditioned rather than
+ * dropped.
+ */
+TEST(TestSuite, freeze_partially_frozen_dcfactor) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  using Mixture = dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>;
+  std::vector<Mixture> mixtures{
+      Mixture(gtsam::KeyVector{x1}, d1,
+              {gtsam::PriorFactor<double>(x1, 0.0, noise),
+               gtsam::PriorFactor<double>(x1, 5.0, noise)}),
+      Mixture(gtsam::KeyVector{x1}, d2,
+              {gtsam::PriorFactor<double>(x1, 0.0, noise),
+               gtsam::PriorFactor<double>(x1, 0.5, noise)})};
+  dcsam::DCMaxMixtureFactor<Mixture> both(gtsam::KeyVector{x1}, d1 & d2,
+                                          mixtures, true);
+
+  // d1 is all but certain, while d2 is ambiguous.
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(
+      x1, 0.0, gtsam::noiseModel::Isotropic::Sigma(1, 0.1)));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(d1, {0.999, 0.001}));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(d2, {0.5, 0.5}));
+  hfg.push_dc(both);
+
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 0.0);
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+  initialGuessDiscrete[d2.first] = 0;
+
+  dcsam::DCSAMParams params;
+  params.discreteFreezeThreshold = 0.99;
+  dcsam::DCSAM dcsam(params);
+  dcsam::DCSAMUpdateResult result =
+      dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+  EXPECT_EQ(result.discreteVariablesFrozen, 1);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 0);
+
+  auto conditionedFactors = [&dcsam]() {
+    std::vector<boost::shared_ptr<dcsam::DCDiscreteFactor>> factors;
+    for (const auto& factor : dcsam.getDiscreteFactorGraph()) {
+      auto dcDiscreteFactor =
+          boost::dynamic_pointer_cast<dcsam::DCDiscreteFactor>(factor);
+      if (dcDiscreteFactor) factors.push_back(dcDiscreteFactor);
+    }
+    return factors;
+  };
+  std::vector<boost::shared_ptr<dcsam::DCDiscreteFactor>> factors =
+      conditionedFactors();
+  EXPECT_EQ(factors.size(), 1);
+  EXPECT_EQ(factors[0]->keys(), gtsam::KeyVector{d2.first});
+  EXPECT_EQ(factors[0]->fixedValues().at(d1.first), 0);
+
+  // The conditioned table matches the full table with d1 = 0.
+  dcsam::DCDiscreteFactor full(factors[0]->dcfactor(),
+                               factors[0]->continuousState());
+  dcsam::DiscreteValues assignment;
+  assignment[d1.first] = 0;
+  assignment[d2.first] = dcsam.calculateDiscreteEstimate(d2.first);
+  full.updateDiscrete(assignment);
+  const gtsam::DecisionTreeFactor conditionedTable =
+      factors[0]->toDecisionTreeFactor();
+  const gtsam::DecisionTreeFactor fullTable = full.toDecisionTreeFactor();
+  for (size_t v = 0; v < d2.second; v++) {
+    assignment[d2.first] = v;
+    EXPECT_NEAR(conditionedTable(assignment), fullTable(assignment), tol);
+  }
+
+  // A new DCFactor on both variables keeps its (conditioned) discrete half.
+  dcsam::HybridFactorGraph next;
+  next.push_dc(both);
+  result = dcsam.update(next);
+  EXPECT_EQ(result.discreteVariablesFrozen, 0);
+  factors = conditionedFactors();
+  EXPECT_EQ(factors.size(), 2);
+  for (const auto& factor : factors) {
+    EXPECT_EQ(factor->keys(), gtsam::KeyVector{d2.first});
+  }
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 0);
+}
+
+/**
+ * Test that the evidence of a fused DCDiscreteFactor counts from the very
+ * first update, even without an initial guess for its discrete variable.
+ */
+TEST(TestSuite, fuse_unary_evidence_without_discrete_guess) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey c1(gtsam::Symbol('c', 1), 3);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 1.0, noise),
+      gtsam::PriorFactor<double>(x1, 2.0, noise)};
+
+  dcsam::DCSAMParams params;
+  params.fuseUnaryEvidence = true;
+  dcsam::DCSAM dcsam(params);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(
+      x1, 2.0, gtsam::noiseModel::Isotropic::Sigma(1, 0.1)));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(c1, {0.4, 0.3, 0.3}));
+  hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+      gtsam::KeyVector{x1}, c1, components));
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 2.0);
+  dcsam.update(hfg, initialGuess);
+
+  const gtsam::DiscreteFactorGraph dfg = dcsam.getDiscreteFactorGraph();
+  EXPECT_EQ(dfg.size(), 1);
+  auto evidence =
+      boost::dynamic_pointer_cast<dcsam::UnaryEvidenceFactor>(dfg.front());
+  EXPECT_TRUE(evidence);
+  Eigen::Index best = 0;
+  evidence->logLikelihood().maxCoeff(&best);
+  EXPECT_EQ(best, 2);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(c1.first), 2);
+}
+
+/**
+ * Test that a DCDiscreteFactor's cached table is recomputed after its
+ * DCFactor changes in place (here, the weights of a max-mixture), even though
+ * none of the values it is evaluated at have changed.
+ */
+TEST(TestSuite, dc_discrete_factor_sees_factor_updates) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  using Mixture = dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>;
+  std::vector<Mixture> mixtures{
+      Mixture(gtsam::KeyVector{x1}, d1,
+              {gtsam::PriorFactor<double>(x1, 0.0, noise),
+               gtsam::PriorFactor<double>(x1, 2.0, noise)}),
+      Mixture(gtsam::KeyVector{x1}, d1,
+              {gtsam::PriorFactor<double>(x1, 2.0, noise),
+               gtsam::PriorFactor<double>(x1, 0.0, noise)})};
+  auto maxMixture = boost::make_shared<dcsam::DCMaxMixtureFactor<Mixture>>(
+      gtsam::KeyVector{x1}, gtsam::DiscreteKeys(d1), mixtures,
+      std::vector<double>{0.5, 0.5}, true);
+  dcsam::DCDiscreteFactor factor(maxMixture);
+
+  gtsam::Values values;
+  values.insert(x1, 0.5);
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[d1.first] = 0;
+  factor.updateContinuous(values);
+  factor.updateDiscrete(discreteVals);
+  const gtsam::DecisionTreeFactor first = factor.toDecisionTreeFactor();
+  EXPECT_EQ(factor.cacheMisses(), 1);
+
+  // Strongly favoring the second component flips the table.
+  const size_t version = maxMixture->evaluationVersion();
+  maxMixture->updateWeights({0.001, 0.999});
+  EXPECT_GT(maxMixture->evaluationVersion(), version);
+  const gtsam::DecisionTreeFactor second = factor.toDecisionTreeFactor();
+  EXPECT_EQ(factor.cacheMisses(), 2);
+  EXPECT_FALSE(second.equals(first));
+  EXPECT_TRUE(second.equals(maxMixture->toDecisionTreeFactor(
+      factor.continuousState()->values(), discreteVals)));
+
+  // With nothing else changed, the new table is reused.
+  factor.toDecisionTreeFactor();
+  EXPECT_EQ(factor.cacheMisses(), 2);
+}
+
+/**
+ * Test that log-domain (min-sum) and max-product discrete inference agree on
+ * the MAP for DCEMFactors and DCMaxMixtureFactors. Their tables mix the
+ * components differently than their errors do: here the errors tie between
+ * the two classes, while the tables favor class 0 by more than a weak prior
+ * favors class 1. The error tables for both are taken from the tables.
+ */
+TEST(TestSuite, log_domain_matches_tables) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  using Mixture = dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>;
+  std::vector<Mixture> mixtures{
+      Mixture(gtsam::KeyVector{x1}, d1,
+              {gtsam::PriorFactor<double>(x1, 0.0, noise),
+               gtsam::PriorFactor<double>(x1, 2.0, noise)}),
+      Mixture(gtsam::KeyVector{x1}, d1,
+              {gtsam::PriorFactor<double>(x1, 2.0, noise),
+               gtsam::PriorFactor<double>(x1, 0.0, noise)})};
+  std::vector<boost::shared_ptr<dcsam::DCFactor>> dcfactors{
+      boost::make_shared<dcsam::DCEMFactor<Mixture>>(
+          gtsam::KeyVector{x1}, gtsam::DiscreteKeys(d1), mixtures, true),
+      boost::make_shared<dcsam::DCMaxMixtureFactor<Mixture>>(
+          gtsam::KeyVector{x1}, gtsam::DiscreteKeys(d1), mixtures, true)};
+
+  for (const auto& dcfactor : dcfactors) {
+    EXPECT_FALSE(dcfactor->errorMatchesTable());
+    dcsam::DiscreteValues estimates[2];
+    for (const bool logDomain : {false, true}) {
+      dcsam::HybridFactorGraph hfg;
+      hfg.push_nonlinear(gtsam::PriorFactor<double>(
+          x1, 0.5, gtsam::noiseModel::Isotropic::Sigma(1, 0.01)));
+      hfg.push_discrete(dcsam::DiscretePriorFactor(d1, {0.45, 0.55}));
+      hfg.push_dc(dcfactor);
+      gtsam::Values initialGuess;
+      initialGuess.insert(x1, 0.5);
+      dcsam::DiscreteValues initialGuessDiscrete;
+      initialGuessDiscrete[d1.first] = 0;
+
+      dcsam::DCSAMParams params;
+      params.discreteLogDomain = logDomain;
+      dcsam::DCSAM dcsam(params);
+      dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+      dcsam.update();
+      estimates[logDomain] = dcsam.calculateEstimate().discrete;
+
+      // The error table is the negative log of the table.
+      for (const auto& factor : dcsam.getDiscreteFactorGraph()) {
+        auto dcDiscrete =
+            boost::dynamic_pointer_cast<dcsam::DCDiscreteFactor>(factor);
+        if (!dcDiscrete) continue;
+        const dcsam::DenseDiscreteFactor table = dcDiscrete->toDenseFactor();
+        const dcsam::DenseDiscreteFactor errors =
+            dcDiscrete->toDenseErrorFactor();
+        for (size_t i = 0; i < d1.second; i++) {
+          EXPECT_NEAR(errors.table()[i], -log(table.table()[i]), 1e-9);
+        }
+      }
+    }
+    EXPECT_EQ(estimates[0].at(d1.first), 0);
+    EXPECT_EQ(estimates[1].at(d1.first), estimates[0].at(d1.first));
+  }
+}
+
+/**
+ * Test that copy-assigning a mixture factor takes on the source's keys and
+ * components and drops the memoized evaluations of the assigned-to factor.
+ */
+TEST(TestSuite, mixture_factor_assignment) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  using Mixture = dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>;
+  Mixture near(gtsam::KeyVector{x1}, d1,
+               {gtsam::PriorFactor<double>(x1, 0.0, noise),
+                gtsam::PriorFactor<double>(x1, 1.0, noise)});
+  Mixture far(gtsam::KeyVector{x1}, d1,
+              {gtsam::PriorFactor<double>(x1, 5.0, noise),
+               gtsam::PriorFactor<double>(x1, 6.0, noise)});
+
+  gtsam::Values values;
+  values.insert(x1, 0.0);
+  dcsam::DiscreteValues discreteVals;
+  discreteVals[d1.first] = 0;
+
+  Mixture mixture = near;
+  mixture = far;
+  EXPECT_TRUE(mixture.equals(far));
+  EXPECT_DOUBLE_EQ(mixture.error(values, discreteVals),
+                   far.error(values, discreteVals));
+
+  dcsam::DCMaxMixtureFactor<Mixture> maxMixture(
+      gtsam::KeyVector{x1}, gtsam::DiscreteKeys(d1), {near, near}, true);
+  dcsam::DCMaxMixtureFactor<Mixture> farMaxMixture(
+      gtsam::KeyVector{x1}, gtsam::DiscreteKeys(d1), {far, far}, true);
+  maxMixture.error(values, discreteVals);
+  size_t version = maxMixture.evaluationVersion();
+  maxMixture = farMaxMixture;
+  EXPECT_GT(maxMixture.evaluationVersion(), version);
+  EXPECT_TRUE(maxMixture.equals(farMaxMixture));
+  EXPECT_DOUBLE_EQ(maxMixture.error(values, discreteVals),
+                   farMaxMixture.error(values, discreteVals));
+
+  dcsam::DCEMFactor<Mixture> em(gtsam::KeyVector{x1},
+                                gtsam::DiscreteKeys(d1), {near, near}, true);
+  dcsam::DCEMFactor<Mixture> farEm(gtsam::KeyVector{x1},
+                                   gtsam::DiscreteKeys(d1), {far, far}, true);
+  em.error(values, discreteVals);
+  version = em.evaluationVersion();
+  em = farEm;
+  EXPECT_GT(em.evaluationVersion(), version);
+  EXPECT_TRUE(em.equals(farEm));
+  EXPECT_DOUBLE_EQ(em.error(values, discreteVals),
+                   farEm.error(values, discreteVals));
+}
+
+/**
+ * Test the evaluations of a DCFactor over one alternation under the default
+ * parameters, where the discrete side uses probability tables and so does not
+ * evaluate the error through the memo. Once x1 has moved, iSAM2 relinearizes
+ * the DC continuous factor at the new estimate and checks its Dogleg step
+ * there: the linearization and the error at the linearization point each
+ * evaluate the factor, and the error after the (zero) step is answered from
+ * the memo.
+ */
+TEST(TestSuite, shared_evaluation_cache_alternation) {
+  gtsam::Symbol x1('x', 1);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 1.0);
+  std::vector<gtsam::PriorFactor<double>> components{
+      gtsam::PriorFactor<double>(x1, 0.0, noise),
+      gtsam::PriorFactor<double>(x1, 5.0, noise)};
+  auto dcfactor =
+      boost::make_shared<dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>>(
+          gtsam::KeyVector{x1}, d1, components);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(gtsam::PriorFactor<double>(x1, 0.0, noise));
+  hfg.push_dc(dcfactor);
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, 0.25);
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+
+  dcsam::DCSAM dcsam;
+  dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+  const size_t misses = dcfactor->evaluationCacheMisses();
+  const size_t hits = dcfactor->evaluationCacheHits();
+
+  dcsam::DCSAMUpdateResult result = dcsam.update();
+  EXPECT_EQ(result.iterations, 1);
+  EXPECT_EQ(result.dcDiscreteFactorsRefreshed, 0);
+  EXPECT_EQ(dcfactor->evaluationCacheMisses() - misses, 2);
+  EXPECT_EQ(dcfactor->evaluationCacheHits() - hits, 1);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 0);
+  EXPECT_NEAR(dcsam.calculateEstimate<double>(x1), 0.0, 1e-9);
+}
+
+/**
+ * Test that the hybrid error change can still be computed after a discrete
+ * variable is marginalized. The DC continuous factor on it keeps its last
+ * assignment, and its continuous variable keeps moving over the following
+ * (nonlinear) alternations.
+ */
+TEST(TestSuite, hybrid_error_change_after_marginalize) {
+  gtsam::noiseModel::Isotropic::shared_ptr noise =
+      gtsam::noiseModel::Isotropic::Sigma(3, 0.1);
+  gtsam::Symbol x1('x', 1), x2('x', 2);
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+
+  dcsam::DCSAMParams params;
+  params.maxIterations = 5;
+  params.stopOnNoDiscreteChange = false;
+  params.hybridErrorTol = 1e-12;
+  params.isamParams.relinearizeThreshold = 0.0;
+  params.isamParams.relinearizeSkip = 1;
+  dcsam::DCSAM dcsam(params);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_nonlinear(
+      gtsam::PriorFactor<gtsam::Pose2>(x1, gtsam::Pose2(), noise));
+  std::vector<gtsam::PriorFactor<gtsam::Pose2>> components{
+      gtsam::PriorFactor<gtsam::Pose2>(x2, gtsam::Pose2(), noise),
+      gtsam::PriorFactor<gtsam::Pose2>(x2, gtsam::Pose2(5.0, 5.0, 0.0),
+                                       noise)};
+  hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<gtsam::Pose2>>(
+      gtsam::KeyVector{x2}, d1, components));
+  hfg.push_discrete(dcsam::DiscretePriorFactor(d1, {0.7, 0.3}));
+  gtsam::Values initialGuess;
+  initialGuess.insert(x1, gtsam::Pose2());
+  initialGuess.insert(x2, gtsam::Pose2());
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+  dcsam.update(hfg, initialGuess, initialGuessDiscrete);
+
+  gtsam::KeySet discreteKeys;
+  discreteKeys.insert(d1.first);
+  dcsam.marginalize(discreteKeys);
+
+  // Pull x2 far from its linearization point, so that it keeps moving.
+  dcsam::HybridFactorGraph next;
+  next.push_nonlinear(gtsam::BetweenFactor<gtsam::Pose2>(
+      x1, x2, gtsam::Pose2(1.0, 1.0, M_PI_2), noise));
+  dcsam::DCSAMUpdateResult result;
+  EXPECT_NO_THROW(result = dcsam.update(next, gtsam::Values(),
+                                        dcsam::DiscreteValues()));
+  EXPECT_GT(result.iterations, 1);
+  EXPECT_TRUE(std::isfinite(result.hybridErrorChange));
+}
+
+/**
+ * Test that freezing looks at marginals rather than conditionals. Two
+ * variables that agree with probability 0.99 but have no other evidence each
+ * have a conditional of 0.99 given the other, yet a marginal of 0.5, so
+ * neither is frozen. Once evidence on one of them arrives, both marginals
+ * become confident and both are frozen.
+ */
+TEST(TestSuite, freeze_coupled_pair_on_marginals) {
+  gtsam::DiscreteKey d1(gtsam::Symbol('d', 1), 2);
+  gtsam::DiscreteKey d2(gtsam::Symbol('d', 2), 2);
+
+  dcsam::DCSAMParams params;
+  params.discreteFreezeThreshold = 0.9;
+  dcsam::DCSAM dcsam(params);
+
+  dcsam::HybridFactorGraph hfg;
+  hfg.push_discrete(gtsam::DecisionTreeFactor(d1 & d2, "0.99 0.01 0.01 0.99"));
+  dcsam::DiscreteValues initialGuessDiscrete;
+  initialGuessDiscrete[d1.first] = 0;
+  initialGuessDiscrete[d2.first] = 0;
+  dcsam::DCSAMUpdateResult result =
+      dcsam.update(hfg, gtsam::Values(), initialGuessDiscrete);
+  EXPECT_EQ(result.discreteVariablesFrozen, 0);
+  EXPECT_EQ(dcsam.getDiscreteFactorGraph().size(), 1);
+
+  dcsam::HybridFactorGraph next;
+  next.push_discrete(dcsam::DiscretePriorFactor(d1, {0.999, 0.001}));
+  result = dcsam.update(next);
+  EXPECT_EQ(result.discreteVariablesFrozen, 2);
+  EXPECT_EQ(dcsam.getDiscreteFactorGraph().size(), 0);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d1.first), 0);
+  EXPECT_EQ(dcsam.calculateDiscreteEstimate(d2.first), 0);
+}
+
+/**
+ * Test that marginalizing discrete variables in a DCFixedLagSmoother keeps
+ * the discrete problem bounded: the components they leave are split or
+ * dropped, and the slots of the removed factors are reused.
+ */
+TEST(TestSuite, fixed_lag_discrete_bounded) {
+  gtsam::noiseModel::Isotropic::shared_ptr odomNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.1);
+  gtsam::noiseModel::Isotropic::shared_ptr inlierNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 0.5);
+  gtsam::noiseModel::Isotropic::shared_ptr outlierNoise =
+      gtsam::noiseModel::Isotropic::Sigma(1, 50.0);
+
+  // Each mode variable m_t with an even t > 0 is coupled to m_{t-1}, so the
+  // window [t - 3, t] holds two pairs for an even t, and a pair and two lone
+  // variables for an odd t.
+  dcsam::DCFixedLagSmoother smoother(3.0);
+  const dcsam::DiscreteISAM& discrete = smoother.solver().getDiscreteSolver();
+  const size_t numSteps = 40;
+  std::vector<size_t> numComponents, numSlots;
+  for (size_t t = 0; t < numSteps; t++) {
+    gtsam::Symbol xt('x', t);
+    gtsam::DiscreteKey mt(gtsam::Symbol('m', t), 2);
+
+    dcsam::HybridFactorGraph hfg;
+    if (t == 0) {
+      hfg.push_nonlinear(gtsam::PriorFactor<double>(xt, 0.0, odomNoise));
+    } else {
+      hfg.push_nonlinear(gtsam::BetweenFactor<double>(
+          gtsam::Symbol('x', t - 1), xt, 1.0, odomNoise));
+    }
+    std::vector<gtsam::PriorFactor<double>> components{
+        gtsam::PriorFactor<double>(xt, t, inlierNoise),
+        gtsam::PriorFactor<double>(xt, t, outlierNoise)};
+    hfg.push_dc(dcsam::DCMixtureFactor<gtsam::PriorFactor<double>>(
+        gtsam::KeyVector{xt}, mt, components));
+    hfg.push_discrete(dcsam::DiscretePriorFactor(mt, {0.9, 0.1}));
+    if (t > 0 && t % 2 == 0) {
+      gtsam::DiscreteKey previous(gtsam::Symbol('m', t - 1), 2);
+      hfg.push_discrete(
+          gtsam::DecisionTreeFactor(previous & mt, "0.8 0.2 0.2 0.8"));
+    }
+
+    gtsam::Values initialGuess;
+    initialGuess.insert(xt, static_cast<double>(t));
+    dcsam::DiscreteValues initialGuessDiscrete;
+    initialGuessDiscrete[mt.first] = 0;
+    dcsam::DCFixedLagSmoother::KeyTimestampMap timestamps;
+    timestamps[xt] = t;
+    timestamps[mt.first] = t;
+    smoother.update(hfg, initialGuess, initialGuessDiscrete, timestamps);
+
+    // Bring the discrete solver up to date with the marginalization.
+    smoother.solver().update();
+    numComponents.push_back(discrete.numComponents());
+    numSlots.push_back(discrete.getFactorsUnsafe().size());
+  }
+
+  EXPECT_EQ(discrete.size(), 4);
+  for (size_t t = 8; t < numSteps; t++) {
+    EXPECT_EQ(numComponents[t], (t % 2 == 0) ? 2 : 3);
+    EXPECT_EQ(numSlots[t], numSlots[t - 2]);
+  }
+  dcsam::DCValues window = smoother.calculateEstimate();
+  EXPECT_EQ(window.discrete.size(), 4);
+  EXPECT_EQ(smoother.solver().getDiscreteFactorGraph().size(),
+            discrete.getFactorsUnsafe().nrFactors());
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();